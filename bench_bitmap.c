@@ -0,0 +1,122 @@
+/* Scaling benchmark of the lock-free bitmap heap.
+ *
+ * 1 to 8 threads each allocate and release runs of 1 to 4 blocks, keeping a
+ * few of them live, once on the bitmap heap and once on the heap of the
+ * segment with memory_allocate and memory_release. The total number of
+ * allocations per second is reported as CSV on stdout.
+ *
+ * memory.c is included, as for the other benchmarks; the Makefile gives the
+ * bitmap heap as many blocks as the heap of the segment.
+ */
+#include "memory.c"
+
+/* Number of allocations per thread */
+#define OPERATIONS  200000
+
+/* Number of allocations that a thread keeps live */
+#define LIVE  8
+
+/* The functions under test */
+struct backend
+{
+  const char *name;
+  void (*initialize)(void);
+  void *(*allocate)(uint32_t size);
+  bool (*release)(void *ptr);
+};
+
+static const struct backend *backend;
+
+/* Allocates and releases OPERATIONS times. Returns the number of
+ * allocations that failed.
+ */
+static void *churn_in_thread(void *arg)
+{
+  uint32_t random = (uint32_t) (uintptr_t) arg * 2654435761u + 1;
+  void *live[LIVE] = { NULL };
+  uintptr_t failures = 0;
+
+  for (int i = 0; i < OPERATIONS; i++)
+  {
+    random = random * 1103515245 + 12345;
+    void **slot = &(live[i % LIVE]);
+    if (*slot != NULL)
+    {
+      backend->release(*slot);
+    }
+    *slot = backend->allocate((1 + (random >> 16) % 4) * BLOCK_SIZE);
+    failures += (*slot == NULL);
+  }
+
+  for (int i = 0; i < LIVE; i++)
+  {
+    if (live[i] != NULL)
+    {
+      backend->release(live[i]);
+    }
+  }
+
+  return (void *) failures;
+}
+
+/* Returns the current time in nanoseconds. */
+static uint64_t now(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t) time.tv_sec * 1000000000 + (uint64_t) time.tv_nsec;
+}
+
+/* Runs churn_in_thread in the given number of threads and prints a CSV
+ * line.
+ */
+static void measure(const struct backend *measured, int thread_count)
+{
+  pthread_t threads[8];
+  uintptr_t failures = 0;
+
+  backend = measured;
+  backend->initialize();
+
+  uint64_t start = now();
+  for (int t = 0; t < thread_count; t++)
+  {
+    pthread_create(&(threads[t]), NULL, churn_in_thread,
+                   (void *) (uintptr_t) (t + 1));
+  }
+  for (int t = 0; t < thread_count; t++)
+  {
+    void *result;
+    pthread_join(threads[t], &result);
+    failures += (uintptr_t) result;
+  }
+  double seconds = (double) (now() - start) / 1e9;
+
+  printf("%s,%d,%.0f,%lu\n", backend->name, thread_count,
+         (double) OPERATIONS * thread_count / seconds,
+         (unsigned long) failures);
+}
+
+int main(void)
+{
+  static const struct backend backends[] =
+  {
+    { "bitmap", memory_bitmap_initialize, memory_bitmap_allocate,
+      memory_bitmap_release },
+    { "locked", memory_initialize, memory_allocate, memory_release }
+  };
+  static const int thread_counts[] = { 1, 2, 4, 8 };
+
+  printf("backend,threads,allocations_per_s,failures\n");
+
+  for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+  {
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]);
+         t++)
+    {
+      measure(&(backends[b]), thread_counts[t]);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,196 @@
+/* Benchmarks of standard containers on the block heap.
+ *
+ * Every workload runs once with its nodes in the block heap, through
+ * memory_block_resource, and once with the default resource, which uses
+ * operator new. Per element, the benchmark reports the time as CSV on
+ * stdout.
+ *
+ * The Makefile links this with memory.c compiled with the heap of the other
+ * benchmarks, which is large enough for the largest workload.
+ */
+#include <cstdio>
+#include <ctime>
+#include <list>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#include "memory.hpp"
+
+/* Number of times that a workload is repeated */
+#define ROUNDS  200
+
+/* Returns the current time in nanoseconds. */
+static uint64_t now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t) time.tv_sec * 1000000000 + (uint64_t) time.tv_nsec;
+}
+
+/* Grows a vector one element at a time, so it is reallocated at every
+ * doubling, and sums it.
+ */
+static uint64_t vector_workload(std::pmr::memory_resource *resource,
+                                uint32_t elements)
+{
+  std::pmr::vector<uint32_t> vector(resource);
+  for (uint32_t i = 0; i < elements; i++)
+  {
+    vector.push_back(i);
+  }
+
+  uint64_t sum = 0;
+  for (uint32_t value : vector)
+  {
+    sum += value;
+  }
+  return sum;
+}
+
+/* Fills a list, erases every other node and fills the holes again, so the
+ * nodes of the list are no longer allocated in order, and walks it.
+ */
+template <typename List>
+static uint64_t list_churn(List &list, uint32_t elements)
+{
+  for (uint32_t i = 0; i < elements; i++)
+  {
+    list.push_back(i);
+  }
+
+  bool erase = true;
+  for (auto it = list.begin(); it != list.end(); erase = !erase)
+  {
+    it = erase ? list.erase(it) : std::next(it);
+  }
+  for (uint32_t i = 0; i < elements / 2; i++)
+  {
+    list.push_front(i);
+  }
+
+  uint64_t sum = 0;
+  for (uint32_t value : list)
+  {
+    sum += value;
+  }
+  return sum;
+}
+
+static uint64_t list_workload(std::pmr::memory_resource *resource,
+                              uint32_t elements)
+{
+  std::pmr::list<uint32_t> list(resource);
+  return list_churn(list, elements);
+}
+
+/* The same, with memory_block_allocator instead of a pmr list; it is only
+ * run on a memory_block_resource.
+ */
+static uint64_t allocator_list_workload(std::pmr::memory_resource *resource,
+                                        uint32_t elements)
+{
+  memory_block_allocator<uint32_t> allocator(
+    static_cast<memory_block_resource *>(resource));
+  std::list<uint32_t, memory_block_allocator<uint32_t>> list(allocator);
+  return list_churn(list, elements);
+}
+
+/* Inserts keys in a hash map, looks each of them up and erases them again.
+ */
+static uint64_t unordered_map_workload(std::pmr::memory_resource *resource,
+                                       uint32_t elements)
+{
+  std::pmr::unordered_map<uint32_t, uint32_t> map(resource);
+  for (uint32_t i = 0; i < elements; i++)
+  {
+    map.emplace(i * 2654435761u, i);
+  }
+
+  uint64_t sum = 0;
+  for (uint32_t i = 0; i < elements; i++)
+  {
+    sum += map.find(i * 2654435761u)->second;
+  }
+  for (uint32_t i = 0; i < elements; i++)
+  {
+    map.erase(i * 2654435761u);
+  }
+  return sum;
+}
+
+/* A workload and its name */
+struct workload
+{
+  const char *container;
+  uint64_t (*run)(std::pmr::memory_resource *resource, uint32_t elements);
+};
+
+/* Runs a workload ROUNDS times on the given resource and prints the time
+ * per element as a CSV line. The heap is initialized anew first, so every
+ * workload starts from the same heap.
+ */
+static void workload_measure(const struct workload *workload,
+                             const char *name,
+                             std::pmr::memory_resource *resource,
+                             uint32_t elements)
+{
+  memory_initialize();
+  volatile uint64_t sink = 0;
+
+  uint64_t start = now();
+  try
+  {
+    for (int i = 0; i < ROUNDS; i++)
+    {
+      sink += workload->run(resource, elements);
+    }
+  }
+  catch (const std::bad_alloc &)
+  {
+    printf("%s,%s,%u,%d,\n", workload->container, name, elements, ROUNDS);
+    return;
+  }
+  uint64_t nanoseconds = now() - start;
+  (void) sink;
+
+  printf("%s,%s,%u,%d,%.2f\n", workload->container, name, elements, ROUNDS,
+         (double) nanoseconds / ((double) ROUNDS * elements));
+}
+
+int main()
+{
+  static const struct workload workloads[] =
+  {
+    { "vector", vector_workload },
+    { "list", list_workload },
+    { "unordered_map", unordered_map_workload }
+  };
+  static const uint32_t lengths[] = { 64, 512, 4096 };
+
+  memory_block_resource block_resource;
+
+  printf("container,resource,elements,rounds,ns\n");
+
+  for (const struct workload &workload : workloads)
+  {
+    for (uint32_t elements : lengths)
+    {
+      workload_measure(&workload, "block", &block_resource, elements);
+      workload_measure(&workload, "default",
+                       std::pmr::get_default_resource(), elements);
+    }
+  }
+
+  static const struct workload allocator_list =
+  {
+    "list", allocator_list_workload
+  };
+  for (uint32_t elements : lengths)
+  {
+    workload_measure(&allocator_list, "block_allocator", &block_resource,
+                     elements);
+  }
+
+  return 0;
+}
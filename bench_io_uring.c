@@ -0,0 +1,238 @@
+/* Benchmark of io_uring file I/O into buffers of the heap, with and without
+ * memory_io_register.
+ *
+ * A temporary file is read and written in chunks of CHUNK bytes, DEPTH
+ * operations at a time, with READ and WRITE on unregistered buffers, which
+ * the kernel pins and unpins for every operation, and with READ_FIXED and
+ * WRITE_FIXED on the registered heap. The throughput of each is reported
+ * as CSV on stdout. The file stays in the page cache, so the cost of the
+ * I/O itself is mostly that of copying and pinning.
+ *
+ * The ring is set up with the raw system calls, without liburing. This
+ * uses only the public API of memory.h, since <linux/io_uring.h> has a
+ * BLOCK_SIZE of its own.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "memory.h"
+
+/* The size of one operation and the number of operations in flight */
+#define CHUNK  16384
+#define DEPTH  8
+
+/* The size of the file and the number of times it is read or written */
+#define FILE_SIZE  (16 * 1024 * 1024)
+#define ROUNDS     16
+
+/* A ring of io_uring, mapped from the kernel */
+struct ring
+{
+  int fd;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+};
+
+/* Sets up a ring of DEPTH entries.
+ *
+ * Returns false when the kernel does not allow io_uring.
+ */
+static bool ring_open(struct ring *ring)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = (int) syscall(SYS_io_uring_setup, DEPTH, &params);
+  if (ring->fd < 0)
+  {
+    return false;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes
+                 + params.cq_entries * sizeof(struct io_uring_cqe);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+  {
+    sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+  }
+
+  uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  uint8_t *cq = sq;
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0)
+  {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if ((sq == MAP_FAILED) || (cq == MAP_FAILED) || (ring->sqes == MAP_FAILED))
+  {
+    close(ring->fd);
+    return false;
+  }
+
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  return true;
+}
+
+/* Queues one operation on the file, for count bytes at its offset, with the
+ * given buffer. A buffer index of -1 means an unregistered buffer.
+ */
+static void ring_queue(struct ring *ring, uint8_t opcode, int file,
+                       void *buffer, uint32_t count, uint64_t offset,
+                       int buf_index)
+{
+  unsigned tail = *(ring->sq_tail);
+  unsigned index = tail & *(ring->sq_mask);
+  struct io_uring_sqe *sqe = &(ring->sqes[index]);
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = file;
+  sqe->addr = (uint64_t) (uintptr_t) buffer;
+  sqe->len = count;
+  sqe->off = offset;
+  if (buf_index >= 0)
+  {
+    sqe->buf_index = (uint16_t) buf_index;
+  }
+
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Submits count queued operations and waits for all of them.
+ *
+ * Returns false when one of them did not transfer a whole chunk.
+ */
+static bool ring_complete(struct ring *ring, unsigned count)
+{
+  if (syscall(SYS_io_uring_enter, ring->fd, count, count,
+              IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+  {
+    return false;
+  }
+
+  bool ok = true;
+  unsigned head = *(ring->cq_head);
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+  {
+    ok = ok && (ring->cqes[head & *(ring->cq_mask)].res == CHUNK);
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+  return ok;
+}
+
+/* Returns the current time in nanoseconds. */
+static uint64_t now(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t) time.tv_sec * 1000000000 + (uint64_t) time.tv_nsec;
+}
+
+/* Reads or writes the whole file ROUNDS times through the buffers, and
+ * prints the throughput as a CSV line.
+ */
+static void measure(struct ring *ring, int file, const char *name,
+                    uint8_t opcode, bool fixed, uint8_t *buffers[DEPTH])
+{
+  bool ok = true;
+  uint64_t start = now();
+
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    for (uint64_t offset = 0; ok && (offset < FILE_SIZE);
+         offset += CHUNK * DEPTH)
+    {
+      for (int i = 0; i < DEPTH; i++)
+      {
+        int buf_index = fixed ? memory_io_buffer(buffers[i], CHUNK, NULL) : -1;
+        ring_queue(ring, opcode, file, buffers[i], CHUNK,
+                   offset + (uint64_t) i * CHUNK, buf_index);
+      }
+      ok = ring_complete(ring, DEPTH);
+    }
+  }
+
+  double seconds = (double) (now() - start) / 1e9;
+  if (ok)
+  {
+    printf("%s,%d,%d,%.1f\n", name, CHUNK, DEPTH,
+           (double) FILE_SIZE * ROUNDS / seconds / (1024 * 1024));
+  }
+  else
+  {
+    printf("%s,%d,%d,\n", name, CHUNK, DEPTH);
+  }
+}
+
+int main(void)
+{
+  struct ring ring;
+  if (!ring_open(&ring))
+  {
+    fprintf(stderr, "io_uring unavailable\n");
+    return EXIT_SUCCESS;
+  }
+
+  char path[] = "/tmp/bench_io_uring.XXXXXX";
+  int file = mkstemp(path);
+  if ((file < 0) || (ftruncate(file, FILE_SIZE) != 0))
+  {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  unlink(path);
+
+  memory_initialize();
+  uint8_t *buffers[DEPTH];
+  for (int i = 0; i < DEPTH; i++)
+  {
+    buffers[i] = memory_allocate(CHUNK);
+    memset(buffers[i], 'a' + i, CHUNK);
+  }
+
+  printf("operation,chunk,depth,mib_per_s\n");
+
+  measure(&ring, file, "write", IORING_OP_WRITE, false, buffers);
+  measure(&ring, file, "read", IORING_OP_READ, false, buffers);
+
+  if (!memory_io_register(ring.fd))
+  {
+    perror("memory_io_register");
+    return EXIT_FAILURE;
+  }
+  measure(&ring, file, "write_fixed", IORING_OP_WRITE_FIXED, true, buffers);
+  measure(&ring, file, "read_fixed", IORING_OP_READ_FIXED, true, buffers);
+  memory_io_unregister(ring.fd);
+
+  close(file);
+  close(ring.fd);
+
+  return EXIT_SUCCESS;
+}
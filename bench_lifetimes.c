@@ -0,0 +1,137 @@
+/* Benchmark of lifetime-hinted allocation against fragmentation.
+ *
+ * A long trace mixes short-lived allocations, which are made in bursts, as
+ * for a request, and all released at the end of their burst, with
+ * long-lived ones, which stay until they are replaced at random. The trace
+ * runs once with memory_allocate for everything and once with
+ * memory_allocate_hint. At regular steps the
+ * benchmark reports the largest free run and the external fragmentation,
+ * the part of the free memory outside that run, as CSV on stdout.
+ *
+ * memory.c is included, so the free list can be inspected directly.
+ */
+#include "memory.c"
+
+/* Number of allocations in the trace */
+#define STEPS  204800
+
+/* Number of steps between two reports, a multiple of BURST */
+#define REPORT  10240
+
+/* Number of allocations in a burst, and of live long-lived allocations */
+#define BURST      256
+#define LONG_LIVE  1024
+
+/* One in LONG_ONE_IN allocations is long-lived */
+#define LONG_ONE_IN  16
+
+/* Returns the next number of a xorshift generator. */
+static uint32_t trace_random(uint32_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+/* Returns the length of the largest run of free blocks, counting the
+ * wilderness, and sets free to the number of free blocks.
+ */
+static uint32_t largest_free_run(uint32_t *free)
+{
+  memory_flush_thread_cache();
+  segment_lock();
+  cpu_caches_flush_locked();
+
+  uint32_t largest = 0;
+  uint32_t run_length = 0;
+  *free = 0;
+
+  for (uint32_t i = 0; i < NUMBER_OF_BLOCKS; i++)
+  {
+    run_length = block_is_free(i) ? run_length + 1 : 0;
+    *free += (run_length > 0) ? 1 : 0;
+    if (run_length > largest)
+    {
+      largest = run_length;
+    }
+  }
+
+  segment_unlock();
+  return largest;
+}
+
+/* Runs the trace, with lifetime hints or without, and prints a CSV line
+ * every REPORT steps.
+ */
+static void trace_run(bool hinted)
+{
+  static void *short_live[BURST];
+  static void *long_live[LONG_LIVE];
+  uint32_t state = 2463534242u;
+  uint32_t failures = 0;
+
+  memory_initialize();
+  memset(short_live, 0, sizeof(short_live));
+  memset(long_live, 0, sizeof(long_live));
+
+  for (uint32_t step = 1; step <= STEPS; step++)
+  {
+    uint32_t r = trace_random(&state);
+    void **slot;
+    uint32_t size;
+    int lifetime;
+
+    if ((r % LONG_ONE_IN) == 0)
+    {
+      slot = &(long_live[(r >> 8) % LONG_LIVE]);
+      size = (1 + (r >> 20) % 4) * BLOCK_SIZE - 1;
+      lifetime = MEMORY_LIFETIME_LONG;
+    }
+    else
+    {
+      slot = &(short_live[step % BURST]);
+      size = (1 + (r >> 20) % 8) * BLOCK_SIZE - 1;
+      lifetime = MEMORY_LIFETIME_SHORT;
+    }
+
+    if (*slot != NULL)
+    {
+      memory_release(*slot);
+    }
+    *slot = hinted ? memory_allocate_hint(size, lifetime)
+                   : memory_allocate(size);
+    failures += (*slot == NULL);
+
+    /* The end of a burst */
+    if ((step % BURST) == 0)
+    {
+      for (int i = 0; i < BURST; i++)
+      {
+        if (short_live[i] != NULL)
+        {
+          memory_release(short_live[i]);
+          short_live[i] = NULL;
+        }
+      }
+    }
+
+    if ((step % REPORT) == 0)
+    {
+      uint32_t free;
+      uint32_t largest = largest_free_run(&free);
+      printf("%s,%u,%u,%u,%.4f,%u\n", hinted ? "hinted" : "unhinted", step,
+             free, largest,
+             (free == 0) ? 0.0 : 1.0 - (double) largest / free, failures);
+    }
+  }
+}
+
+int main(void)
+{
+  printf("mode,step,free_blocks,largest_free_run,fragmentation,failures\n");
+  trace_run(false);
+  trace_run(true);
+
+  return 0;
+}
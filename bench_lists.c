@@ -0,0 +1,255 @@
+/* Microbenchmarks of the list primitives of memory.c.
+ *
+ * Every primitive runs over lists of a range of lengths and shapes: a list
+ * is built from runs of contiguous blocks with a gap of one block between
+ * runs, so a shorter run means a more fragmented list. Per call, the
+ * benchmark reports the time and, when perf_event_open gives access to
+ * them, cycles, instructions, cache misses and branch misses, as CSV on
+ * stdout. list_remove_chain and list_insert_chain are measured as pairs of
+ * calls that take the block in the middle out and put it back.
+ *
+ * memory.c is included, so its static primitives can be called directly.
+ * The Makefile compiles this with a heap large enough for the longest list.
+ */
+#include "memory.c"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+/* Number of calls that are measured together */
+#define REPETITIONS  2000
+
+/* The hardware counters that are read, in this order */
+#define COUNTERS  4
+
+static const uint64_t counter_configs[COUNTERS] =
+{
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES,
+  PERF_COUNT_HW_BRANCH_MISSES
+};
+
+/* The file descriptor of the group leader, or -1 without counters */
+static int counter_group = -1;
+
+/* A list of the shape that is measured, and the block in its middle. */
+struct shape
+{
+  struct list list;
+  struct block *middle;
+  uint32_t length;
+  uint32_t run;
+};
+
+/* A measurement of REPETITIONS calls. */
+struct sample
+{
+  uint64_t nanoseconds;
+  uint64_t counters[COUNTERS];
+};
+
+/* Opens the hardware counters as one group for the calling thread.
+ *
+ * Returns false when the kernel, or the permissions, do not allow it.
+ */
+static bool counters_open(void)
+{
+  for (int i = 0; i < COUNTERS; i++)
+  {
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.config = counter_configs[i];
+    attributes.disabled = (i == 0);
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    attributes.read_format = PERF_FORMAT_GROUP;
+
+    int fd = (int) syscall(SYS_perf_event_open, &attributes, 0, -1,
+                           counter_group, 0);
+    if (fd < 0)
+    {
+      if (counter_group >= 0)
+      {
+        close(counter_group);
+        counter_group = -1;
+      }
+      return false;
+    }
+
+    if (i == 0)
+    {
+      counter_group = fd;
+    }
+  }
+
+  return true;
+}
+
+/* Returns the current time in nanoseconds. */
+static uint64_t now(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t) time.tv_sec * 1000000000 + (uint64_t) time.tv_nsec;
+}
+
+/* Starts a measurement. */
+static void sample_start(struct sample *sample)
+{
+  if (counter_group >= 0)
+  {
+    ioctl(counter_group, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(counter_group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+  sample->nanoseconds = now();
+}
+
+/* Ends a measurement. */
+static void sample_stop(struct sample *sample)
+{
+  sample->nanoseconds = now() - sample->nanoseconds;
+
+  if (counter_group >= 0)
+  {
+    ioctl(counter_group, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    uint64_t values[1 + COUNTERS];
+    if (read(counter_group, values, sizeof(values)) == sizeof(values))
+    {
+      memcpy(sample->counters, &(values[1]), sizeof(sample->counters));
+    }
+  }
+}
+
+/* Returns a total as an average per call. */
+static double per_call(uint64_t total)
+{
+  return (double) total / REPETITIONS;
+}
+
+/* Prints a measurement as a CSV line, per call. */
+static void sample_print(const char *primitive, const struct shape *shape,
+                         const struct sample *sample)
+{
+  printf("%s,%u,%u,%d,%.2f", primitive, shape->length, shape->run,
+         REPETITIONS, per_call(sample->nanoseconds));
+  for (int i = 0; i < COUNTERS; i++)
+  {
+    if (counter_group >= 0)
+    {
+      printf(",%.2f", per_call(sample->counters[i]));
+    }
+    else
+    {
+      printf(",");
+    }
+  }
+  printf("\n");
+}
+
+/* Builds a list of length blocks in runs of run contiguous blocks, with one
+ * block left out between two runs.
+ */
+static void shape_build(struct shape *shape, uint32_t length, uint32_t run)
+{
+  list_init(&(shape->list));
+  shape->length = length;
+  shape->run = run;
+
+  uint32_t index = 0;
+  for (uint32_t i = 0; i < length; i++)
+  {
+    if ((i > 0) && ((i % run) == 0))
+    {
+      index++;
+    }
+    struct block *block = &(pool_of_blocks[index]);
+    block->address = &(heap[index * BLOCK_SIZE]);
+    block->alloc_count = 0;
+    list_append_block(&(shape->list), block);
+    index++;
+
+    if (i == length / 2)
+    {
+      shape->middle = block;
+    }
+  }
+}
+
+/* Measures every primitive on the given shape. */
+static void shape_measure(struct shape *shape)
+{
+  struct sample sample = { 0 };
+  volatile uintptr_t sink = 0;
+
+  /* Looking up the address in the middle of the list */
+  sample_start(&sample);
+  for (int i = 0; i < REPETITIONS; i++)
+  {
+    sink += (uintptr_t) list_find_block_by_address(&(shape->list),
+                                                   shape->middle->address);
+  }
+  sample_stop(&sample);
+  sample_print("list_find_block_by_address", shape, &sample);
+
+  /* Checking the whole list, which stops at the first gap */
+  sample_start(&sample);
+  for (int i = 0; i < REPETITIONS; i++)
+  {
+    sink += has_number_of_contiguous_blocks(shape->list.first,
+                                            shape->length);
+  }
+  sample_stop(&sample);
+  sample_print("has_number_of_contiguous_blocks", shape, &sample);
+
+  /* Taking the block in the middle out and putting it back. A single call
+   * of list_remove_chain takes less than the resolution of the clock, so
+   * the pairs are measured together, like the other primitives */
+  sample_start(&sample);
+  for (int i = 0; i < REPETITIONS; i++)
+  {
+    sink += list_remove_chain(&(shape->list), shape->middle, 1);
+    list_insert_chain(&(shape->list), shape->middle);
+  }
+  sample_stop(&sample);
+  sample_print("list_remove_chain+list_insert_chain", shape, &sample);
+
+  (void) sink;
+}
+
+int main(void)
+{
+  static const uint32_t lengths[] = { 16, 64, 256, 1024, 4096 };
+  static const uint32_t runs[] = { 4096, 16, 4, 1 };
+
+  if (!counters_open())
+  {
+    fprintf(stderr, "hardware counters unavailable, timing only\n");
+  }
+
+  printf("primitive,length,run,repetitions,ns,cycles,instructions,"
+         "cache_misses,branch_misses\n");
+
+  struct shape shape;
+  for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+  {
+    for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++)
+    {
+      if (lengths[l] + lengths[l] / runs[r] > NUMBER_OF_BLOCKS)
+      {
+        fprintf(stderr, "a list of %u blocks in runs of %u does not fit in "
+                "a heap of %u blocks\n", lengths[l], runs[r],
+                (unsigned) NUMBER_OF_BLOCKS);
+        return EXIT_FAILURE;
+      }
+      shape_build(&shape, lengths[l], runs[r]);
+      shape_measure(&shape);
+    }
+  }
+
+  return 0;
+}
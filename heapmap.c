@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+
+/* Number of blocks per line of an occupancy map */
+#define MAP_WIDTH  64
+
+/* A heap snapshot read back from a file written by memory_snapshot_write. */
+struct snapshot
+{
+  struct memory_snapshot_header header;
+  uint8_t *states;
+  uint32_t *alloc_counts;
+  uint32_t *runs;
+};
+
+/* Fragmentation metrics of a snapshot, in blocks. */
+struct metrics
+{
+  uint32_t used;
+  uint32_t cached;
+  uint32_t free;
+  uint32_t wilderness;
+  uint32_t allocations;
+  uint32_t runs;
+  uint32_t largest_run;
+};
+
+/* Reads the snapshot in the file with the given name.
+ *
+ * Returns false, after printing why, when the file can not be read or is
+ * not a snapshot.
+ */
+static bool snapshot_read(const char *path, struct snapshot *snapshot)
+{
+  FILE *in = fopen(path, "rb");
+  if (in == NULL)
+  {
+    perror(path);
+    return false;
+  }
+
+  struct memory_snapshot_header *header = &(snapshot->header);
+  bool ok = (   (fread(header, sizeof(*header), 1, in) == 1)
+             && (header->magic == MEMORY_SNAPSHOT_MAGIC)
+             && (header->version == MEMORY_SNAPSHOT_VERSION)
+             && (header->wilderness <= header->blocks)
+             && (header->runs <= header->blocks));
+
+  if (ok)
+  {
+    snapshot->states = malloc(header->blocks);
+    snapshot->alloc_counts = malloc(header->blocks * sizeof(uint32_t));
+    snapshot->runs = malloc((header->runs + 1) * 2 * sizeof(uint32_t));
+    ok = (   (snapshot->states != NULL)
+          && (snapshot->alloc_counts != NULL)
+          && (snapshot->runs != NULL)
+          && (fread(snapshot->states, 1, header->blocks, in)
+              == header->blocks)
+          && (fread(snapshot->alloc_counts, sizeof(uint32_t), header->blocks,
+                    in) == header->blocks)
+          && (fread(snapshot->runs, 2 * sizeof(uint32_t), header->runs, in)
+              == header->runs));
+  }
+
+  if (!ok)
+  {
+    fprintf(stderr, "%s: not a heap snapshot\n", path);
+  }
+
+  fclose(in);
+  return ok;
+}
+
+/* Computes the fragmentation metrics of the given snapshot. The free runs
+ * that border the wilderness, below its start or above its end, count as
+ * one run together with it, since an allocation can use all of them.
+ */
+static void snapshot_measure(const struct snapshot *snapshot,
+                             struct metrics         *metrics)
+{
+  const struct memory_snapshot_header *header = &(snapshot->header);
+  memset(metrics, 0, sizeof(*metrics));
+
+  for (uint32_t i = 0; i < header->blocks; i++)
+  {
+    switch (snapshot->states[i] & MEMORY_SNAPSHOT_STATE)
+    {
+      case MEMORY_SNAPSHOT_HEAD:
+        metrics->allocations++;
+        metrics->used += snapshot->alloc_counts[i];
+        break;
+      case MEMORY_SNAPSHOT_CACHED:
+        metrics->cached += snapshot->alloc_counts[i];
+        break;
+      case MEMORY_SNAPSHOT_FREE:
+        metrics->free++;
+        break;
+      case MEMORY_SNAPSHOT_WILDERNESS:
+        metrics->wilderness++;
+        break;
+    }
+  }
+
+  /* The wilderness, with the runs it joins */
+  uint32_t wilderness_end = header->wilderness + metrics->wilderness;
+  uint32_t joined = metrics->wilderness;
+
+  metrics->runs = header->runs;
+  for (uint32_t r = 0; r < header->runs; r++)
+  {
+    uint32_t start = snapshot->runs[2*r];
+    uint32_t length = snapshot->runs[2*r + 1];
+    if (   (metrics->wilderness > 0)
+        && (   (start + length == header->wilderness)
+            || (start == wilderness_end)))
+    {
+      joined += length;
+      metrics->runs--;
+    }
+    else if (length > metrics->largest_run)
+    {
+      metrics->largest_run = length;
+    }
+  }
+
+  if (metrics->wilderness > 0)
+  {
+    metrics->runs++;
+    if (joined > metrics->largest_run)
+    {
+      metrics->largest_run = joined;
+    }
+  }
+}
+
+/* Returns the external fragmentation: the part of the free memory that is
+ * not in the largest free run, between 0 and 1.
+ */
+static double metrics_fragmentation(const struct metrics *metrics)
+{
+  uint32_t free = metrics->free + metrics->wilderness;
+  return (free == 0) ? 0.0 : 1.0 - (double) metrics->largest_run / free;
+}
+
+/* Prints the metrics of a snapshot, in blocks and in bytes. */
+static void metrics_print(const char *title, const struct metrics *metrics,
+                          uint32_t block_size)
+{
+  printf("%s\n", title);
+  printf("  used:           %6u blocks %8u bytes in %u allocations\n",
+         metrics->used, metrics->used * block_size, metrics->allocations);
+  printf("  cached:         %6u blocks %8u bytes\n",
+         metrics->cached, metrics->cached * block_size);
+  printf("  free:           %6u blocks %8u bytes in %u runs\n",
+         metrics->free + metrics->wilderness,
+         (metrics->free + metrics->wilderness) * block_size, metrics->runs);
+  printf("  wilderness:     %6u blocks\n", metrics->wilderness);
+  printf("  largest run:    %6u blocks %8u bytes\n",
+         metrics->largest_run, metrics->largest_run * block_size);
+  printf("  mean run:       %9.2f blocks\n",
+         (metrics->runs == 0)
+         ? 0.0
+         : (double) (metrics->free + metrics->wilderness) / metrics->runs);
+  printf("  mean allocation:%9.2f blocks\n",
+         (metrics->allocations == 0)
+         ? 0.0
+         : (double) metrics->used / metrics->allocations);
+  printf("  fragmentation:  %9.2f %%\n", 100.0 * metrics_fragmentation(metrics));
+}
+
+/* Returns the character that shows the state of a block in a map. */
+static char state_symbol(uint8_t state)
+{
+  switch (state & MEMORY_SNAPSHOT_STATE)
+  {
+    case MEMORY_SNAPSHOT_HEAD:
+      return ((state & MEMORY_SNAPSHOT_MOVABLE) != 0) ? 'm' : '#';
+    case MEMORY_SNAPSHOT_BODY:
+      return '=';
+    case MEMORY_SNAPSHOT_CACHED:
+      return 'c';
+    case MEMORY_SNAPSHOT_FREE:
+      return '.';
+    default:
+      return '_';
+  }
+}
+
+/* Prints the occupancy map of a snapshot, MAP_WIDTH blocks per line. */
+static void snapshot_print_map(const struct snapshot *snapshot)
+{
+  printf("map (# allocation, m movable, = its other blocks, c cached,\n"
+         "     . free, _ wilderness):\n");
+  for (uint32_t i = 0; i < snapshot->header.blocks; i++)
+  {
+    if ((i % MAP_WIDTH) == 0)
+    {
+      printf("  %6u ", i);
+    }
+    putchar(state_symbol(snapshot->states[i]));
+    if (((i + 1) % MAP_WIDTH == 0) || (i + 1 == snapshot->header.blocks))
+    {
+      putchar('\n');
+    }
+  }
+}
+
+/* Prints how the blocks changed from the older snapshot to the newer one:
+ * + became used, - became free, * belongs to another allocation than before,
+ * space unchanged.
+ */
+static void snapshot_print_diff(const struct snapshot *older,
+                                const struct snapshot *newer)
+{
+  printf("changes (+ now used, - now free, * other allocation):\n");
+  for (uint32_t i = 0; i < newer->header.blocks; i++)
+  {
+    uint8_t before = older->states[i] & MEMORY_SNAPSHOT_STATE;
+    uint8_t after = newer->states[i] & MEMORY_SNAPSHOT_STATE;
+    bool used_before = (   (before == MEMORY_SNAPSHOT_HEAD)
+                        || (before == MEMORY_SNAPSHOT_BODY));
+    bool used_after = (   (after == MEMORY_SNAPSHOT_HEAD)
+                       || (after == MEMORY_SNAPSHOT_BODY));
+
+    char symbol = ' ';
+    if (used_after && !used_before)
+    {
+      symbol = '+';
+    }
+    else if (used_before && !used_after)
+    {
+      symbol = '-';
+    }
+    else if (   used_after
+             && (   (before != after)
+                 || (older->alloc_counts[i] != newer->alloc_counts[i])))
+    {
+      symbol = '*';
+    }
+
+    if ((i % MAP_WIDTH) == 0)
+    {
+      printf("  %6u ", i);
+    }
+    putchar(symbol);
+    if (((i + 1) % MAP_WIDTH == 0) || (i + 1 == newer->header.blocks))
+    {
+      putchar('\n');
+    }
+  }
+}
+
+/* Analyzes a heap snapshot written by memory_snapshot_write: prints its
+ * fragmentation metrics and its occupancy map. Given a second, newer
+ * snapshot of the same heap, it prints the metrics of both and the blocks
+ * that changed in between.
+ */
+int main(int argc, char *argv[])
+{
+  if ((argc != 2) && (argc != 3))
+  {
+    fprintf(stderr, "usage: %s SNAPSHOT [NEWER_SNAPSHOT]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  struct snapshot snapshots[2];
+  struct metrics metrics[2];
+  for (int i = 0; i < argc - 1; i++)
+  {
+    if (!snapshot_read(argv[i + 1], &(snapshots[i])))
+    {
+      return EXIT_FAILURE;
+    }
+    snapshot_measure(&(snapshots[i]), &(metrics[i]));
+  }
+
+  const struct memory_snapshot_header *header = &(snapshots[0].header);
+  printf("heap of %u bytes in %u blocks of %u bytes\n",
+         header->heap_size, header->blocks, header->block_size);
+
+  if (argc == 2)
+  {
+    metrics_print(argv[1], &(metrics[0]), header->block_size);
+    snapshot_print_map(&(snapshots[0]));
+    return EXIT_SUCCESS;
+  }
+
+  if (   (snapshots[1].header.blocks != header->blocks)
+      || (snapshots[1].header.block_size != header->block_size))
+  {
+    fprintf(stderr, "%s and %s are snapshots of different heaps\n",
+            argv[1], argv[2]);
+    return EXIT_FAILURE;
+  }
+
+  metrics_print(argv[1], &(metrics[0]), header->block_size);
+  metrics_print(argv[2], &(metrics[1]), header->block_size);
+  printf("fragmentation went from %.2f %% to %.2f %%\n",
+         100.0 * metrics_fragmentation(&(metrics[0])),
+         100.0 * metrics_fragmentation(&(metrics[1])));
+  snapshot_print_map(&(snapshots[1]));
+  snapshot_print_diff(&(snapshots[0]), &(snapshots[1]));
+
+  return EXIT_SUCCESS;
+}
@@ -22,6 +22,7 @@ static bool block_is_valid(const struct block *block)
   return (   (block != NULL)
           && (block->address >= heap)
           && (block->address < &(heap[HEAP_SIZE]))
+          && (((block->address - heap) % BLOCK_SIZE) == 0)
          );
 }
 
@@ -30,13 +31,28 @@ static bool block_is_valid(const struct block *block)
  */
 static bool list_contains(const struct list *list, const struct block *block)
 {
+  for (struct block *p = list->first; p != NULL; p = p->next)
+  {
+    if (p == block)
+    {
+      return true;
+    }
+  }
+
   return false;
 }
 
 /* Returns the length of the given list (the number of blocks it contains) */
 static uint32_t list_get_length(const struct list *list)
 {
-  return 0;
+  uint32_t length = 0;
+
+  for (struct block *p = list->first; p != NULL; p = p->next)
+  {
+    length++;
+  }
+
+  return length;
 }
 
 /* Prints a human representation of the given list in forward order.
@@ -53,6 +69,12 @@ static uint32_t list_get_length(const struct list *list)
  */
 static void list_print(struct list *list, const char *title)
 {
+  printf("%s:\n  ", title);
+  for (struct block *p = list->first; p != NULL; p = p->next)
+  {
+    printf("%p->", (void *) p->address);
+  }
+  printf("NULL\n");
 }
 
 /* Prints a human representation of the given list in reverse order.
@@ -61,6 +83,12 @@ static void list_print(struct list *list, const char *title)
  */
 static void list_print_reverse(struct list *list, const char *title)
 {
+  printf("%s:\n  ", title);
+  for (struct block *p = list->last; p != NULL; p = p->prev)
+  {
+    printf("%p->", (void *) p->address);
+  }
+  printf("NULL\n");
 }
 
 /* Returns the block for which the given address falls within its address
@@ -72,6 +100,14 @@ static void list_print_reverse(struct list *list, const char *title)
 static struct block *list_find_block_by_address(const struct list *list,
                                                 const uint8_t *address)
 {
+  for (struct block *p = list->first; p != NULL; p = p->next)
+  {
+    if ((address >= p->address) && (address < p->address + BLOCK_SIZE))
+    {
+      return p;
+    }
+  }
+
   return NULL;
 }
 
@@ -85,7 +121,9 @@ static struct block *list_find_block_by_address(const struct list *list,
 static bool blocks_are_contiguous(const struct block *left,
                                   const struct block *right)
 {
-  return false;
+  return (   (left->address < right->address)
+          && (left->address + BLOCK_SIZE == right->address)
+         );
 }
 
 /* Returns the number of contiguous blocks that is required to satisfy
@@ -93,7 +131,7 @@ static bool blocks_are_contiguous(const struct block *left,
  */
 static uint32_t required_number_of_contiguous_blocks(uint32_t size)
 {
-  return 0xFFFFFFFF;
+  return (size / BLOCK_SIZE) + ((size % BLOCK_SIZE) != 0);
 }
 
 /* - Returns true when count equals zero. 
@@ -105,7 +143,21 @@ static uint32_t required_number_of_contiguous_blocks(uint32_t size)
 static bool has_number_of_contiguous_blocks(const struct block *block,
                                             uint32_t            count)
 {
-  return false;
+  if (count == 0)
+  {
+    return true;
+  }
+
+  for (uint32_t i = 1; i < count; i++)
+  {
+    if ((block->next == NULL) || !blocks_are_contiguous(block, block->next))
+    {
+      return false;
+    }
+    block = block->next;
+  }
+
+  return true;
 }
 
 /* Initializes the given block with the given address and appends it to the
@@ -130,6 +182,22 @@ static void list_init_block(struct list  *list,
                             struct block *block,
                             uint8_t      *address)
 {
+  assert((list->last == NULL) || (list->last->address + BLOCK_SIZE == address));
+
+  block->address = address;
+  block->alloc_count = 0;
+  block->prev = list->last;
+  block->next = NULL;
+
+  if (list->last == NULL)
+  {
+    list->first = block;
+  }
+  else
+  {
+    list->last->next = block;
+  }
+  list->last = block;
 }
 
 /* Inserts a chain of blocks starting with the given block in the given list.
@@ -148,6 +216,47 @@ static void list_init_block(struct list  *list,
  */
 static void list_insert_chain(struct list* list, struct block *block)
 {
+  struct block *chain_last = block;
+  while (chain_last->next != NULL)
+  {
+    chain_last = chain_last->next;
+  }
+
+  /* Find the first block of the list that comes after the chain. Chains
+   * are often appended, which needs no search at all. */
+  struct block *successor = list->first;
+  if ((list->last != NULL) && (list->last->address < block->address))
+  {
+    successor = NULL;
+  }
+  while ((successor != NULL) && (successor->address < block->address))
+  {
+    successor = successor->next;
+  }
+
+  struct block *predecessor = (successor != NULL) ? successor->prev
+                                                  : list->last;
+
+  block->prev = predecessor;
+  chain_last->next = successor;
+
+  if (predecessor == NULL)
+  {
+    list->first = block;
+  }
+  else
+  {
+    predecessor->next = block;
+  }
+
+  if (successor == NULL)
+  {
+    list->last = chain_last;
+  }
+  else
+  {
+    successor->prev = chain_last;
+  }
 }
 
 /* Removes a chain of blocks starting with the given block from the given list,
@@ -167,77 +276,4186 @@ static uint32_t list_remove_chain(struct list  *list,
                                   struct block *block,
                                   uint32_t      block_count)
 {
-  return 0;
+  if (block_count == 0)
+  {
+    return 0;
+  }
+
+  uint32_t removed = 1;
+  struct block *chain_last = block;
+  while ((removed < block_count) && (chain_last->next != NULL))
+  {
+    chain_last = chain_last->next;
+    removed++;
+  }
+
+  if (block->prev == NULL)
+  {
+    list->first = chain_last->next;
+  }
+  else
+  {
+    block->prev->next = chain_last->next;
+  }
+
+  if (chain_last->next == NULL)
+  {
+    list->last = block->prev;
+  }
+  else
+  {
+    chain_last->next->prev = block->prev;
+  }
+
+  block->prev = NULL;
+  chain_last->next = NULL;
+
+  return removed;
 }
 
 /* Initializes the dynamic memory and its bookkeeping.
  *
- * This function is already implemented for you. Study this function
- * thoroughly in order to understand how the heap and its bookkeeping
- * is represented.
+ * Initialization takes constant time: the whole heap becomes the
+ * wilderness, a run of blocks that are free but not yet an element of the
+ * free list. wilderness_carve moves blocks from the start of the wilderness
+ * to the free list once an allocation needs them, and wilderness_carve_top
+ * from its end for long-lived allocations, so the blocks of pool_of_blocks
+ * are only touched when they are used.
+ *
+ * Postconditions:
+ *   - for every index i that was carved, below segment->wilderness or from
+ *     segment->wilderness_end on, pool_of_blocks[i] describes the block at
+ *     address heap + i * BLOCK_SIZE. Blocks only move between the free list
+ *     and the used list, so this holds for the lifetime of the heap and
+ *     allows to find the block of an address without searching a list.
  */
 void memory_initialize(void)
 {
+  pthread_once(&private_released_once, private_released_init);
+
+  segment_lock();
+
   list_init(&free_list);
   list_init(&used_list);
+  __atomic_store_n(&(segment->wilderness), 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&(segment->wilderness_end), NUMBER_OF_BLOCKS,
+                   __ATOMIC_RELAXED);
+  segment->free_blocks = 0;
+  segment->used_blocks = 0;
+  segment->generation++;
+  segment->cached_blocks = 0;
+  memset(remote_queues, 0, sizeof(remote_queues));
+  memset(block_owner, 0, sizeof(block_owner));
+  memset(cpu_caches, 0, sizeof(cpu_caches));
+  memset(handles, 0, sizeof(handles));
+  memset(block_handle, 0, sizeof(block_handle));
+  memset(segment->retired, 0, sizeof(segment->retired));
+  segment->retired_count = 0;
+
+  segment_unlock();
+
+  profile_forget_live();
+}
+
+/* Returns whether the block with the given index was carved from the
+ * wilderness, so that it is an element of the free list or the used list.
+ * A block in the wilderness is free, whatever its flags say.
+ */
+static bool block_is_carved(uint32_t index)
+{
+  return (   (index < __atomic_load_n(&(segment->wilderness), __ATOMIC_RELAXED))
+          || (   index
+              >= __atomic_load_n(&(segment->wilderness_end),
+                                 __ATOMIC_RELAXED)));
+}
+
+/* Makes the count blocks of the wilderness from index start on free blocks
+ * and inserts them into the free list, after the free blocks below the
+ * wilderness and before those above its end. The place is searched from
+ * the end of the free list, so only the free blocks above the wilderness
+ * are passed. Returns the first of them.
+ *
+ * Preconditions:
+ *   - count is not zero and the blocks lie in the wilderness
+ */
+static struct block *wilderness_link(uint32_t start, uint32_t count)
+{
+  struct block *first = &(pool_of_blocks[start]);
+  struct block *prev = NULL;
+
+  for (uint32_t i = start; i < start + count; i++)
+  {
+    struct block *block = &(pool_of_blocks[i]);
+    block->address = &(heap[i * BLOCK_SIZE]);
+    block->alloc_count = 0;
+    block->prev = prev;
+    block->next = NULL;
+    if (prev != NULL)
+    {
+      prev->next = block;
+    }
+    __atomic_fetch_and(&(block_flags[i]), BLOCK_DIRTY, __ATOMIC_RELAXED);
+    prev = block;
+  }
+
+  struct block *successor = NULL;
+  struct block *predecessor = free_list.last;
+  while ((predecessor != NULL) && (predecessor->address > prev->address))
+  {
+    successor = predecessor;
+    predecessor = predecessor->prev;
+  }
+
+  first->prev = predecessor;
+  prev->next = successor;
+  if (predecessor == NULL)
+  {
+    free_list.first = first;
+  }
+  else
+  {
+    predecessor->next = first;
+  }
+  if (successor == NULL)
+  {
+    free_list.last = prev;
+  }
+  else
+  {
+    successor->prev = prev;
+  }
+  segment->free_blocks += count;
+
+  return first;
+}
+
+/* Moves count blocks from the start of the wilderness to the free list and
+ * returns the first of them.
+ *
+ * Preconditions:
+ *   - count is not zero and the wilderness holds at least count blocks
+ */
+static struct block *wilderness_carve(uint32_t count)
+{
+  uint32_t start = segment->wilderness;
+  assert((count > 0) && (count <= segment->wilderness_end - start));
+
+  struct block *first = wilderness_link(start, count);
+  __atomic_store_n(&(segment->wilderness), start + count, __ATOMIC_RELAXED);
+
+  return first;
+}
+
+/* Moves count blocks from the end of the wilderness to the free list and
+ * returns the first of them.
+ *
+ * Preconditions:
+ *   - count is not zero and the wilderness holds at least count blocks
+ */
+static struct block *wilderness_carve_top(uint32_t count)
+{
+  uint32_t end = segment->wilderness_end;
+  assert((count > 0) && (count <= end - segment->wilderness));
+
+  struct block *first = wilderness_link(end - count, count);
+  __atomic_store_n(&(segment->wilderness_end), end - count, __ATOMIC_RELAXED);
+
+  return first;
+}
+
+/* Returns the first block of the first run of count contiguous blocks in the
+ * free list.
+ *
+ * The wilderness lies between the free blocks below it and those above its
+ * end. When no run below it is long enough, the run is made by carving
+ * blocks from the start of the wilderness; if the last run below borders
+ * the wilderness, only the blocks it lacks are carved. When the wilderness
+ * is too small for that, but borders the first run above it, all of it is
+ * carved to join the runs on both sides, and the search goes on above it.
+ * Returns NULL when there is no such run.
+ *
+ * Preconditions:
+ *   - count is not zero
+ */
+static struct block *free_list_find_run(uint32_t count)
+{
+  struct block *run = NULL;
+  uint32_t run_length = 0;
+  bool below = true;
+
+  for (struct block *p = free_list.first; ; p = p->next)
+  {
+    if (   below
+        && (   (p == NULL)
+            || (block_index(p->address) >= segment->wilderness_end)))
+    {
+      below = false;
+
+      struct block *last = (p != NULL) ? p->prev : free_list.last;
+      uint32_t joined =
+        (   (last != NULL)
+         && (block_index(last->address) + 1 == segment->wilderness))
+        ? run_length : 0;
+      uint32_t gap = segment->wilderness_end - segment->wilderness;
+
+      if (count - joined <= gap)
+      {
+        struct block *carved = wilderness_carve(count - joined);
+        return (joined > 0) ? run : carved;
+      }
+
+      if (   (gap > 0)
+          && (p != NULL)
+          && (block_index(p->address) == segment->wilderness_end))
+      {
+        struct block *carved = wilderness_carve(gap);
+        run = (joined > 0) ? run : carved;
+        run_length = joined + gap;
+      }
+    }
+
+    if (p == NULL)
+    {
+      return NULL;
+    }
 
-  uint8_t *address = heap;
-  for (int i=0; i < (sizeof(pool_of_blocks)/sizeof(pool_of_blocks[0])); i++)
+    if ((run != NULL) && blocks_are_contiguous(p->prev, p))
+    {
+      run_length++;
+    }
+    else
+    {
+      run = p;
+      run_length = 1;
+    }
+
+    if (run_length == count)
+    {
+      return run;
+    }
+  }
+}
+
+/* Returns the first block of the last run of count contiguous blocks in the
+ * free list, for long-lived allocations, which are placed from the end of
+ * the heap down.
+ *
+ * The free blocks above the end of the wilderness are searched first. When
+ * they have no such run, it is carved from the end of the wilderness; if
+ * the first run above borders the wilderness, only the blocks it lacks are
+ * carved. Only when the wilderness is too small as well, all of it is
+ * carved and the whole free list is searched from its end. Returns NULL
+ * when there is no such run.
+ *
+ * Preconditions:
+ *   - count is not zero
+ */
+static struct block *free_list_find_last_run(uint32_t count)
+{
+  uint32_t end = segment->wilderness_end;
+  uint32_t run_length = 0;
+  struct block *p = free_list.last;
+
+  for (; (p != NULL) && (block_index(p->address) >= end); p = p->prev)
+  {
+    if ((run_length > 0) && blocks_are_contiguous(p, p->next))
+    {
+      run_length++;
+    }
+    else
+    {
+      run_length = 1;
+    }
+
+    if (run_length == count)
+    {
+      return p;
+    }
+  }
+
+  /* The run that was counted last is the lowest one above the wilderness */
+  struct block *lowest = (p != NULL) ? p->next : free_list.first;
+  uint32_t joined =
+    ((lowest != NULL) && (block_index(lowest->address) == end))
+    ? run_length : 0;
+  uint32_t gap = end - segment->wilderness;
+
+  if (count - joined <= gap)
+  {
+    return wilderness_carve_top(count - joined);
+  }
+
+  if (gap > 0)
+  {
+    wilderness_carve(gap);
+  }
+
+  run_length = 0;
+  for (p = free_list.last; p != NULL; p = p->prev)
   {
-    list_init_block(&free_list, &(pool_of_blocks[i]), address);
-    address += BLOCK_SIZE;
+    if ((run_length > 0) && blocks_are_contiguous(p, p->next))
+    {
+      run_length++;
+    }
+    else
+    {
+      run_length = 1;
+    }
+
+    if (run_length == count)
+    {
+      return p;
+    }
   }
-  assert(address == &(heap[HEAP_SIZE]));
+
+  return NULL;
 }
 
 /* Returns the amount of dynamic memory available in number of bytes */
 uint32_t memory_available(void)
 {
-  return 0;
+  segment_lock();
+  uint32_t available =
+    (  segment->free_blocks
+     + segment->wilderness_end - segment->wilderness
+     + segment->cached_blocks) * BLOCK_SIZE;
+  segment_unlock();
+
+  return available;
 }
 
 /* Returns the amount of dynamic memory used in number of bytes */
 uint32_t memory_used(void)
 {
-  return 0;
+  segment_lock();
+  uint32_t used =
+    (segment->used_blocks - segment->cached_blocks) * BLOCK_SIZE;
+  segment_unlock();
+
+  return used;
 }
 
-/* Allocates size number of *contiguous bytes* and returns a pointer to the
- * allocated memory. The memory does not have to be initialized.
+/* Returns whether the given pointer points into the heap, whether or not
+ * it is allocated.
+ */
+bool memory_contains(const void *ptr)
+{
+  const uint8_t *address = (const uint8_t *) ptr;
+  return (address >= heap) && (address < &(heap[HEAP_SIZE]));
+}
+
+/* Returns a compressed reference to the given address: its offset in the
+ * heap plus one, so that MEMORY_REF_NULL stands for NULL. A reference takes
+ * half the space of a pointer and, since it is relative to the heap, stays
+ * valid when a shared or persistent heap is mapped at another address.
  *
- * Returns NULL,
- *   - if size is zero,
- *   - or if not enough contiguous memory is available
+ * Allocations do not move for as long as they live, except for those of
+ * memory_allocate_handle, which memory_compact may move; those must not be
+ * referenced in this way.
  *
- * Postconditions:
- *   - After a successful allocation, the first block that represents the
- *     the beginning of the allocated memory must have its alloc_count field
- *     set to the number of contiguous blocks that was required to fulfil
- *     the allocation. This information will be useful for releasing the
- *     allocated memory.
+ * Preconditions:
+ *   - ptr is NULL or lies within a live allocation of the heap
+ */
+memory_ref_t memory_ref(const void *ptr)
+{
+  if (ptr == NULL)
+  {
+    return MEMORY_REF_NULL;
+  }
+
+  assert(memory_contains(ptr));
+  assert(   (block_flags_load(block_index((const uint8_t *) ptr))
+           & (BLOCK_HEAD | BLOCK_BODY)) != 0);
+  return (memory_ref_t) ((const uint8_t *) ptr - heap) + 1;
+}
+
+/* Returns the address of a reference of memory_ref, or NULL for
+ * MEMORY_REF_NULL.
  *
- * Hint: Don't forgot to update free_list and used_list
- * Hint: The functions list_remove_chain and list_insert_chain can be useful here
+ * Preconditions:
+ *   - ref is MEMORY_REF_NULL or refers to a live allocation of the heap
  */
-void *memory_allocate(uint32_t size)
+void *memory_deref(memory_ref_t ref)
 {
-  return NULL;
+  if (ref == MEMORY_REF_NULL)
+  {
+    return NULL;
+  }
+
+  assert(ref <= HEAP_SIZE);
+  assert(   (block_flags_load((ref - 1) / BLOCK_SIZE)
+           & (BLOCK_HEAD | BLOCK_BODY)) != 0);
+  return &(heap[ref - 1]);
 }
 
-/* Releases the memory pointed to by the given pointer, which must have been
- * returned by a previous call to memory_allocate.
+/* Acquires the lock of the active segment. Every public function holds it
+ * while it inspects or changes the heap, so the heap can be used by several
+ * threads and, for a shared segment, by several processes.
+ */
+static void segment_lock(void)
+{
+  pthread_mutex_lock(&(segment->lock));
+}
+
+/* Releases the lock acquired by segment_lock. */
+static void segment_unlock(void)
+{
+  pthread_mutex_unlock(&(segment->lock));
+}
+
+/* Returns the index of the block of the heap that contains the given address.
  *
- * Returns true when actual memory has been released, false otherwise.
+ * Preconditions:
+ *   - the given address lies within the heap
+ */
+static uint32_t block_index(const uint8_t *address)
+{
+  assert((address >= heap) && (address < &(heap[HEAP_SIZE])));
+
+  return (uint32_t) ((address - heap) / BLOCK_SIZE);
+}
+
+/* Moves the first chain of count contiguous blocks of the free list to the
+ * used list and returns the first block of that chain, with its alloc_count
+ * set to count.
  *
- * Possible reasons why the memory has not been released:
- *  - The given pointer is NULL.
- *  - The given pointer does not point to memory that was allocated by
- *    memory_allocate.
+ * When neither the free list nor the wilderness contains count contiguous
+ * blocks, the thread cache of the calling thread, every remote free queue
+ * and every CPU cache are flushed, so their chains can coalesce with their
+ * neighbours, and the search is repeated.
  *
- * Hint: Don't forgot to update free_list and used_list
- * Hint: The functions list_remove_chain and list_insert_chain can be useful here
+ * Returns NULL when count is zero or when no such chain is found.
  */
-bool memory_release(void *ptr)
+static struct block *allocate_chain(uint32_t count)
 {
-  return false;
+  return allocate_chain_by(count, free_list_find_run);
+}
+
+/* Does the work of allocate_chain, with find_run to pick the chain, which is
+ * either free_list_find_run or free_list_find_last_run.
+ */
+static struct block *allocate_chain_by(uint32_t count,
+                                       struct block *(*find_run)(uint32_t))
+{
+  if (count == 0)
+  {
+    return NULL;
+  }
+
+  struct block *p = find_run(count);
+  if ((p == NULL) && (segment->cached_blocks > 0))
+  {
+    caches_flush_locked();
+    p = find_run(count);
+  }
+
+  if (p == NULL)
+  {
+    return NULL;
+  }
+
+  allocation_claim(p, count);
+
+  return p;
+}
+
+/* Returns every cached chain to the free list, so it can coalesce with its
+ * neighbours: those in the thread cache of the calling thread and of every
+ * other thread that is not busy with its own, in every remote free queue
+ * and in every CPU cache.
+ */
+static void caches_flush_locked(void)
+{
+  thread_cache_flush_locked();
+  thread_caches_flush_others_locked();
+  for (uint32_t queue = 1; queue <= REMOTE_QUEUES; queue++)
+  {
+    remote_queue_drain(queue, true);
+  }
+  cpu_caches_flush_locked();
+}
+
+/* Returns whether the block with the given index is free, either in the free
+ * list or in the wilderness.
+ */
+static bool block_is_free(uint32_t index)
+{
+  return (   !block_is_carved(index)
+          || ((block_flags_load(index) & (BLOCK_HEAD | BLOCK_BODY)) == 0));
+}
+
+/* Returns the end of the run of free blocks from index start on, where start
+ * is the index of a free block, and sets *next to the first block of the
+ * free list after that run. The wilderness joins the runs that border it.
+ *
+ * Preconditions:
+ *   - *next is the first block of the free list from index start on, or
+ *     NULL when there is none
+ */
+static uint32_t free_run_end(uint32_t start, struct block **next)
+{
+  uint32_t wilderness = segment->wilderness;
+  uint32_t wilderness_end = segment->wilderness_end;
+  uint32_t end = block_is_carved(start) ? start : wilderness_end;
+  struct block *p = *next;
+
+  for (;;)
+  {
+    while ((p != NULL) && (block_index(p->address) == end))
+    {
+      end++;
+      p = p->next;
+    }
+
+    if ((end != wilderness) || (wilderness == wilderness_end))
+    {
+      break;
+    }
+    end = wilderness_end;
+  }
+
+  *next = p;
+  return end;
+}
+
+/* Returns the start of the run of free blocks that ends before index end,
+ * where end-1 is the index of a free block, and sets *prev to the last block
+ * of the free list before that run. The wilderness joins the runs that
+ * border it.
+ *
+ * Preconditions:
+ *   - *prev is the last block of the free list before index end, or NULL
+ *     when there is none
+ */
+static uint32_t free_run_start(uint32_t end, struct block **prev)
+{
+  uint32_t wilderness = segment->wilderness;
+  uint32_t wilderness_end = segment->wilderness_end;
+  uint32_t start = block_is_carved(end - 1) ? end : wilderness;
+  struct block *p = *prev;
+
+  for (;;)
+  {
+    while ((p != NULL) && (block_index(p->address) + 1 == start))
+    {
+      start--;
+      p = p->prev;
+    }
+
+    if ((start != wilderness_end) || (wilderness == wilderness_end))
+    {
+      break;
+    }
+    start = wilderness;
+  }
+
+  *prev = p;
+  return start;
+}
+
+/* Returns the index of the first free block from index from on, in the free
+ * list or in the wilderness, given the first block of the free list from
+ * there on. Returns NUMBER_OF_BLOCKS when there is none.
+ */
+static uint32_t free_run_next(uint32_t from, const struct block *next)
+{
+  uint32_t wilderness = segment->wilderness;
+  uint32_t wilderness_end = segment->wilderness_end;
+
+  if (   (from <= wilderness) && (wilderness < wilderness_end)
+      && ((next == NULL) || (block_index(next->address) >= wilderness_end)))
+  {
+    return wilderness;
+  }
+
+  return (next != NULL) ? block_index(next->address) : NUMBER_OF_BLOCKS;
+}
+
+/* Returns one past the index of the last free block before index to, in the
+ * free list or in the wilderness, given the last block of the free list
+ * before there. Returns 0 when there is none.
+ */
+static uint32_t free_run_prev(uint32_t to, const struct block *prev)
+{
+  uint32_t wilderness = segment->wilderness;
+  uint32_t wilderness_end = segment->wilderness_end;
+
+  if (   (wilderness_end <= to) && (wilderness < wilderness_end)
+      && ((prev == NULL) || (block_index(prev->address) < wilderness)))
+  {
+    return wilderness_end;
+  }
+
+  return (prev != NULL) ? block_index(prev->address) + 1 : 0;
+}
+
+/* Returns the first block of the run of count contiguous free blocks that
+ * is closest to the block with index hint, in the free list or, when it
+ * reaches the wilderness, in blocks carved from it.
+ *
+ * The run is the one that starts closest after the hint, or that ends
+ * closest before it. On a tie, the run after the hint wins. Returns NULL
+ * when there is no such run.
+ *
+ * The search starts from the neighbours of the hint in the free list, and
+ * walks the runs of free blocks outward from there, nearest first, so it
+ * passes only the free blocks between the hint and the run it returns. The
+ * neighbours are found by stepping over the allocations after the hint.
+ *
+ * Preconditions:
+ *   - count is not zero and hint is the index of a block of the heap
+ */
+static struct block *free_list_find_run_near(uint32_t hint, uint32_t count)
+{
+  uint32_t index = hint;
+  while (index < NUMBER_OF_BLOCKS)
+  {
+    uint8_t flags = block_flags_load(index);
+    if (!block_is_carved(index))
+    {
+      index = segment->wilderness_end;
+    }
+    else if ((flags & (BLOCK_HEAD | BLOCK_BODY)) == 0)
+    {
+      break;
+    }
+    else if (   ((flags & BLOCK_HEAD) != 0)
+             && (pool_of_blocks[index].alloc_count > 0))
+    {
+      index += pool_of_blocks[index].alloc_count;
+    }
+    else
+    {
+      index++;
+    }
+  }
+
+  /* The first block of the free list from the hint on, and the last one
+   * before the runs that are searched backward */
+  struct block *next =
+    (index < NUMBER_OF_BLOCKS) ? &(pool_of_blocks[index]) : NULL;
+  struct block *prev = (next != NULL) ? next->prev : free_list.last;
+
+  uint32_t after;
+  uint32_t before;
+  if (block_is_free(hint))
+  {
+    after = hint;
+    before = hint + 1;
+    if (next == &(pool_of_blocks[hint]))
+    {
+      prev = next;
+    }
+  }
+  else
+  {
+    after = free_run_next(hint, next);
+    before = free_run_prev(hint, prev);
+  }
+
+  /* The run after the hint starts at after, the one before it ends before
+   * before; each step takes the one that is closest */
+  uint32_t start = NUMBER_OF_BLOCKS;
+  while (   (start == NUMBER_OF_BLOCKS)
+         && ((after < NUMBER_OF_BLOCKS) || (before >= count)))
+  {
+    if (   (after < NUMBER_OF_BLOCKS)
+        && ((before < count) || (after - hint <= hint + 1 - before)))
+    {
+      uint32_t end = free_run_end(after, &next);
+      if (end - after >= count)
+      {
+        start = after;
+      }
+      after = free_run_next(end, next);
+    }
+    else
+    {
+      uint32_t first = free_run_start(before, &prev);
+      if (before - first >= count)
+      {
+        start = before - count;
+      }
+      before = free_run_prev(first, prev);
+    }
+  }
+
+  if (start == NUMBER_OF_BLOCKS)
+  {
+    return NULL;
+  }
+
+  /* The wilderness stays one run: the part of the run in it is carved from
+   * its end when the run reaches the end, and from its start otherwise */
+  uint32_t wilderness = segment->wilderness;
+  uint32_t wilderness_end = segment->wilderness_end;
+  if (   (wilderness < wilderness_end)
+      && (start < wilderness_end) && (start + count > wilderness))
+  {
+    if (start + count >= wilderness_end)
+    {
+      wilderness_carve_top(
+        wilderness_end - ((start > wilderness) ? start : wilderness));
+    }
+    else
+    {
+      wilderness_carve(start + count - wilderness);
+    }
+  }
+
+  return &(pool_of_blocks[start]);
+}
+
+/* Moves the chain of count contiguous free blocks that starts with the given
+ * block from the free list to the used list, and marks it as an allocation
+ * of count blocks.
+ *
+ * Preconditions:
+ *   - the given block and its count-1 successors in the free list are
+ *     contiguous
+ */
+static void allocation_claim(struct block *block, uint32_t count)
+{
+  list_remove_chain(&free_list, block, count);
+  list_insert_chain(&used_list, block);
+  block->alloc_count = count;
+  segment->free_blocks -= count;
+  segment->used_blocks += count;
+
+  uint32_t first = block_index(block->address);
+  blocks_set_flags(first, 1, BLOCK_HEAD);
+  blocks_set_flags(first + 1, count - 1, BLOCK_BODY);
+}
+
+/* Moves the chain of blocks that starts with the given block from the used
+ * list back to the free list, and wakes the threads that wait for memory.
+ *
+ * Preconditions:
+ *   - the given block is the first block of an allocation, i.e. it is an
+ *     element of the used list and its alloc_count is not zero
+ */
+static void release_chain(struct block *block)
+{
+  uint32_t count = block->alloc_count;
+  uint32_t first = block_index(block->address);
+
+  blocks_clear_flags(first, count,
+                       BLOCK_HEAD | BLOCK_BODY | BLOCK_MOVABLE | BLOCK_CACHED
+                     | BLOCK_LONG_LIVED | BLOCK_RETIRED);
+
+  block->alloc_count = 0;
+  block_owner[first] = 0;
+  list_remove_chain(&used_list, block, count);
+  list_insert_chain(&free_list, block);
+  segment->used_blocks -= count;
+  segment->free_blocks += count;
+
+  if (segment->waiting > 0)
+  {
+    pthread_cond_broadcast(&(segment->released));
+  }
+}
+
+/* Returns the first block of the allocation that starts at the given pointer,
+ * using only block_flags and pool_of_blocks.
+ *
+ * Returns NULL when the given pointer is NULL, lies outside the heap, does
+ * not point to the start of a block, or when its block is not the first
+ * block of a live allocation (it is free, already released into a thread
+ * cache or the free list, retired, in the middle of an allocation or still
+ * part of the wilderness).
+ */
+static struct block *block_of_allocation(const void *ptr)
+{
+  const uint8_t *address = (const uint8_t *) ptr;
+
+  if (   (address == NULL)
+      || (address < heap)
+      || (address >= &(heap[HEAP_SIZE]))
+      || (((address - heap) % BLOCK_SIZE) != 0))
+  {
+    return NULL;
+  }
+
+  uint32_t index = block_index(address);
+  if (   !block_is_carved(index)
+      || (   (block_flags_load(index)
+              & (BLOCK_HEAD | BLOCK_CACHED | BLOCK_RETIRED))
+          != BLOCK_HEAD))
+  {
+    return NULL;
+  }
+
+  return &(pool_of_blocks[index]);
+}
+
+/* Returns the flags of the block with the given index. thread_cache_push
+ * and remote_queue_push change block_flags without the lock, so every
+ * access to it is atomic.
+ */
+static uint8_t block_flags_load(uint32_t index)
+{
+  return __atomic_load_n(&(block_flags[index]), __ATOMIC_RELAXED);
+}
+
+/* Sets the given flags in block_flags for count blocks, starting with the
+ * block with index first.
+ */
+static void blocks_set_flags(uint32_t first, uint32_t count, uint8_t flags)
+{
+  for (uint32_t i = first; i < first + count; i++)
+  {
+    __atomic_fetch_or(&(block_flags[i]), flags, __ATOMIC_RELAXED);
+  }
+}
+
+/* Clears the given flags in block_flags for count blocks, starting with the
+ * block with index first.
+ */
+static void blocks_clear_flags(uint32_t first, uint32_t count, uint8_t flags)
+{
+  for (uint32_t i = first; i < first + count; i++)
+  {
+    __atomic_fetch_and(&(block_flags[i]), (uint8_t) ~flags, __ATOMIC_RELAXED);
+  }
+}
+
+/* Zeroes every dirty block among the count blocks that start with the block
+ * with index first. Blocks that are known to be zero are left untouched.
+ * Consecutive dirty blocks are cleared with a single call to memset.
+ */
+static void blocks_zero_dirty(uint32_t first, uint32_t count)
+{
+  uint32_t i = first;
+  while (i < first + count)
+  {
+    if ((block_flags_load(i) & BLOCK_DIRTY) == 0)
+    {
+      i++;
+      continue;
+    }
+
+    uint32_t run = i;
+    while (   (i < first + count)
+           && ((block_flags_load(i) & BLOCK_DIRTY) != 0))
+    {
+      i++;
+    }
+    memset(&(heap[run * BLOCK_SIZE]), 0, (i - run) * BLOCK_SIZE);
+  }
+}
+
+/* Allocates size bytes for memory_allocate, without timing or sampling it.
+ */
+static void *allocation_create(uint32_t size)
+{
+  uint32_t count = required_number_of_contiguous_blocks(size);
+
+  struct block *block = thread_cache_pop(count);
+  if (block == NULL)
+  {
+    block = cpu_cache_pop(count);
+  }
+
+  uint8_t *address = NULL;
+
+  if (block == NULL)
+  {
+    segment_lock();
+
+    block = allocate_chain(count);
+
+    if (block != NULL)
+    {
+      blocks_set_flags(block_index(block->address), block->alloc_count,
+                       BLOCK_DIRTY);
+      block_owner[block_index(block->address)] = thread_cache.queue;
+    }
+
+    segment_unlock();
+  }
+
+  if (block != NULL)
+  {
+    address = block->address;
+  }
+
+  return address;
+}
+
+/* Allocates size number of *contiguous bytes* and returns a pointer to the
+ * allocated memory. The memory does not have to be initialized.
+ *
+ * Returns NULL,
+ *   - if size is zero,
+ *   - or if not enough contiguous memory is available
+ *
+ * Postconditions:
+ *   - After a successful allocation, the first block that represents the
+ *     the beginning of the allocated memory must have its alloc_count field
+ *     set to the number of contiguous blocks that was required to fulfil
+ *     the allocation. This information will be useful for releasing the
+ *     allocated memory.
+ *
+ * While the latency recorder is on, the call is timed.
+ *
+ * Hint: Don't forgot to update free_list and used_list
+ * Hint: The functions list_remove_chain and list_insert_chain can be useful here
+ */
+void *memory_allocate(uint32_t size)
+{
+  void *address;
+
+  if (!__atomic_load_n(&latency_enabled, __ATOMIC_RELAXED))
+  {
+    address = allocation_create(size);
+  }
+  else
+  {
+    uint64_t start = latency_now();
+    address = allocation_create(size);
+    latency_record(MEMORY_LATENCY_ALLOCATE,
+                   required_number_of_contiguous_blocks(size),
+                   latency_now() - start);
+  }
+
+  /* Sampled here, so the stack starts at the caller of memory_allocate */
+  if (   (address != NULL)
+      && (__atomic_load_n(&profile_interval, __ATOMIC_RELAXED) != 0))
+  {
+    profile_allocation(address, size);
+  }
+
+  return address;
+}
+
+/* Allocates size number of *contiguous bytes*, just like memory_allocate,
+ * and places them in the heap by the given lifetime, one of:
+ *
+ *   - MEMORY_LIFETIME_SHORT: the allocation is released soon. It is placed
+ *     exactly as memory_allocate would, from the start of the heap.
+ *   - MEMORY_LIFETIME_LONG: the allocation outlives most others. It takes
+ *     the last free run that fits, carved from the end of the wilderness
+ *     when the free runs above it are too small, so it grows down from the
+ *     end of the heap and does not pin holes between the short-lived
+ *     allocations. When it is released, it goes straight back to the free
+ *     list, not to a cache from which short-lived data would take it.
+ *
+ * Returns NULL in the same cases as memory_allocate, and for any other
+ * lifetime.
+ */
+void *memory_allocate_hint(uint32_t size, int lifetime)
+{
+  if (lifetime == MEMORY_LIFETIME_SHORT)
+  {
+    return memory_allocate(size);
+  }
+  if (lifetime != MEMORY_LIFETIME_LONG)
+  {
+    return NULL;
+  }
+
+  segment_lock();
+
+  struct block *block =
+    allocate_chain_by(required_number_of_contiguous_blocks(size),
+                      free_list_find_last_run);
+
+  if (block != NULL)
+  {
+    blocks_set_flags(block_index(block->address), block->alloc_count,
+                     BLOCK_DIRTY);
+    blocks_set_flags(block_index(block->address), 1, BLOCK_LONG_LIVED);
+    block_owner[block_index(block->address)] = thread_cache.queue;
+  }
+
+  segment_unlock();
+
+  uint8_t *address = NULL;
+
+  if (block != NULL)
+  {
+    address = block->address;
+    if (__atomic_load_n(&profile_interval, __ATOMIC_RELAXED) != 0)
+    {
+      profile_allocation(address, size);
+    }
+  }
+
+  return address;
+}
+
+/* Allocates size number of *contiguous bytes*, just like memory_allocate,
+ * but as close as possible to the allocation at hint_ptr: the run of free
+ * blocks that is found first when searching outward from the block of
+ * hint_ptr, in both directions, instead of from the start of the heap. Nodes
+ * of a linked structure that are allocated near each other share pages and
+ * cache lines when it is traversed.
+ *
+ * hint_ptr can be any address in the heap, also a released one. When it is
+ * NULL or outside the heap, this is memory_allocate.
+ *
+ * Returns NULL in the same cases as memory_allocate.
+ */
+void *memory_allocate_near(const void *hint_ptr, uint32_t size)
+{
+  if (!memory_contains(hint_ptr))
+  {
+    return memory_allocate(size);
+  }
+
+  uint32_t count = required_number_of_contiguous_blocks(size);
+  if ((count == 0) || (count > NUMBER_OF_BLOCKS))
+  {
+    return NULL;
+  }
+
+  uint32_t hint = block_index((const uint8_t *) hint_ptr);
+
+  segment_lock();
+
+  struct block *block = free_list_find_run_near(hint, count);
+  if ((block == NULL) && (segment->cached_blocks > 0))
+  {
+    caches_flush_locked();
+    block = free_list_find_run_near(hint, count);
+  }
+
+  if (block != NULL)
+  {
+    allocation_claim(block, count);
+    blocks_set_flags(block_index(block->address), count, BLOCK_DIRTY);
+    block_owner[block_index(block->address)] = thread_cache.queue;
+  }
+
+  segment_unlock();
+
+  uint8_t *address = NULL;
+
+  if (block != NULL)
+  {
+    address = block->address;
+    if (__atomic_load_n(&profile_interval, __ATOMIC_RELAXED) != 0)
+    {
+      profile_allocation(address, size);
+    }
+  }
+
+  return address;
+}
+
+/* Allocates size number of *contiguous bytes*, just like memory_allocate,
+ * but the allocated memory is set to zero.
+ *
+ * Only the blocks that may have been written to since the program started
+ * are cleared. Blocks that have never been handed out are still zero and
+ * are not touched at all.
+ *
+ * Returns NULL in the same cases as memory_allocate.
+ */
+void *memory_allocate_zeroed(uint32_t size)
+{
+  uint32_t count = required_number_of_contiguous_blocks(size);
+
+  struct block *block = thread_cache_pop(count);
+  if (block == NULL)
+  {
+    block = cpu_cache_pop(count);
+  }
+  if (block != NULL)
+  {
+    blocks_zero_dirty(block_index(block->address), count);
+  }
+  else
+  {
+    segment_lock();
+
+    block = allocate_chain(count);
+
+    if (block != NULL)
+    {
+      uint32_t first = block_index(block->address);
+      blocks_zero_dirty(first, block->alloc_count);
+      blocks_set_flags(first, block->alloc_count, BLOCK_DIRTY);
+      block_owner[first] = thread_cache.queue;
+    }
+
+    segment_unlock();
+  }
+
+  uint8_t *address = NULL;
+
+  if (block != NULL)
+  {
+    address = block->address;
+    if (__atomic_load_n(&profile_interval, __ATOMIC_RELAXED) != 0)
+    {
+      profile_allocation(address, size);
+    }
+  }
+
+  return address;
+}
+
+/* Returns the largest number of blocks a thread in memory_allocate_wait
+ * waits for, or zero when nobody waits. The lock must be held.
+ */
+static uint32_t waiting_largest(void)
+{
+  uint32_t count = NUMBER_OF_BLOCKS;
+  while ((count > 0) && (segment->waiters[count] == 0))
+  {
+    count--;
+  }
+
+  return count;
+}
+
+/* Allocates size number of *contiguous bytes*, just like memory_allocate,
+ * but when not enough contiguous memory is available, the caller waits until
+ * releases make room, for at most timeout milliseconds. A negative timeout
+ * waits without limit; a zero timeout does not wait at all.
+ *
+ * Waiters are served in order of request size, largest first: while a larger
+ * request waits, smaller ones wait too, even when they would fit at once, so
+ * a stream of small calls of memory_allocate_wait can not starve it. Plain
+ * memory_allocate does not wait its turn.
+ *
+ * Returns NULL,
+ *   - if size is zero or larger than the heap,
+ *   - or if the timeout expires before enough contiguous memory is available
+ */
+void *memory_allocate_wait(uint32_t size, int timeout)
+{
+  uint32_t count = required_number_of_contiguous_blocks(size);
+  if ((count == 0) || (count > NUMBER_OF_BLOCKS))
+  {
+    return NULL;
+  }
+
+  /* Only when nobody waits yet, the request may skip the queue */
+  uint8_t *address = NULL;
+  if (__atomic_load_n(&(segment->waiting), __ATOMIC_RELAXED) == 0)
+  {
+    address = (uint8_t *) memory_allocate(size);
+    if ((address != NULL) || (timeout == 0))
+    {
+      return address;
+    }
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (long) (timeout % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000)
+  {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  segment_lock();
+
+  /* Pairs with the fence in allocation_release: either the releaser sees
+   * this waiter, or the search below sees what it released */
+  __atomic_fetch_add(&(segment->waiting), 1, __ATOMIC_SEQ_CST);
+  segment->waiters[count]++;
+
+  int status = 0;
+  while (true)
+  {
+    if (waiting_largest() == count)
+    {
+      struct block *block = allocate_chain(count);
+      if (block != NULL)
+      {
+        blocks_set_flags(block_index(block->address), count, BLOCK_DIRTY);
+        block_owner[block_index(block->address)] = thread_cache.queue;
+        address = block->address;
+        break;
+      }
+    }
+
+    if (status == ETIMEDOUT)
+    {
+      break;
+    }
+
+    status = (timeout < 0)
+           ? pthread_cond_wait(&(segment->released), &(segment->lock))
+           : pthread_cond_timedwait(&(segment->released), &(segment->lock),
+                                    &deadline);
+  }
+
+  segment->waiters[count]--;
+  __atomic_fetch_sub(&(segment->waiting), 1, __ATOMIC_RELAXED);
+
+  /* The next request in line may go ahead now */
+  if (segment->waiting > 0)
+  {
+    pthread_cond_broadcast(&(segment->released));
+  }
+
+  segment_unlock();
+
+  /* The profiler takes a stack trace and its own lock, so not under ours */
+  if (   (address != NULL)
+      && (__atomic_load_n(&profile_interval, __ATOMIC_RELAXED) != 0))
+  {
+    profile_allocation(address, size);
+  }
+
+  return address;
+}
+
+/* Releases the allocation at the given pointer for memory_release, without
+ * timing it.
+ */
+static bool allocation_release(void *ptr)
+{
+  if (__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0)
+  {
+    profile_release(ptr);
+  }
+
+  if (   (__atomic_load_n(&(segment->waiting), __ATOMIC_RELAXED) == 0)
+      && (remote_queue_push(ptr) || thread_cache_push(ptr)))
+  {
+    /* A thread may have started to wait since waiting was read, and it
+     * cannot see a cached chain, so it is flushed to the free list */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&(segment->waiting), __ATOMIC_ACQUIRE) != 0)
+    {
+      segment_lock();
+      caches_flush_locked();
+      pthread_cond_broadcast(&(segment->released));
+      segment_unlock();
+    }
+
+    return true;
+  }
+
+  segment_lock();
+
+  struct block *block = block_of_allocation(ptr);
+  if (   (block != NULL)
+      && (   (block_flags_load(block_index(block->address)) & BLOCK_MOVABLE)
+          != 0))
+  {
+    block = NULL;
+  }
+
+  if (block != NULL)
+  {
+    release_chain(block);
+  }
+
+  segment_unlock();
+
+  return (block != NULL);
+}
+
+/* Releases the memory pointed to by the given pointer, which must have been
+ * returned by a previous call to memory_allocate.
+ *
+ * Returns true when actual memory has been released, false otherwise.
+ *
+ * Possible reasons why the memory has not been released:
+ *  - The given pointer is NULL.
+ *  - The given pointer does not point to memory that was allocated by
+ *    memory_allocate.
+ *  - The given pointer points inside an allocation instead of to its start.
+ *  - The memory has already been released.
+ *  - The memory was allocated with memory_allocate_handle and must be
+ *    released with memory_release_handle.
+ *
+ * All of these are detected in constant time, without searching used_list.
+ *
+ * An allocation made by another thread that has a remote free queue is
+ * pushed onto that queue, and small allocations go to the thread cache of
+ * the calling thread. Neither takes the lock; the chains are only returned
+ * to the free list when the queue is drained or the cache is flushed. While
+ * threads wait in memory_allocate_wait, allocations are released to the
+ * free list at once, and a thread that starts to wait during a lock-free
+ * release has the caches flushed and is woken by it.
+ *
+ * While the latency recorder is on, the call is timed.
+ *
+ * Hint: Don't forgot to update free_list and used_list
+ * Hint: The functions list_remove_chain and list_insert_chain can be useful here
+ */
+bool memory_release(void *ptr)
+{
+  if (!__atomic_load_n(&latency_enabled, __ATOMIC_RELAXED))
+  {
+    return allocation_release(ptr);
+  }
+
+  /* The size class is looked up before the clock starts */
+  struct block *block = block_of_allocation(ptr);
+  uint32_t count = (block != NULL) ? block->alloc_count : 0;
+
+  uint64_t start = latency_now();
+  bool released = allocation_release(ptr);
+  latency_record(MEMORY_LATENCY_RELEASE, count, latency_now() - start);
+
+  return released;
+}
+
+/* Returns the number of bytes that can be used through the given pointer,
+ * which is alloc_count * BLOCK_SIZE and thus at least the size that was
+ * requested from memory_allocate.
+ *
+ * Returns zero when the given pointer is not the start of a live allocation,
+ * for the same reasons for which memory_release would refuse it.
+ */
+uint32_t memory_usable_size(const void *ptr)
+{
+  uint32_t size = 0;
+
+  segment_lock();
+
+  const struct block *block = block_of_allocation(ptr);
+  if (block != NULL)
+  {
+    size = block->alloc_count * BLOCK_SIZE;
+  }
+
+  segment_unlock();
+
+  return size;
+}
+
+/* Creates the key whose destructor flushes the thread cache of a thread
+ * when the thread exits, and makes forked children forget the cache.
+ */
+static void thread_cache_key_create(void)
+{
+  pthread_key_create(&thread_cache_key, thread_cache_exit);
+  pthread_atfork(NULL, NULL, thread_cache_fork_child);
+}
+
+/* A forked child shares a shared segment with its parent, so the chains in
+ * the copy of the thread cache it inherited, and the remote free queue,
+ * still belong to the parent.
+ */
+static void thread_cache_fork_child(void)
+{
+  if (segment != &private_segment)
+  {
+    memset(thread_cache.count, 0, sizeof(thread_cache.count));
+    thread_cache.queue = 0;
+    thread_cache.segment = NULL;
+  }
+}
+
+/* Flushes the thread cache of an exiting thread. */
+static void thread_cache_exit(void *cache)
+{
+  (void) cache;
+  thread_cache_leave();
+
+  pthread_mutex_lock(&thread_caches_lock);
+  if (thread_cache.prev != NULL)
+  {
+    thread_cache.prev->next = thread_cache.next;
+  }
+  else
+  {
+    thread_caches = thread_cache.next;
+  }
+  if (thread_cache.next != NULL)
+  {
+    thread_cache.next->prev = thread_cache.prev;
+  }
+  pthread_mutex_unlock(&thread_caches_lock);
+}
+
+/* Takes the thread cache of the calling thread before it is changed without
+ * the lock. Meanwhile, thread_caches_flush_others_locked leaves it alone.
+ */
+static void thread_cache_begin(void)
+{
+  while (__atomic_exchange_n(&(thread_cache.busy), true, __ATOMIC_ACQUIRE))
+  {
+    sched_yield();
+  }
+}
+
+/* Gives back the thread cache taken by thread_cache_begin. */
+static void thread_cache_end(void)
+{
+  __atomic_store_n(&(thread_cache.busy), false, __ATOMIC_RELEASE);
+}
+
+/* Releases the chains in the thread caches of the other threads to the free
+ * list, so that a thread that stopped allocating does not keep them from
+ * an allocation that fails without them. A cache that its thread is busy
+ * with is skipped. The lock must be held.
+ */
+static void thread_caches_flush_others_locked(void)
+{
+  pthread_mutex_lock(&thread_caches_lock);
+
+  for (struct thread_cache *cache = thread_caches; cache != NULL;
+       cache = cache->next)
+  {
+    if (   (cache == &thread_cache)
+        || (cache->segment != segment)
+        || (cache->generation != segment->generation)
+        || __atomic_exchange_n(&(cache->busy), true, __ATOMIC_ACQUIRE))
+    {
+      continue;
+    }
+
+    for (uint32_t bin = 0; bin < THREAD_CACHE_BINS; bin++)
+    {
+      for (uint32_t i = 0; i < cache->count[bin]; i++)
+      {
+        release_chain(&(pool_of_blocks[cache->blocks[bin][i]]));
+      }
+      __atomic_fetch_sub(&(segment->cached_blocks),
+                         cache->count[bin] * (bin + 1), __ATOMIC_RELAXED);
+      cache->count[bin] = 0;
+    }
+
+    __atomic_store_n(&(cache->busy), false, __ATOMIC_RELEASE);
+  }
+
+  pthread_mutex_unlock(&thread_caches_lock);
+}
+
+/* Makes sure the thread cache of the calling thread belongs to the heap in
+ * use. Entries of another segment, or of the same segment before its last
+ * memory_initialize, are forgotten, and a remote free queue is claimed in
+ * the heap in use.
+ *
+ * A process that calls exit does not run the destructor of the key, so
+ * the chains in its caches and its queue would stay in a shared or
+ * persistent segment for good. Such a segment therefore gets no queue, and
+ * thread_cache_push and thread_cache_pop leave it alone.
+ */
+static void thread_cache_make_current(void)
+{
+  if (   (thread_cache.segment != segment)
+      || (thread_cache.generation != segment->generation))
+  {
+    if (!thread_cache.registered)
+    {
+      pthread_once(&thread_cache_once, thread_cache_key_create);
+      pthread_setspecific(thread_cache_key, &thread_cache);
+      thread_cache.registered = true;
+
+      pthread_mutex_lock(&thread_caches_lock);
+      thread_cache.next = thread_caches;
+      if (thread_caches != NULL)
+      {
+        thread_caches->prev = &thread_cache;
+      }
+      thread_caches = &thread_cache;
+      pthread_mutex_unlock(&thread_caches_lock);
+    }
+
+    memset(thread_cache.count, 0, sizeof(thread_cache.count));
+    thread_cache.segment = segment;
+    thread_cache.generation = segment->generation;
+    thread_cache.queue = 0;
+    if (segment == &private_segment)
+    {
+      remote_queue_claim();
+    }
+  }
+}
+
+/* Takes the most recently cached chain of count blocks from the thread cache
+ * of the calling thread and makes it a live allocation again. This does not
+ * need the lock. The remote free queue of the thread is drained first.
+ *
+ * Returns NULL when the cache holds no chain of count blocks.
+ */
+static struct block *thread_cache_pop(uint32_t count)
+{
+  struct block *block = NULL;
+
+  thread_cache_begin();
+  thread_cache_make_current();
+
+  uint32_t queue = thread_cache.queue;
+  if (   (queue != 0)
+      && (__atomic_load_n(&(remote_queues[queue-1].head), __ATOMIC_ACQUIRE)
+          != 0))
+  {
+    remote_queue_drain(queue, false);
+  }
+
+  if (   (count > 0) && (count <= THREAD_CACHE_BINS)
+      && (segment == &private_segment)
+      && (thread_cache.count[count-1] > 0))
+  {
+    uint32_t *depth = &(thread_cache.count[count-1]);
+    uint32_t index = thread_cache.blocks[count-1][--(*depth)];
+    __atomic_fetch_and(&(block_flags[index]), (uint8_t) ~BLOCK_CACHED,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&(segment->cached_blocks), count, __ATOMIC_RELAXED);
+    block_owner[index] = thread_cache.queue;
+    block = &(pool_of_blocks[index]);
+  }
+
+  thread_cache_end();
+
+  return block;
+}
+
+/* Releases the allocation that starts at the given pointer into the thread
+ * cache of the calling thread, without taking the lock unless the cache
+ * is full. When the cache is full, its oldest half of chains of the same
+ * size is spilled to the CPU caches first.
+ *
+ * Returns false, without doing anything, when the given pointer is not the
+ * start of a live allocation of at most THREAD_CACHE_BINS blocks made with
+ * memory_allocate.
+ */
+static bool thread_cache_push(void *ptr)
+{
+  struct block *block = block_of_allocation(ptr);
+  if ((block == NULL) || (segment != &private_segment))
+  {
+    return false;
+  }
+
+  uint32_t index = block_index(block->address);
+  uint32_t count = block->alloc_count;
+  if (   (count > THREAD_CACHE_BINS)
+      || (   (block_flags_load(index) & (BLOCK_MOVABLE | BLOCK_LONG_LIVED))
+          != 0))
+  {
+    return false;
+  }
+
+  thread_cache_begin();
+  thread_cache_make_current();
+
+  if (thread_cache.count[count-1] == THREAD_CACHE_DEPTH)
+  {
+    thread_cache_spill(count-1, THREAD_CACHE_DEPTH / 2);
+  }
+
+  /* Of two concurrent releases of the same pointer, or of a release and
+   * memory_retire, only one gets here */
+  uint8_t flags = __atomic_fetch_or(&(block_flags[index]), BLOCK_CACHED,
+                                    __ATOMIC_RELAXED);
+  bool pushed = ((flags & (BLOCK_CACHED | BLOCK_RETIRED)) == 0);
+  if (!pushed && ((flags & BLOCK_CACHED) == 0))
+  {
+    __atomic_fetch_and(&(block_flags[index]), (uint8_t) ~BLOCK_CACHED,
+                       __ATOMIC_RELAXED);
+  }
+  if (pushed)
+  {
+    thread_cache.blocks[count-1][thread_cache.count[count-1]++] = index;
+    __atomic_fetch_add(&(segment->cached_blocks), count, __ATOMIC_RELAXED);
+  }
+
+  thread_cache_end();
+
+  return pushed;
+}
+
+/* Releases the count oldest chains of the given bin of the thread cache of
+ * the calling thread to the free list. The lock must be held.
+ */
+static void thread_cache_evict(uint32_t bin, uint32_t count)
+{
+  uint32_t depth = thread_cache.count[bin];
+  if (count > depth)
+  {
+    count = depth;
+  }
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    release_chain(&(pool_of_blocks[thread_cache.blocks[bin][i]]));
+  }
+
+  memmove(&(thread_cache.blocks[bin][0]), &(thread_cache.blocks[bin][count]),
+          (depth - count) * sizeof(thread_cache.blocks[bin][0]));
+  thread_cache.count[bin] = depth - count;
+  __atomic_fetch_sub(&(segment->cached_blocks), count * (bin + 1),
+                     __ATOMIC_RELAXED);
+}
+
+/* Moves the count oldest chains of the given bin of the thread cache of the
+ * calling thread to the CPU caches. Chains that do not fit there are
+ * released to the free list.
+ */
+static void thread_cache_spill(uint32_t bin, uint32_t count)
+{
+  uint32_t depth = thread_cache.count[bin];
+  uint32_t moved = 0;
+  while (   (moved < count)
+         && cpu_cache_push(thread_cache.blocks[bin][moved], bin + 1))
+  {
+    moved++;
+  }
+
+  memmove(&(thread_cache.blocks[bin][0]), &(thread_cache.blocks[bin][moved]),
+          (depth - moved) * sizeof(thread_cache.blocks[bin][0]));
+  thread_cache.count[bin] = depth - moved;
+
+  if (moved < count)
+  {
+    segment_lock();
+    thread_cache_evict(bin, count - moved);
+    segment_unlock();
+  }
+}
+
+/* Returns the index of the CPU cache of the CPU the calling thread runs on.
+ *
+ * The CPU caches are a small shared cache of chains of at most
+ * THREAD_CACHE_BINS blocks behind the thread caches; a chain goes to
+ * whichever CPU cache has room, not back to its owner.
+ */
+static uint32_t cpu_cache_current(void)
+{
+  int cpu = sched_getcpu();
+  return (cpu < 0) ? 0 : ((uint32_t) cpu % CPU_CACHES);
+}
+
+/* Takes the most recently stored chain of count blocks from the CPU cache
+ * of the current CPU and makes it a live allocation again. When that cache
+ * has none, or is in use by another thread, the neighbouring CPU caches are
+ * tried in turn. This does not need the lock.
+ *
+ * Returns NULL when no CPU cache holds a chain of count blocks.
+ */
+static struct block *cpu_cache_pop(uint32_t count)
+{
+  if ((count == 0) || (count > THREAD_CACHE_BINS))
+  {
+    return NULL;
+  }
+
+  uint32_t current = cpu_cache_current();
+  for (uint32_t i = 0; i < CPU_CACHES; i++)
+  {
+    struct cpu_cache *cache = &(cpu_caches[(current + i) % CPU_CACHES]);
+    if (   (__atomic_load_n(&(cache->count[count-1]), __ATOMIC_RELAXED) == 0)
+        || __atomic_exchange_n(&(cache->busy), true, __ATOMIC_ACQUIRE))
+    {
+      continue;
+    }
+
+    uint32_t index = 0;
+    bool found = (cache->count[count-1] > 0);
+    if (found)
+    {
+      index = cache->blocks[count-1][--(cache->count[count-1])];
+    }
+    __atomic_store_n(&(cache->busy), false, __ATOMIC_RELEASE);
+
+    if (found)
+    {
+      __atomic_fetch_and(&(block_flags[index]), (uint8_t) ~BLOCK_CACHED,
+                         __ATOMIC_RELAXED);
+      __atomic_fetch_sub(&(segment->cached_blocks), count, __ATOMIC_RELAXED);
+      block_owner[index] = thread_cache.queue;
+      return &(pool_of_blocks[index]);
+    }
+  }
+
+  return NULL;
+}
+
+/* Stores the cached chain of count blocks that starts at the block with the
+ * given index in the CPU cache of the current CPU, or in a neighbouring one
+ * when that one is full or in use. This does not need the lock.
+ *
+ * Returns false when no CPU cache could take it.
+ */
+static bool cpu_cache_push(uint32_t index, uint32_t count)
+{
+  uint32_t current = cpu_cache_current();
+  for (uint32_t i = 0; i < CPU_CACHES; i++)
+  {
+    struct cpu_cache *cache = &(cpu_caches[(current + i) % CPU_CACHES]);
+    if (   (   __atomic_load_n(&(cache->count[count-1]), __ATOMIC_RELAXED)
+            == THREAD_CACHE_DEPTH)
+        || __atomic_exchange_n(&(cache->busy), true, __ATOMIC_ACQUIRE))
+    {
+      continue;
+    }
+
+    bool stored = (cache->count[count-1] < THREAD_CACHE_DEPTH);
+    if (stored)
+    {
+      cache->blocks[count-1][cache->count[count-1]++] = index;
+    }
+    __atomic_store_n(&(cache->busy), false, __ATOMIC_RELEASE);
+
+    if (stored)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Releases every chain in every CPU cache to the free list. The lock must
+ * be held.
+ */
+static void cpu_caches_flush_locked(void)
+{
+  for (uint32_t i = 0; i < CPU_CACHES; i++)
+  {
+    struct cpu_cache *cache = &(cpu_caches[i]);
+    while (__atomic_exchange_n(&(cache->busy), true, __ATOMIC_ACQUIRE))
+    {
+      sched_yield();
+    }
+
+    for (uint32_t bin = 0; bin < THREAD_CACHE_BINS; bin++)
+    {
+      for (uint32_t j = 0; j < cache->count[bin]; j++)
+      {
+        release_chain(&(pool_of_blocks[cache->blocks[bin][j]]));
+      }
+      __atomic_fetch_sub(&(segment->cached_blocks),
+                         cache->count[bin] * (bin + 1), __ATOMIC_RELAXED);
+      cache->count[bin] = 0;
+    }
+
+    __atomic_store_n(&(cache->busy), false, __ATOMIC_RELEASE);
+  }
+}
+
+/* Releases every chain in the thread cache and the remote free queue of the
+ * calling thread to the free list. The lock must be held.
+ */
+static void thread_cache_flush_locked(void)
+{
+  thread_cache_make_current();
+
+  if (thread_cache.queue != 0)
+  {
+    remote_queue_drain(thread_cache.queue, true);
+  }
+
+  for (uint32_t bin = 0; bin < THREAD_CACHE_BINS; bin++)
+  {
+    thread_cache_evict(bin, thread_cache.count[bin]);
+  }
+}
+
+/* Releases every chain in the thread cache and the remote free queue of the
+ * calling thread to the free list, where it can coalesce with its free
+ * neighbours. This happens by itself when an allocation fails and when the
+ * thread exits.
+ */
+void memory_flush_thread_cache(void)
+{
+  segment_lock();
+  thread_cache_flush_locked();
+  segment_unlock();
+}
+
+/* Flushes the thread cache of the calling thread and gives up its remote
+ * free queue, before the thread exits or stops using the segment. Chains
+ * that other threads push onto the queue afterwards are drained by the next
+ * thread that claims it, or when an allocation fails.
+ */
+static void thread_cache_leave(void)
+{
+  segment_lock();
+
+  thread_cache_flush_locked();
+  if (thread_cache.queue != 0)
+  {
+    __atomic_store_n(&(remote_queues[thread_cache.queue-1].owned), false,
+                     __ATOMIC_RELEASE);
+  }
+  thread_cache.queue = 0;
+  thread_cache.segment = NULL;
+
+  segment_unlock();
+}
+
+/* Claims a free remote free queue in the active segment for the calling
+ * thread. When all of them are in use, the thread does without one and the
+ * allocations it makes are released by other threads under the lock.
+ */
+static void remote_queue_claim(void)
+{
+  thread_cache.queue = 0;
+
+  for (uint32_t queue = 1; queue <= REMOTE_QUEUES; queue++)
+  {
+    bool owned = false;
+    if (__atomic_compare_exchange_n(&(remote_queues[queue-1].owned), &owned,
+                                    true, false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED))
+    {
+      thread_cache.queue = queue;
+      return;
+    }
+  }
+}
+
+/* Releases the allocation that starts at the given pointer by pushing it onto
+ * the remote free queue of the thread that allocated it, with a single
+ * compare-and-swap and without taking the lock.
+ *
+ * Returns false, without doing anything, when the given pointer is not the
+ * start of a live allocation made with memory_allocate by another thread
+ * that has a remote free queue.
+ */
+static bool remote_queue_push(void *ptr)
+{
+  struct block *block = block_of_allocation(ptr);
+  if (block == NULL)
+  {
+    return false;
+  }
+
+  thread_cache_begin();
+  thread_cache_make_current();
+  thread_cache_end();
+
+  uint32_t index = block_index(block->address);
+  uint32_t owner = block_owner[index];
+  if (   (owner == 0)
+      || (owner == thread_cache.queue)
+      || (   (block_flags_load(index) & (BLOCK_MOVABLE | BLOCK_LONG_LIVED))
+          != 0))
+  {
+    return false;
+  }
+
+  /* Of two concurrent releases of the same pointer, or of a release and
+   * memory_retire, only one gets here */
+  uint8_t flags = __atomic_fetch_or(&(block_flags[index]), BLOCK_CACHED,
+                                    __ATOMIC_RELAXED);
+  if ((flags & (BLOCK_CACHED | BLOCK_RETIRED)) != 0)
+  {
+    if ((flags & BLOCK_CACHED) == 0)
+    {
+      __atomic_fetch_and(&(block_flags[index]), (uint8_t) ~BLOCK_CACHED,
+                         __ATOMIC_RELAXED);
+    }
+    return false;
+  }
+
+  __atomic_fetch_add(&(segment->cached_blocks), block->alloc_count,
+                     __ATOMIC_RELAXED);
+
+  struct remote_queue *queue = &(remote_queues[owner-1]);
+  uint32_t head = __atomic_load_n(&(queue->head), __ATOMIC_RELAXED);
+  do
+  {
+    remote_next[index] = head;
+  }
+  while (!__atomic_compare_exchange_n(&(queue->head), &head, index + 1, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  return true;
+}
+
+/* Takes every chain from the given remote free queue at once. When it is the
+ * queue of the calling thread, chains that fit go to its thread cache or to
+ * a CPU cache; the others are released to the free list, taking the lock
+ * once for the whole batch unless locked tells that the caller already
+ * holds it.
+ */
+static void remote_queue_drain(uint32_t queue, bool locked)
+{
+  uint32_t head = __atomic_exchange_n(&(remote_queues[queue-1].head), 0,
+                                      __ATOMIC_ACQUIRE);
+  bool own = (queue == thread_cache.queue);
+  bool taken = false;
+
+  while (head != 0)
+  {
+    uint32_t index = head - 1;
+    struct block *block = &(pool_of_blocks[index]);
+    uint32_t count = block->alloc_count;
+    head = remote_next[index];
+
+    if (own && (count <= THREAD_CACHE_BINS))
+    {
+      if (thread_cache.count[count-1] < THREAD_CACHE_DEPTH)
+      {
+        thread_cache.blocks[count-1][thread_cache.count[count-1]++] = index;
+        continue;
+      }
+      if (cpu_cache_push(index, count))
+      {
+        continue;
+      }
+    }
+
+    if (!locked && !taken)
+    {
+      segment_lock();
+      taken = true;
+    }
+    release_chain(block);
+    __atomic_fetch_sub(&(segment->cached_blocks), count, __ATOMIC_RELAXED);
+  }
+
+  if (taken)
+  {
+    segment_unlock();
+  }
+}
+
+/* Releases the chains that are still marked as cached or retired in the
+ * active segment. Used for a heap restored from a file, whose thread caches,
+ * remote free queues and readers disappeared with the previous run.
+ */
+static void segment_release_cached(void)
+{
+  for (uint32_t i = 0; i < NUMBER_OF_BLOCKS; i++)
+  {
+    if (   block_is_carved(i)
+        && ((block_flags_load(i) & (BLOCK_CACHED | BLOCK_RETIRED)) != 0))
+    {
+      release_chain(&(pool_of_blocks[i]));
+    }
+  }
+  segment->cached_blocks = 0;
+  memset(remote_queues, 0, sizeof(remote_queues));
+  memset(block_owner, 0, sizeof(block_owner));
+  memset(cpu_caches, 0, sizeof(cpu_caches));
+  memset(segment->retired, 0, sizeof(segment->retired));
+  segment->retired_count = 0;
+}
+
+/* Inserts the free run of run_length blocks that starts with the block with
+ * index first into runs, which holds the max largest runs found so far,
+ * ordered by decreasing length. The iov_base and iov_len of an entry are
+ * the address and the size in bytes of the run. Returns the new number of
+ * entries in runs.
+ */
+static int iov_runs_insert(struct iovec *runs, int count, int max,
+                           uint32_t first, uint32_t run_length)
+{
+  size_t size = run_length * BLOCK_SIZE;
+
+  int i = (count < max) ? count : max - 1;
+  if ((i == max - 1) && (count == max) && (runs[i].iov_len >= size))
+  {
+    return count;
+  }
+
+  while ((i > 0) && (runs[i-1].iov_len < size))
+  {
+    runs[i] = runs[i-1];
+    i--;
+  }
+  runs[i].iov_base = &(heap[first * BLOCK_SIZE]);
+  runs[i].iov_len = size;
+
+  return (count < max) ? count + 1 : count;
+}
+
+/* Allocates size bytes as up to max separate pieces, which are described by
+ * the first entries of out, and returns the number of pieces. The lengths of
+ * the pieces add up to size, so out can be passed to writev or readv as is.
+ *
+ * When size contiguous bytes are available, a single piece is used.
+ * Otherwise the largest free runs are used, largest first.
+ *
+ * Returns 0, without allocating anything, when size is zero or when the max
+ * largest free runs together are too small.
+ *
+ * The pieces must be released together with memory_release_iov.
+ */
+int memory_allocate_iov(uint32_t size, struct iovec *out, int max)
+{
+  uint32_t count = required_number_of_contiguous_blocks(size);
+  if ((count == 0) || (max <= 0))
+  {
+    return 0;
+  }
+
+  segment_lock();
+
+  int pieces = 0;
+  struct block *block = allocate_chain(count);
+  if (block != NULL)
+  {
+    blocks_set_flags(block_index(block->address), count, BLOCK_DIRTY);
+    out[0].iov_base = block->address;
+    out[0].iov_len = size;
+    pieces = 1;
+  }
+  else
+  {
+    /* Find the largest runs, with the wilderness carved, so that it joins
+     * the runs on both sides of it */
+    if (segment->wilderness < segment->wilderness_end)
+    {
+      wilderness_carve(segment->wilderness_end - segment->wilderness);
+    }
+
+    uint32_t run_first = 0;
+    uint32_t run_length = 0;
+    for (struct block *p = free_list.first; p != NULL; p = p->next)
+    {
+      if ((run_length > 0) && blocks_are_contiguous(p->prev, p))
+      {
+        run_length++;
+        continue;
+      }
+      if (run_length > 0)
+      {
+        pieces = iov_runs_insert(out, pieces, max, run_first, run_length);
+      }
+      run_first = block_index(p->address);
+      run_length = 1;
+    }
+    if (run_length > 0)
+    {
+      pieces = iov_runs_insert(out, pieces, max, run_first, run_length);
+    }
+
+    uint32_t available = 0;
+    for (int i = 0; i < pieces; i++)
+    {
+      available += out[i].iov_len / BLOCK_SIZE;
+    }
+
+    if (available < count)
+    {
+      pieces = 0;
+    }
+
+    uint32_t remaining = size;
+    for (int i = 0; (i < pieces) && (remaining > 0); i++)
+    {
+      uint32_t first = block_index(out[i].iov_base);
+      uint32_t blocks = out[i].iov_len / BLOCK_SIZE;
+      uint32_t wanted = required_number_of_contiguous_blocks(remaining);
+      if (blocks > wanted)
+      {
+        blocks = wanted;
+      }
+
+      allocation_claim(&(pool_of_blocks[first]), blocks);
+      blocks_set_flags(first, blocks, BLOCK_DIRTY);
+
+      out[i].iov_len = (remaining < blocks * BLOCK_SIZE) ? remaining
+                                                         : blocks * BLOCK_SIZE;
+      remaining -= out[i].iov_len;
+      if (remaining == 0)
+      {
+        pieces = i + 1;
+      }
+    }
+  }
+
+  segment_unlock();
+
+  return pieces;
+}
+
+/* Releases the count pieces described by iov, as returned by
+ * memory_allocate_iov.
+ *
+ * Returns true when every piece was released. Pieces that are not the start
+ * of a live allocation are skipped, as memory_release would.
+ */
+bool memory_release_iov(const struct iovec *iov, int count)
+{
+  bool released = true;
+
+  segment_lock();
+
+  for (int i = 0; i < count; i++)
+  {
+    struct block *block = block_of_allocation(iov[i].iov_base);
+    if (   (block == NULL)
+        || (   (block_flags_load(block_index(block->address)) & BLOCK_MOVABLE)
+            != 0))
+    {
+      released = false;
+    }
+    else
+    {
+      release_chain(block);
+    }
+  }
+
+  segment_unlock();
+
+  return released;
+}
+
+/* Returns the entry of the handle table for the given handle, or NULL when
+ * the handle is not in use or its entry no longer describes the movable
+ * chain it was made for.
+ */
+static struct handle *handle_lookup(memory_handle_t handle)
+{
+  if ((handle == 0) || (handle > NUMBER_OF_BLOCKS) || !handles[handle-1].used)
+  {
+    return NULL;
+  }
+
+  /* The entry must still describe a movable chain that it owns */
+  uint32_t block = handles[handle-1].block;
+  if (   (   (block_flags_load(block) & (BLOCK_HEAD | BLOCK_MOVABLE))
+          != (BLOCK_HEAD | BLOCK_MOVABLE))
+      || (block_handle[block] != handle - 1))
+  {
+    return NULL;
+  }
+
+  return &(handles[handle-1]);
+}
+
+/* Allocates size number of *contiguous bytes* that are not addressed
+ * through a pointer but through the returned handle. This allows
+ * memory_compact to move the memory while it is not pinned.
+ *
+ * Returns 0 in the same cases in which memory_allocate returns NULL.
+ */
+memory_handle_t memory_allocate_handle(uint32_t size)
+{
+  memory_handle_t handle = 0;
+
+  segment_lock();
+
+  uint32_t slot = 0;
+  while ((slot < NUMBER_OF_BLOCKS) && handles[slot].used)
+  {
+    slot++;
+  }
+
+  struct block *block = NULL;
+  if (slot < NUMBER_OF_BLOCKS)
+  {
+    block = allocate_chain(required_number_of_contiguous_blocks(size));
+  }
+
+  if (block != NULL)
+  {
+    uint32_t first = block_index(block->address);
+    blocks_set_flags(first, block->alloc_count, BLOCK_DIRTY);
+    blocks_set_flags(first, 1, BLOCK_MOVABLE);
+
+    handles[slot].block = first;
+    handles[slot].pin_count = 0;
+    handles[slot].used = true;
+    block_handle[first] = slot;
+    handle = slot + 1;
+  }
+
+  segment_unlock();
+
+  return handle;
+}
+
+/* Returns a pointer to the memory of the given handle and keeps that memory
+ * in place until a matching call to memory_unpin. Pins nest.
+ *
+ * Returns NULL when the handle is not in use.
+ */
+void *memory_pin(memory_handle_t handle)
+{
+  uint8_t *address = NULL;
+
+  segment_lock();
+
+  struct handle *entry = handle_lookup(handle);
+  if (entry != NULL)
+  {
+    entry->pin_count++;
+    address = &(heap[entry->block * BLOCK_SIZE]);
+  }
+
+  segment_unlock();
+
+  return address;
+}
+
+/* Undoes one call to memory_pin for the given handle. Pointers obtained by
+ * that call must not be used anymore.
+ */
+void memory_unpin(memory_handle_t handle)
+{
+  segment_lock();
+
+  struct handle *entry = handle_lookup(handle);
+  if ((entry != NULL) && (entry->pin_count > 0))
+  {
+    entry->pin_count--;
+  }
+
+  segment_unlock();
+}
+
+/* Releases the memory of the given handle, which must have been returned by
+ * memory_allocate_handle. The handle may be reused afterwards.
+ *
+ * Returns false, without releasing anything, when the handle is not in use
+ * or when its memory is still pinned.
+ */
+bool memory_release_handle(memory_handle_t handle)
+{
+  segment_lock();
+
+  struct handle *entry = handle_lookup(handle);
+  bool released = ((entry != NULL) && (entry->pin_count == 0));
+  if (released)
+  {
+    entry->used = false;
+    release_chain(&(pool_of_blocks[entry->block]));
+  }
+
+  segment_unlock();
+
+  return released;
+}
+
+/* Appends the given block to the end of the given list.
+ *
+ * Preconditions:
+ *   - the address of the given block is greater than the address of the
+ *     last block in the given list
+ */
+static void list_append_block(struct list *list, struct block *block)
+{
+  block->prev = list->last;
+  block->next = NULL;
+
+  if (list->last == NULL)
+  {
+    list->first = block;
+  }
+  else
+  {
+    list->last->next = block;
+  }
+  list->last = block;
+}
+
+/* Rebuilds the free list and the used list of the active segment from
+ * block_flags and the alloc_count of the first block of every allocation.
+ * Free blocks next to the wilderness, on either side, are returned to it.
+ */
+static void lists_rebuild(void)
+{
+  uint32_t wilderness = 0;
+  for (uint32_t i = 0; i < segment->wilderness; i++)
+  {
+    if ((block_flags_load(i) & (BLOCK_HEAD | BLOCK_BODY)) != 0)
+    {
+      wilderness = i + 1;
+    }
+  }
+  uint32_t wilderness_end = NUMBER_OF_BLOCKS;
+  for (uint32_t i = NUMBER_OF_BLOCKS; i > segment->wilderness_end; i--)
+  {
+    if ((block_flags_load(i - 1) & (BLOCK_HEAD | BLOCK_BODY)) != 0)
+    {
+      wilderness_end = i - 1;
+    }
+  }
+  __atomic_store_n(&(segment->wilderness), wilderness, __ATOMIC_RELAXED);
+  __atomic_store_n(&(segment->wilderness_end), wilderness_end,
+                   __ATOMIC_RELAXED);
+
+  list_init(&free_list);
+  list_init(&used_list);
+  segment->free_blocks = 0;
+  segment->used_blocks = 0;
+
+  for (uint32_t i = 0; i < NUMBER_OF_BLOCKS; i++)
+  {
+    if (!block_is_carved(i))
+    {
+      continue;
+    }
+
+    struct block *block = &(pool_of_blocks[i]);
+    if ((block_flags_load(i) & (BLOCK_HEAD | BLOCK_BODY)) != 0)
+    {
+      list_append_block(&used_list, block);
+      segment->used_blocks++;
+    }
+    else
+    {
+      block->alloc_count = 0;
+      list_append_block(&free_list, block);
+      segment->free_blocks++;
+    }
+  }
+}
+
+/* Moves the movable allocation that starts with the block with index from
+ * to the block with index to, which is lower. Only the contents, the flags,
+ * the alloc_count and the handle of the allocation are updated, the lists
+ * have to be rebuilt afterwards.
+ *
+ * Preconditions:
+ *   - all blocks from index to up to index from are free
+ */
+static void allocation_move(uint32_t from, uint32_t to)
+{
+  uint32_t count = pool_of_blocks[from].alloc_count;
+  uint32_t slot = block_handle[from];
+
+  assert(to < from);
+
+  memmove(&(heap[to * BLOCK_SIZE]), &(heap[from * BLOCK_SIZE]),
+          count * BLOCK_SIZE);
+
+  blocks_clear_flags(from, count, BLOCK_HEAD | BLOCK_BODY | BLOCK_MOVABLE);
+  blocks_set_flags(to, 1, BLOCK_HEAD | BLOCK_MOVABLE);
+  blocks_set_flags(to + 1, count - 1, BLOCK_BODY);
+  blocks_set_flags(to, count, BLOCK_DIRTY);
+
+  pool_of_blocks[from].alloc_count = 0;
+  pool_of_blocks[to].alloc_count = count;
+  handles[slot].block = to;
+  block_handle[to] = slot;
+}
+
+/* Slides every unpinned handle allocation as far as possible towards the
+ * start of the heap. Allocations made with memory_allocate and pinned
+ * handle allocations stay where they are; the others close the gaps in
+ * front of them. The free space behind the last allocation becomes a
+ * single run again.
+ *
+ * The thread cache of the calling thread and the CPU caches are flushed
+ * first; chains in the caches of other threads stay where they are.
+ */
+void memory_compact(void)
+{
+  segment_lock();
+
+  thread_cache_flush_locked();
+  cpu_caches_flush_locked();
+
+  uint32_t destination = 0;
+  uint32_t i = 0;
+  while (i < segment->wilderness)
+  {
+    if ((block_flags_load(i) & BLOCK_HEAD) == 0)
+    {
+      i++;
+      continue;
+    }
+
+    uint32_t count = pool_of_blocks[i].alloc_count;
+    bool movable = (   ((block_flags_load(i) & BLOCK_MOVABLE) != 0)
+                    && (handles[block_handle[i]].pin_count == 0));
+
+    if (movable && (destination < i))
+    {
+      allocation_move(i, destination);
+      destination += count;
+    }
+    else
+    {
+      destination = i + count;
+    }
+    i += count;
+  }
+
+  lists_rebuild();
+
+  segment_unlock();
+}
+
+/* Maps a segment from the shared memory object fd, which must be exactly as
+ * large as a segment.
+ *
+ * When address is NULL, the kernel chooses where the segment is mapped.
+ * Otherwise the segment is mapped at the given address or not at all.
+ *
+ * Returns the mapped segment, or NULL on failure.
+ */
+static struct segment *segment_map(int fd, struct segment *address)
+{
+  int flags = MAP_SHARED;
+  if (address != NULL)
+  {
+    flags |= MAP_FIXED_NOREPLACE;
+  }
+
+  void *mapping = mmap(address, sizeof(struct segment),
+                       PROT_READ | PROT_WRITE, flags, fd, 0);
+  if (mapping == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  /* Kernels before 4.17 treat MAP_FIXED_NOREPLACE as a mere hint */
+  if ((address != NULL) && (mapping != address))
+  {
+    munmap(mapping, sizeof(struct segment));
+    return NULL;
+  }
+
+  return mapping;
+}
+
+/* Initializes released, the condition the threads in memory_allocate_wait
+ * wait on, with the given process-shared attribute. Its deadlines are on
+ * CLOCK_MONOTONIC, so setting the wall clock does not change them.
+ */
+static void released_init(pthread_cond_t *released, int pshared)
+{
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setpshared(&attributes, pshared);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(released, &attributes);
+  pthread_condattr_destroy(&attributes);
+}
+
+/* Replaces the static initializer of the condition of private_segment,
+ * which waits on CLOCK_REALTIME, once, before anybody can wait on it.
+ */
+static void private_released_init(void)
+{
+  pthread_cond_destroy(&(private_segment.released));
+  released_init(&(private_segment.released), PTHREAD_PROCESS_PRIVATE);
+}
+
+/* Initializes the lock of the given segment, and the condition its waiters
+ * wait on, so that they can be used by several processes. Nobody waits yet.
+ */
+static void segment_lock_init(struct segment *shared)
+{
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&(shared->lock), &attributes);
+  pthread_mutexattr_destroy(&attributes);
+
+  released_init(&(shared->released), PTHREAD_PROCESS_SHARED);
+
+  shared->waiting = 0;
+  memset(shared->waiters, 0, sizeof(shared->waiters));
+}
+
+/* Makes the given, freshly mapped segment the active segment and
+ * initializes an empty heap in it. The block_flags of the segment are kept,
+ * so they must tell correctly which blocks are dirty.
+ */
+static void segment_format(struct segment *shared)
+{
+  segment_lock_init(shared);
+  shared->heap_size = HEAP_SIZE;
+  shared->block_size = BLOCK_SIZE;
+  shared->clean = false;
+  shared->base = shared;
+  shared->root = NULL;
+
+  segment = shared;
+  memory_initialize();
+
+  /* Attaching processes only trust the segment once the magic is there */
+  __atomic_store_n(&(shared->magic), SEGMENT_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* Moves the heap into a new segment of shared memory and initializes it.
+ * Memory allocated from it can be used by every process that shares the
+ * segment: processes forked afterwards inherit it, other processes can
+ * attach to it with memory_attach_shared when a name is given.
+ *
+ * When name is NULL the segment is anonymous. Otherwise name is the name of
+ * a new POSIX shared memory object (see shm_open), which remains in
+ * existence until it is removed with shm_unlink.
+ *
+ * A shared segment previously used by this process is detached first.
+ * Threads must not use the heap while the segment is being replaced.
+ *
+ * Returns false when the shared memory could not be created, in which case
+ * the heap in use is left as it was.
+ */
+bool memory_initialize_shared(const char *name)
+{
+  int fd = (name == NULL) ? memfd_create("memory", 0)
+                          : shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  struct segment *shared = NULL;
+  if (ftruncate(fd, sizeof(struct segment)) == 0)
+  {
+    shared = segment_map(fd, NULL);
+  }
+  close(fd);
+
+  if (shared == NULL)
+  {
+    if (name != NULL)
+    {
+      shm_unlink(name);
+    }
+    return false;
+  }
+
+  memory_detach_shared();
+  segment_format(shared);
+
+  return true;
+}
+
+/* Switches the heap of this process to the shared segment with the given
+ * name, which was created by memory_initialize_shared in another process.
+ * The segment is mapped at the same address as in the process that
+ * created it.
+ *
+ * A shared segment previously used by this process is detached first.
+ * Threads must not use the heap while the segment is being replaced.
+ *
+ * Segments hold pointers, so they cannot be mapped elsewhere: attaching
+ * fails with errno EADDRINUSE when anything in this process, e.g. a library
+ * placed there by address space randomization, occupies the range the
+ * segment needs. Attaching early, before the process maps much else, makes
+ * this unlikely.
+ *
+ * Returns false, with errno set, when there is no such segment (the errno
+ * of shm_open), when the object is not a segment (EINVAL) or when the
+ * address range it needs is not free in this process (EADDRINUSE).
+ */
+bool memory_attach_shared(const char *name)
+{
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  struct stat status;
+  struct segment *shared = NULL;
+  int error = EINVAL;
+  if (   (fstat(fd, &status) == 0)
+      && (status.st_size == sizeof(struct segment)))
+  {
+    struct segment *probe = segment_map(fd, NULL);
+    if (probe != NULL)
+    {
+      struct segment *base = NULL;
+      if (__atomic_load_n(&(probe->magic), __ATOMIC_ACQUIRE) == SEGMENT_MAGIC)
+      {
+        base = probe->base;
+      }
+
+      if (probe == base)
+      {
+        shared = probe;
+      }
+      else
+      {
+        munmap(probe, sizeof(struct segment));
+        if ((base != NULL) && (base == segment))
+        {
+          /* Already in use, e.g. inherited from the creating process */
+          shared = segment;
+        }
+        else if (base != NULL)
+        {
+          shared = segment_map(fd, base);
+          error = EADDRINUSE;
+        }
+      }
+    }
+    else
+    {
+      error = errno;
+    }
+  }
+  close(fd);
+
+  if (shared == NULL)
+  {
+    errno = error;
+    return false;
+  }
+
+  if (shared != segment)
+  {
+    memory_detach_shared();
+    segment = shared;
+  }
+
+  return true;
+}
+
+/* Unmaps the shared segment this process is using, if any, and switches
+ * back to the private heap of the process. Memory allocated from the shared
+ * segment can no longer be used by this process afterwards.
+ *
+ * A persistent heap is closed as by memory_close_persistent.
+ *
+ * The thread cache of the calling thread is flushed first, and its remote
+ * free queue given up, in any case.
+ */
+void memory_detach_shared(void)
+{
+  thread_cache_leave();
+
+  if (segment == &private_segment)
+  {
+    return;
+  }
+
+  if (persistent_fd >= 0)
+  {
+    segment->clean = true;
+    msync(segment, sizeof(struct segment), MS_SYNC);
+    close(persistent_fd);
+    persistent_fd = -1;
+  }
+
+  munmap(segment, sizeof(struct segment));
+  segment = &private_segment;
+}
+
+/* Returns the given pointer moved by delta bytes. NULL stays NULL. */
+static void *pointer_rebase(void *pointer, uintptr_t delta)
+{
+  if (pointer == NULL)
+  {
+    return NULL;
+  }
+
+  return (void *) ((uintptr_t) pointer + delta);
+}
+
+/* Adjusts every pointer of the bookkeeping of the active segment, which was
+ * last used at old_base, to the address at which it is mapped now.
+ */
+static void segment_relocate(struct segment *old_base)
+{
+  uintptr_t delta = (uintptr_t) segment - (uintptr_t) old_base;
+
+  for (uint32_t i = 0; i < NUMBER_OF_BLOCKS; i++)
+  {
+    struct block *block = &(pool_of_blocks[i]);
+    block->address = pointer_rebase(block->address, delta);
+    block->prev = pointer_rebase(block->prev, delta);
+    block->next = pointer_rebase(block->next, delta);
+  }
+
+  free_list.first = pointer_rebase(free_list.first, delta);
+  free_list.last = pointer_rebase(free_list.last, delta);
+  used_list.first = pointer_rebase(used_list.first, delta);
+  used_list.last = pointer_rebase(used_list.last, delta);
+  segment->root = pointer_rebase(segment->root, delta);
+  segment->base = segment;
+}
+
+/* Returns true when the given list of the active segment satisfies the
+ * invariants of the free list (used is false) or of the used list (used is
+ * true), and adds the length of the list to count.
+ *
+ * Only carved blocks from pool_of_blocks are accepted, each describing the
+ * block of the heap that corresponds with its index. At most
+ * NUMBER_OF_BLOCKS blocks are visited in total, so a corrupted list cannot
+ * loop forever.
+ */
+static bool list_is_consistent(const struct list *list,
+                               bool               used,
+                               uint32_t          *count)
+{
+  const uintptr_t pool = (uintptr_t) pool_of_blocks;
+  struct block *prev = NULL;
+  uint32_t body_blocks = 0;
+
+  for (struct block *p = list->first; p != NULL; p = p->next)
+  {
+    uintptr_t offset = (uintptr_t) p - pool;
+    if (   (*count >= NUMBER_OF_BLOCKS)
+        || ((uintptr_t) p < pool)
+        || (offset >= sizeof(pool_of_blocks))
+        || ((offset % sizeof(struct block)) != 0))
+    {
+      return false;
+    }
+
+    uint32_t index = offset / sizeof(struct block);
+    uint8_t state = block_flags_load(index) & (BLOCK_HEAD | BLOCK_BODY);
+    if (   !block_is_carved(index)
+        || (p->address != &(heap[index * BLOCK_SIZE]))
+        || (p->prev != prev)
+        || ((prev != NULL) && (prev->address >= p->address)))
+    {
+      return false;
+    }
+
+    if (!used)
+    {
+      if ((state != 0) || (p->alloc_count != 0))
+      {
+        return false;
+      }
+    }
+    else if (body_blocks > 0)
+    {
+      if (   (state != BLOCK_BODY)
+          || (p->alloc_count != 0)
+          || !blocks_are_contiguous(prev, p))
+      {
+        return false;
+      }
+      body_blocks--;
+    }
+    else
+    {
+      if ((state != BLOCK_HEAD) || (p->alloc_count == 0))
+      {
+        return false;
+      }
+      if ((block_flags_load(index) & BLOCK_MOVABLE) != 0)
+      {
+        uint32_t slot = block_handle[index];
+        if (   (slot >= NUMBER_OF_BLOCKS)
+            || !handles[slot].used
+            || (handles[slot].block != index))
+        {
+          return false;
+        }
+      }
+      body_blocks = p->alloc_count - 1;
+    }
+
+    prev = p;
+    (*count)++;
+  }
+
+  return (list->last == prev) && (body_blocks == 0);
+}
+
+/* Returns true when the bookkeeping of the active segment is consistent:
+ * both lists satisfy their invariants, their lengths match free_blocks and
+ * used_blocks, and every block of the pool that was carved from the
+ * wilderness is an element of exactly one of them.
+ */
+static bool segment_is_consistent(void)
+{
+  uint32_t free_count = 0;
+  uint32_t used_count = 0;
+
+  return (   (segment->heap_size == HEAP_SIZE)
+          && (segment->block_size == BLOCK_SIZE)
+          && (segment->wilderness <= segment->wilderness_end)
+          && (segment->wilderness_end <= NUMBER_OF_BLOCKS)
+          && list_is_consistent(&free_list, false, &free_count)
+          && list_is_consistent(&used_list, true, &used_count)
+          && (free_count == segment->free_blocks)
+          && (used_count == segment->used_blocks)
+          && (   free_count + used_count
+              ==   segment->wilderness
+                 + NUMBER_OF_BLOCKS - segment->wilderness_end)
+         );
+}
+
+/* Moves the heap into the file with the given path, which is created when
+ * it does not exist yet. The heap and its bookkeeping stay in the file, so
+ * a later run of the program can continue with the same heap.
+ *
+ * When the file holds the heap of an earlier run, that heap is restored:
+ *   - it is mapped at the same address as before when that address is
+ *     free, so that pointers stored in the heap remain valid. Otherwise
+ *     the bookkeeping and the root pointer are relocated, but pointers
+ *     inside the allocated memory itself are not.
+ *   - when the earlier run did not close the heap with
+ *     memory_close_persistent, the bookkeeping is validated first.
+ * A file that does not hold a valid heap gets a new, empty heap.
+ *
+ * When restored is not NULL, it is set to whether an earlier heap was
+ * restored.
+ *
+ * A shared or persistent segment previously used by this process is
+ * detached first. Threads must not use the heap while the segment is being
+ * replaced.
+ *
+ * Returns false when the file could not be opened or mapped, for instance
+ * because it is already in use, in which case the heap in use is left as
+ * it was.
+ */
+bool memory_open_persistent(const char *path, bool *restored)
+{
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0)
+  {
+    return false;
+  }
+
+  struct stat status;
+  if (   (flock(fd, LOCK_EX | LOCK_NB) != 0)
+      || (fstat(fd, &status) != 0))
+  {
+    close(fd);
+    return false;
+  }
+
+  bool restore = (status.st_size == sizeof(struct segment));
+  if (   !restore
+      && (   (ftruncate(fd, 0) != 0)
+          || (ftruncate(fd, sizeof(struct segment)) != 0)))
+  {
+    close(fd);
+    return false;
+  }
+
+  struct segment *mapped = segment_map(fd, NULL);
+  if (mapped == NULL)
+  {
+    close(fd);
+    return false;
+  }
+
+  struct segment *base = mapped->base;
+  restore = (   restore
+             && (mapped->magic == SEGMENT_MAGIC)
+             && (base != NULL));
+
+  if (restore && (mapped != base))
+  {
+    struct segment *at_base = segment_map(fd, base);
+    if (at_base != NULL)
+    {
+      munmap(mapped, sizeof(struct segment));
+      mapped = at_base;
+    }
+  }
+
+  memory_detach_shared();
+  segment = mapped;
+  persistent_fd = fd;
+
+  if (restore)
+  {
+    if (mapped != base)
+    {
+      segment_relocate(base);
+    }
+    restore = (mapped->clean || segment_is_consistent());
+  }
+
+  if (restore)
+  {
+    segment_lock_init(mapped);
+    segment_release_cached();
+    mapped->clean = false;
+  }
+  else
+  {
+    /* Nothing is known about what the file held before */
+    if (status.st_size == sizeof(struct segment))
+    {
+      memset(block_flags, BLOCK_DIRTY, sizeof(block_flags));
+    }
+    segment_format(mapped);
+  }
+  msync(mapped, sizeof(struct segment), MS_SYNC);
+
+  if (restored != NULL)
+  {
+    *restored = restore;
+  }
+
+  return true;
+}
+
+/* Closes the persistent heap opened with memory_open_persistent and marks
+ * it as cleanly shut down, so the next memory_open_persistent can restore
+ * it without validating it. The process switches back to its private heap.
+ */
+void memory_close_persistent(void)
+{
+  if (persistent_fd >= 0)
+  {
+    memory_detach_shared();
+  }
+}
+
+/* Stores the given pointer in the heap, where it can be found again after
+ * the heap was restored by memory_open_persistent or attached by
+ * memory_attach_shared. It typically points to the data structure from
+ * which everything else in the heap can be reached.
+ */
+void memory_set_root(void *ptr)
+{
+  segment_lock();
+  segment->root = ptr;
+  segment_unlock();
+}
+
+/* Returns the pointer that was last stored with memory_set_root, or NULL. */
+void *memory_get_root(void)
+{
+  segment_lock();
+  void *root = segment->root;
+  segment_unlock();
+
+  return root;
+}
+
+/* Returns the state byte of the block with the given index for a snapshot.
+ */
+static uint8_t snapshot_state(uint32_t index)
+{
+  uint8_t flags = block_flags_load(index);
+  uint8_t state = MEMORY_SNAPSHOT_FREE;
+
+  if (!block_is_carved(index))
+  {
+    state = MEMORY_SNAPSHOT_WILDERNESS;
+  }
+  else if ((flags & (BLOCK_CACHED | BLOCK_RETIRED)) != 0)
+  {
+    state = MEMORY_SNAPSHOT_CACHED;
+  }
+  else if ((flags & BLOCK_HEAD) != 0)
+  {
+    state = MEMORY_SNAPSHOT_HEAD;
+  }
+  else if ((flags & BLOCK_BODY) != 0)
+  {
+    state = MEMORY_SNAPSHOT_BODY;
+  }
+
+  if ((flags & BLOCK_MOVABLE) != 0)
+  {
+    state |= MEMORY_SNAPSHOT_MOVABLE;
+  }
+  if ((flags & BLOCK_DIRTY) != 0)
+  {
+    state |= MEMORY_SNAPSHOT_DIRTY;
+  }
+
+  return state;
+}
+
+/* Writes a snapshot of the heap to the given stream, in the binary format
+ * described in memory.h: the state of every block, the alloc_count of every
+ * block, which marks the allocation boundaries, and the free runs in
+ * address order. The wilderness is not one of the free runs.
+ *
+ * The snapshot is taken under the lock, so it is consistent, but chains in
+ * thread caches and CPU caches show up as cached, not as free. It is copied
+ * into buffers from malloc, which can be large for a heap of millions of
+ * blocks, and only written after the lock is released.
+ *
+ * Returns false when the buffers can not be allocated or writing fails.
+ */
+bool memory_snapshot_write(FILE *out)
+{
+  uint8_t *states = malloc(NUMBER_OF_BLOCKS * sizeof(uint8_t));
+  uint32_t *alloc_counts = malloc(NUMBER_OF_BLOCKS * sizeof(uint32_t));
+  uint32_t *runs = malloc(2 * ((NUMBER_OF_BLOCKS + 1) / 2) * sizeof(uint32_t));
+  if ((states == NULL) || (alloc_counts == NULL) || (runs == NULL))
+  {
+    free(states);
+    free(alloc_counts);
+    free(runs);
+    return false;
+  }
+
+  segment_lock();
+
+  struct memory_snapshot_header header =
+  {
+    .magic = MEMORY_SNAPSHOT_MAGIC,
+    .version = MEMORY_SNAPSHOT_VERSION,
+    .heap_size = HEAP_SIZE,
+    .block_size = BLOCK_SIZE,
+    .blocks = NUMBER_OF_BLOCKS,
+    .wilderness = segment->wilderness,
+    .runs = 0
+  };
+
+  for (uint32_t i = 0; i < NUMBER_OF_BLOCKS; i++)
+  {
+    states[i] = snapshot_state(i);
+    alloc_counts[i] =
+      block_is_carved(i) ? pool_of_blocks[i].alloc_count : 0;
+
+    if ((states[i] & MEMORY_SNAPSHOT_STATE) != MEMORY_SNAPSHOT_FREE)
+    {
+      continue;
+    }
+    if (   (i == 0)
+        || ((states[i-1] & MEMORY_SNAPSHOT_STATE) != MEMORY_SNAPSHOT_FREE))
+    {
+      runs[2 * header.runs] = i;
+      runs[2 * header.runs + 1] = 0;
+      header.runs++;
+    }
+    runs[2 * header.runs - 1]++;
+  }
+
+  segment_unlock();
+
+  bool written =
+    (   (fwrite(&header, sizeof(header), 1, out) == 1)
+     && (fwrite(states, sizeof(uint8_t), NUMBER_OF_BLOCKS, out)
+         == NUMBER_OF_BLOCKS)
+     && (fwrite(alloc_counts, sizeof(uint32_t), NUMBER_OF_BLOCKS, out)
+         == NUMBER_OF_BLOCKS)
+     && (   (header.runs == 0)
+         || (fwrite(runs, 2 * sizeof(uint32_t), header.runs, out)
+             == header.runs))
+     && (fflush(out) == 0));
+
+  free(states);
+  free(alloc_counts);
+  free(runs);
+
+  return written;
+}
+
+#ifndef MEMORY_TIER
+/* Returns an approximation of the base 2 logarithm of the given positive
+ * number, which is good enough to draw sampling intervals without libm.
+ */
+static double profile_log2(double x)
+{
+  union { double value; uint64_t bits; } number = { .value = x };
+  int exponent = (int) ((number.bits >> 52) & 0x7FF) - 1023;
+  number.bits = (number.bits & ((UINT64_C(1) << 52) - 1))
+              | (UINT64_C(1023) << 52);
+
+  double mantissa = number.value - 1.0;
+  return exponent + mantissa * (1.3465557 - 0.3465557 * mantissa);
+}
+
+/* Draws the number of bytes until the next sample of the calling thread from
+ * an exponential distribution with mean profile_interval, so that samples
+ * form a Poisson process over the allocated bytes.
+ */
+static int64_t profile_next_interval(void)
+{
+  /* xorshift64 */
+  profile_random ^= profile_random << 13;
+  profile_random ^= profile_random >> 7;
+  profile_random ^= profile_random << 17;
+
+  double uniform = ((double) (profile_random >> 11) + 1.0) / 9007199254740992.0;
+  double interval = -profile_log2(uniform) * 0.6931471805599453
+                  * __atomic_load_n(&profile_interval, __ATOMIC_RELAXED);
+
+  return (int64_t) interval;
+}
+
+/* Counts size bytes allocated at the given address against the sampling
+ * interval of the calling thread. When the interval runs out, the stack
+ * trace of the caller is recorded as a sample of that allocation, until it
+ * is released.
+ */
+static void profile_allocation(uint8_t *address, uint32_t size)
+{
+  profile_countdown -= size;
+  if (profile_countdown >= 0)
+  {
+    return;
+  }
+
+  /* The first allocation of a thread only starts its interval */
+  bool first = (profile_random == 0);
+  if (first)
+  {
+    profile_random = (uint64_t) (uintptr_t) &profile_random
+                   ^ ((uint64_t) time(NULL) << 32)
+                   ^ UINT64_C(0x9E3779B97F4A7C15);
+  }
+  profile_countdown = profile_next_interval();
+  if (first)
+  {
+    return;
+  }
+
+  /* Frame 0 is this function */
+  void *frames[PROFILE_DEPTH + 1];
+  int depth = backtrace(frames, PROFILE_DEPTH + 1) - 1;
+  if (depth <= 0)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&profile_lock);
+
+  uint32_t site = 0;
+  while (   (site < profile_site_count)
+         && (   (profile_sites[site].depth != (uint32_t) depth)
+             || (memcmp(profile_sites[site].frames, &(frames[1]),
+                        depth * sizeof(void *)) != 0)))
+  {
+    site++;
+  }
+
+  if ((site == profile_site_count) && (site < PROFILE_SITES))
+  {
+    profile_sites[site].depth = depth;
+    memcpy(profile_sites[site].frames, &(frames[1]), depth * sizeof(void *));
+    profile_site_count++;
+  }
+
+  /* Samples of call sites beyond PROFILE_SITES are dropped */
+  if (site < profile_site_count)
+  {
+    uint32_t index = block_index(address);
+    profile_sites[site].live_count++;
+    profile_sites[site].live_bytes += size;
+    profile_sites[site].total_count++;
+    profile_sites[site].total_bytes += size;
+    block_site[index] = site + 1;
+    profile_size[index] = size;
+    __atomic_fetch_add(&profile_live, 1, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/* Drops the sample of the allocation that starts at the given pointer, if it
+ * was sampled.
+ */
+static void profile_release(const void *ptr)
+{
+  if (block_of_allocation(ptr) == NULL)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&profile_lock);
+
+  uint32_t index = block_index(ptr);
+  if (block_site[index] != 0)
+  {
+    struct profile_site *site = &(profile_sites[block_site[index] - 1]);
+    site->live_count--;
+    site->live_bytes -= profile_size[index];
+    block_site[index] = 0;
+    __atomic_fetch_sub(&profile_live, 1, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/* Forgets every sampled allocation that is still live, for
+ * memory_initialize. The call sites and their totals are kept.
+ */
+static void profile_forget_live(void)
+{
+  pthread_mutex_lock(&profile_lock);
+  memset(block_site, 0, sizeof(block_site));
+  for (uint32_t i = 0; i < profile_site_count; i++)
+  {
+    profile_sites[i].live_count = 0;
+    profile_sites[i].live_bytes = 0;
+  }
+  __atomic_store_n(&profile_live, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/* Starts sampling, on average once every interval allocated bytes, or stops
+ * it when interval is zero. Samples taken earlier are kept.
+ *
+ * While sampling is off, memory_allocate only checks interval.
+ */
+void memory_profile_set_interval(uint32_t interval)
+{
+  __atomic_store_n(&profile_interval, interval, __ATOMIC_RELAXED);
+}
+
+/* Writes the samples as a heap profile in the legacy text format of pprof:
+ * the live samples first and all samples between brackets, for each call
+ * site, followed by the mappings pprof needs to symbolize the addresses.
+ * pprof scales the samples up using the interval in the header.
+ */
+void memory_profile_write_pprof(FILE *out)
+{
+  pthread_mutex_lock(&profile_lock);
+
+  uint64_t live_count = 0, live_bytes = 0, total_count = 0, total_bytes = 0;
+  for (uint32_t i = 0; i < profile_site_count; i++)
+  {
+    live_count += profile_sites[i].live_count;
+    live_bytes += profile_sites[i].live_bytes;
+    total_count += profile_sites[i].total_count;
+    total_bytes += profile_sites[i].total_bytes;
+  }
+
+  fprintf(out, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%u\n",
+          (unsigned long long) live_count, (unsigned long long) live_bytes,
+          (unsigned long long) total_count, (unsigned long long) total_bytes,
+          __atomic_load_n(&profile_interval, __ATOMIC_RELAXED));
+
+  for (uint32_t i = 0; i < profile_site_count; i++)
+  {
+    struct profile_site *site = &(profile_sites[i]);
+    fprintf(out, "%llu: %llu [%llu: %llu] @",
+            (unsigned long long) site->live_count,
+            (unsigned long long) site->live_bytes,
+            (unsigned long long) site->total_count,
+            (unsigned long long) site->total_bytes);
+    for (uint32_t j = 0; j < site->depth; j++)
+    {
+      fprintf(out, " %p", site->frames[j]);
+    }
+    fprintf(out, "\n");
+  }
+
+  pthread_mutex_unlock(&profile_lock);
+
+  fprintf(out, "\nMAPPED_LIBRARIES:\n");
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (maps != NULL)
+  {
+    char line[512];
+    while (fgets(line, sizeof(line), maps) != NULL)
+    {
+      fputs(line, out);
+    }
+    fclose(maps);
+  }
+}
+
+/* Writes one frame of a collapsed stack: the function name that
+ * backtrace_symbols found, or else the address.
+ */
+static void profile_write_frame(FILE *out, void *frame, char *symbol)
+{
+  char *name = (symbol != NULL) ? strchr(symbol, '(') : NULL;
+  size_t length = (name != NULL) ? strcspn(name + 1, "+)") : 0;
+
+  if (length > 0)
+  {
+    fprintf(out, "%.*s", (int) length, name + 1);
+  }
+  else
+  {
+    fprintf(out, "%p", frame);
+  }
+}
+
+/* Writes the samples in collapsed stack format, one call site per line with
+ * its frames from the outermost to the innermost separated by semicolons,
+ * followed by the sampled bytes: those still allocated when live is true,
+ * otherwise all of them. Flame graph tools read this format.
+ */
+void memory_profile_write_collapsed(FILE *out, bool live)
+{
+  pthread_mutex_lock(&profile_lock);
+
+  for (uint32_t i = 0; i < profile_site_count; i++)
+  {
+    struct profile_site *site = &(profile_sites[i]);
+    uint64_t bytes = live ? site->live_bytes : site->total_bytes;
+    if (bytes == 0)
+    {
+      continue;
+    }
+
+    char **symbols = backtrace_symbols(site->frames, (int) site->depth);
+    for (uint32_t j = site->depth; j > 0; j--)
+    {
+      profile_write_frame(out, site->frames[j-1],
+                          (symbols != NULL) ? symbols[j-1] : NULL);
+      fprintf(out, (j > 1) ? ";" : " ");
+    }
+    fprintf(out, "%llu\n", (unsigned long long) bytes);
+    free(symbols);
+  }
+
+  pthread_mutex_unlock(&profile_lock);
+}
+
+/* Returns the time stamp counter, or on processors without one, the time in
+ * nanoseconds.
+ */
+static uint64_t latency_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t) time.tv_sec * 1000000000 + (uint64_t) time.tv_nsec;
+#endif
+}
+
+/* Returns the size class of an operation on count blocks: 0 for a single
+ * block, or c for 2^(c-1) + 1 up to 2^c blocks, with everything larger in
+ * the last class.
+ */
+static uint32_t latency_size_class(uint32_t count)
+{
+  uint32_t size_class = (count <= 1) ? 0 : 32 - __builtin_clz(count - 1);
+  return (size_class < MEMORY_LATENCY_SIZE_CLASSES)
+         ? size_class
+         : MEMORY_LATENCY_SIZE_CLASSES - 1;
+}
+
+/* Returns the histogram bucket of the given number of ticks. Below
+ * 2 * LATENCY_SUB_BUCKETS every number has its own bucket; above it, every
+ * power of two is split into LATENCY_SUB_BUCKETS buckets of equal width, so
+ * the error stays below 1 / LATENCY_SUB_BUCKETS.
+ */
+static uint32_t latency_bucket(uint64_t ticks)
+{
+  if (ticks < 2 * LATENCY_SUB_BUCKETS)
+  {
+    return (uint32_t) ticks;
+  }
+
+  uint32_t exponent = 63 - __builtin_clzll(ticks);
+  return 2 * LATENCY_SUB_BUCKETS
+       + (exponent - LATENCY_SUB_BITS - 1) * LATENCY_SUB_BUCKETS
+       + (uint32_t) ((ticks >> (exponent - LATENCY_SUB_BITS))
+                     & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* Returns the highest number of ticks that falls in the given bucket. */
+static uint64_t latency_bucket_limit(uint32_t bucket)
+{
+  if (bucket < 2 * LATENCY_SUB_BUCKETS)
+  {
+    return bucket;
+  }
+
+  uint32_t exponent = (bucket - 2 * LATENCY_SUB_BUCKETS) / LATENCY_SUB_BUCKETS
+                    + LATENCY_SUB_BITS + 1;
+  uint64_t sub = (bucket - 2 * LATENCY_SUB_BUCKETS) % LATENCY_SUB_BUCKETS;
+  uint64_t width = UINT64_C(1) << (exponent - LATENCY_SUB_BITS);
+
+  return ((LATENCY_SUB_BUCKETS + sub) * width) + (width - 1);
+}
+
+/* Counts an operation on count blocks that took the given number of ticks.
+ */
+static void latency_record(int operation, uint32_t count, uint64_t ticks)
+{
+  __atomic_fetch_add(&(latency_histograms[operation]
+                                         [latency_size_class(count)]
+                                         [latency_bucket(ticks)]),
+                     1, __ATOMIC_RELAXED);
+}
+
+/* Switches the latency recorder on or off. While it is on, every call of
+ * memory_allocate and memory_release is timed with the time stamp counter
+ * and counted in a histogram per operation and size class. Counts recorded
+ * earlier are kept.
+ *
+ * While it is off, each call only checks whether it is on.
+ */
+void memory_latency_enable(bool enabled)
+{
+  __atomic_store_n(&latency_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+/* Clears all histograms of the latency recorder. */
+void memory_latency_reset(void)
+{
+  for (int operation = 0; operation < MEMORY_LATENCY_OPERATIONS; operation++)
+  {
+    for (int size_class = 0; size_class < MEMORY_LATENCY_SIZE_CLASSES;
+         size_class++)
+    {
+      for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+      {
+        __atomic_store_n(&(latency_histograms[operation][size_class][bucket]),
+                         0, __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+/* Returns the number of recorded calls of the given operation, either
+ * MEMORY_LATENCY_ALLOCATE or MEMORY_LATENCY_RELEASE, in the given size
+ * class. See latency_size_class for the size classes.
+ */
+uint64_t memory_latency_count(int operation, uint32_t size_class)
+{
+  if (   (operation < 0) || (operation >= MEMORY_LATENCY_OPERATIONS)
+      || (size_class >= MEMORY_LATENCY_SIZE_CLASSES))
+  {
+    return 0;
+  }
+
+  uint64_t count = 0;
+  for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+  {
+    count += __atomic_load_n(&(latency_histograms[operation][size_class]
+                                                 [bucket]),
+                             __ATOMIC_RELAXED);
+  }
+
+  return count;
+}
+
+/* Returns the latency, in ticks of the time stamp counter, below which the
+ * given percentile, between 0 and 100, of the recorded calls of the given
+ * operation in the given size class stayed. It is rounded up to the limit
+ * of its histogram bucket.
+ *
+ * Returns zero when no calls were recorded.
+ */
+uint64_t memory_latency_percentile(int      operation,
+                                   uint32_t size_class,
+                                   double   percentile)
+{
+  uint64_t count = memory_latency_count(operation, size_class);
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t) (percentile / 100.0 * count + 0.5);
+  if (rank == 0)
+  {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  int bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1)
+  {
+    seen += __atomic_load_n(&(latency_histograms[operation][size_class]
+                                                [bucket]),
+                            __ATOMIC_RELAXED);
+    if (seen >= rank)
+    {
+      break;
+    }
+    bucket++;
+  }
+
+  return latency_bucket_limit(bucket);
+}
+
+/* Writes, for every operation and size class with recorded calls, the
+ * number of calls and the 50th, 99th and 99.9th percentile and the maximum
+ * of their latency, in ticks, as CSV. A size class is named after the
+ * largest number of blocks in it; the last class also holds all larger
+ * allocations.
+ */
+void memory_latency_write(FILE *out)
+{
+  static const char *names[MEMORY_LATENCY_OPERATIONS] =
+  {
+    "allocate",
+    "release"
+  };
+
+  fprintf(out, "operation,max_blocks,count,p50,p99,p99.9,max\n");
+  for (int operation = 0; operation < MEMORY_LATENCY_OPERATIONS; operation++)
+  {
+    for (uint32_t size_class = 0; size_class < MEMORY_LATENCY_SIZE_CLASSES;
+         size_class++)
+    {
+      uint64_t count = memory_latency_count(operation, size_class);
+      if (count == 0)
+      {
+        continue;
+      }
+
+      fprintf(out, "%s,%u,%llu,%llu,%llu,%llu,%llu\n",
+              names[operation], 1u << size_class, (unsigned long long) count,
+              (unsigned long long)
+                memory_latency_percentile(operation, size_class, 50.0),
+              (unsigned long long)
+                memory_latency_percentile(operation, size_class, 99.0),
+              (unsigned long long)
+                memory_latency_percentile(operation, size_class, 99.9),
+              (unsigned long long)
+                memory_latency_percentile(operation, size_class, 100.0));
+    }
+  }
+}
+
+#else
+/* A tier has neither the profiler nor the latency recorder, see
+ * memory_priv.h. Their switches stay off, so these are never called.
+ */
+static void profile_allocation(uint8_t *address, uint32_t size)
+{
+}
+
+static void profile_release(const void *ptr)
+{
+}
+
+static void profile_forget_live(void)
+{
+}
+
+static uint64_t latency_now(void)
+{
+  return 0;
+}
+
+static void latency_record(int operation, uint32_t count, uint64_t ticks)
+{
+}
+#endif
+
+/* Returns the number of fixed buffers in which memory_io_register splits the
+ * heap.
+ */
+static uint32_t io_slices(void)
+{
+  return IO_SLICES;
+}
+
+/* Registers the heap of the active segment with the io_uring instance
+ * ring_fd as fixed buffers, with IORING_REGISTER_BUFFERS. The kernel then
+ * pins its pages once, instead of for every operation, and READ_FIXED and
+ * WRITE_FIXED operations can take their buffers from any allocation; see
+ * memory_io_buffer for their buffer index.
+ *
+ * The heap is registered in slices of MEMORY_IO_SLICE bytes, the largest
+ * fixed buffer the kernel accepts, so a heap of up to MEMORY_IO_SLICE
+ * bytes is buffer 0.
+ *
+ * The whole heap is registered, including the blocks that are free or that
+ * other threads or processes allocated, so the ring can read and write any
+ * of them; the caller must only pass buffers it owns.
+ *
+ * Returns false, with errno set, when the kernel refuses, e.g. because the
+ * ring already has buffers or the pages can not be locked.
+ */
+bool memory_io_register(int ring_fd)
+{
+  struct iovec iov[IO_SLICES];
+
+  for (uint32_t i = 0; i < IO_SLICES; i++)
+  {
+    uint64_t start = (uint64_t) i * MEMORY_IO_SLICE;
+    iov[i].iov_base = &(heap[start]);
+    iov[i].iov_len = (HEAP_SIZE - start < MEMORY_IO_SLICE)
+                     ? HEAP_SIZE - start
+                     : MEMORY_IO_SLICE;
+  }
+
+  return syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS,
+                 iov, IO_SLICES) == 0;
+}
+
+/* Unregisters the fixed buffers of the io_uring instance ring_fd, which
+ * unpins the pages of the heap.
+ *
+ * Returns false, with errno set, when the ring has no buffers.
+ */
+bool memory_io_unregister(int ring_fd)
+{
+  return syscall(SYS_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS,
+                 NULL, 0) == 0;
+}
+
+/* Returns the index of the fixed buffer, registered by memory_io_register,
+ * that holds the size bytes at ptr, and sets offset to the offset of ptr in
+ * that buffer. A READ_FIXED or WRITE_FIXED operation on those bytes uses
+ * ptr as its address and this index as its buf_index.
+ *
+ * Returns -1 when the bytes are not all in the heap or not all in the same
+ * buffer.
+ */
+int memory_io_buffer(const void *ptr, uint32_t size, uint64_t *offset)
+{
+  if (!memory_contains(ptr) || (size == 0))
+  {
+    return -1;
+  }
+
+  uint64_t start = (uint64_t) ((const uint8_t *) ptr - heap);
+  uint64_t end = start + size - 1;
+  if ((end >= HEAP_SIZE) || (start / MEMORY_IO_SLICE != end / MEMORY_IO_SLICE))
+  {
+    return -1;
+  }
+
+  if (offset != NULL)
+  {
+    *offset = start % MEMORY_IO_SLICE;
+  }
+
+  return (int) (start / MEMORY_IO_SLICE);
+}
+
+#ifndef MEMORY_TIER
+/* Returns the first block of the first run of count free blocks of the
+ * bitmap heap from block first on, or from the start of the bitmap heap if
+ * there is none. Words that are completely used or completely free are
+ * skipped at once.
+ *
+ * The bitmap can change during the search, so the run is only a candidate
+ * for bitmap_claim. Returns BITMAP_BLOCKS when there is no run.
+ */
+static uint32_t bitmap_find(uint32_t count, uint32_t first)
+{
+  for (int pass = 0; pass < 2; pass++)
+  {
+    uint32_t run_length = 0;
+    uint32_t i = (pass == 0) ? first : 0;
+
+    while (i < BITMAP_BLOCKS)
+    {
+      uint64_t word = __atomic_load_n(&(bitmap_words[i / 64]),
+                                      __ATOMIC_RELAXED);
+
+      if (((i % 64) == 0) && (word == UINT64_MAX))
+      {
+        run_length = 0;
+        i += 64;
+      }
+      else if (((i % 64) == 0) && (word == 0))
+      {
+        if (run_length + 64 >= count)
+        {
+          return i - run_length;
+        }
+        run_length += 64;
+        i += 64;
+      }
+      else
+      {
+        run_length = ((word >> (i % 64)) & 1) ? 0 : run_length + 1;
+        if (run_length == count)
+        {
+          return i + 1 - count;
+        }
+        i++;
+      }
+    }
+  }
+
+  return BITMAP_BLOCKS;
+}
+
+/* Sets the bits of the count blocks from block start on, one word at a
+ * time, with compare-and-swap.
+ *
+ * Returns false, after clearing the bits it already set, when another
+ * thread claimed one of the blocks first.
+ */
+static bool bitmap_claim(uint32_t start, uint32_t count)
+{
+  uint32_t end = start + count;
+
+  for (uint32_t i = start; i < end; )
+  {
+    uint32_t shift = i % 64;
+    uint32_t length = (end - i < 64 - shift) ? end - i : 64 - shift;
+    uint64_t mask = ((length == 64) ? UINT64_MAX
+                                    : ((UINT64_C(1) << length) - 1)) << shift;
+
+    uint64_t word = __atomic_load_n(&(bitmap_words[i / 64]), __ATOMIC_RELAXED);
+    do
+    {
+      if ((word & mask) != 0)
+      {
+        bitmap_clear(start, i - start);
+        return false;
+      }
+    }
+    while (!__atomic_compare_exchange_n(&(bitmap_words[i / 64]), &word,
+                                        word | mask, true, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED));
+
+    i += length;
+  }
+
+  return true;
+}
+
+/* Clears the bits of the count blocks from block start on, with an atomic
+ * AND per word.
+ */
+static void bitmap_clear(uint32_t start, uint32_t count)
+{
+  uint32_t end = start + count;
+
+  for (uint32_t i = start; i < end; )
+  {
+    uint32_t shift = i % 64;
+    uint32_t length = (end - i < 64 - shift) ? end - i : 64 - shift;
+    uint64_t mask = ((length == 64) ? UINT64_MAX
+                                    : ((UINT64_C(1) << length) - 1)) << shift;
+
+    __atomic_fetch_and(&(bitmap_words[i / 64]), ~mask, __ATOMIC_RELEASE);
+
+    i += length;
+  }
+}
+
+/* Initializes the lock-free bitmap heap: a heap of BITMAP_BLOCKS blocks of
+ * its own, next to the heap of the segment, in which every block is free.
+ *
+ * Just like memory_initialize, this may not run at the same time as any
+ * other function of the bitmap heap.
+ */
+void memory_bitmap_initialize(void)
+{
+  memset(bitmap_words, 0, sizeof(bitmap_words));
+  memset(bitmap_counts, 0, sizeof(bitmap_counts));
+
+  /* The bits after the last block are used for good */
+  if ((BITMAP_BLOCKS % 64) != 0)
+  {
+    bitmap_words[BITMAP_WORDS - 1] = UINT64_MAX << (BITMAP_BLOCKS % 64);
+  }
+}
+
+/* Allocates size contiguous bytes from the bitmap heap, without a lock.
+ *
+ * Who owns a block is kept in a bitmap of 64-bit words only. A thread looks
+ * for a run of free blocks from the word where its last allocation ended,
+ * so threads spread over the bitmap, and claims it with compare-and-swap,
+ * word by word for a run that spans words. When another thread wins one of
+ * those words, the thread gives back what it claimed and searches again.
+ *
+ * Returns NULL if size is zero or no run of free blocks is large enough.
+ */
+void *memory_bitmap_allocate(uint32_t size)
+{
+  uint32_t count = required_number_of_contiguous_blocks(size);
+  if ((count == 0) || (count > BITMAP_BLOCKS))
+  {
+    return NULL;
+  }
+
+  if (bitmap_hint == 0)
+  {
+    bitmap_hint = 1 + (uint32_t) (((uintptr_t) &bitmap_hint >> 6)
+                                  % BITMAP_WORDS);
+  }
+
+  for (;;)
+  {
+    uint32_t start = bitmap_find(count, (bitmap_hint - 1) * 64);
+    if (start == BITMAP_BLOCKS)
+    {
+      return NULL;
+    }
+
+    if (bitmap_claim(start, count))
+    {
+      __atomic_store_n(&(bitmap_counts[start]), count, __ATOMIC_RELEASE);
+      bitmap_hint = 1 + ((start + count) / 64) % BITMAP_WORDS;
+      return &(bitmap_heap[start * BLOCK_SIZE]);
+    }
+  }
+}
+
+/* Releases an allocation of memory_bitmap_allocate, without a lock, by
+ * clearing its bits with an atomic AND per word.
+ *
+ * Returns false when the pointer is not the start of a live allocation of
+ * the bitmap heap. Of two releases of the same pointer, only one succeeds.
+ */
+bool memory_bitmap_release(void *ptr)
+{
+  uint8_t *address = (uint8_t *) ptr;
+  if (   (address < bitmap_heap)
+      || (address >= &(bitmap_heap[BITMAP_BLOCKS * BLOCK_SIZE]))
+      || (((address - bitmap_heap) % BLOCK_SIZE) != 0))
+  {
+    return false;
+  }
+
+  uint32_t start = (uint32_t) ((address - bitmap_heap) / BLOCK_SIZE);
+  uint32_t count = __atomic_exchange_n(&(bitmap_counts[start]), 0,
+                                       __ATOMIC_ACQ_REL);
+  if (count == 0)
+  {
+    return false;
+  }
+
+  bitmap_clear(start, count);
+
+  return true;
+}
+
+/* Returns the number of free bytes in the bitmap heap. */
+uint32_t memory_bitmap_available(void)
+{
+  uint32_t used = 0;
+  for (uint32_t w = 0; w < BITMAP_WORDS; w++)
+  {
+    used += __builtin_popcountll(__atomic_load_n(&(bitmap_words[w]),
+                                                 __ATOMIC_RELAXED));
+  }
+
+  return (BITMAP_WORDS * 64 - used) * BLOCK_SIZE;
+}
+
+/* Initializes the ring buffer heap: a heap of RING_BLOCKS blocks of its
+ * own, for allocations that are released in about the order in which they
+ * were made, such as the messages of a queue.
+ *
+ * This may not run at the same time as any other function of the ring
+ * buffer heap.
+ */
+void memory_ring_initialize(void)
+{
+  memset(ring_counts, 0, sizeof(ring_counts));
+  memset(ring_released, 0, sizeof(ring_released));
+  ring_head = 0;
+  ring_tail = 0;
+  ring_used = 0;
+}
+
+/* Appends a chain of count blocks at the head of the ring.
+ *
+ * Preconditions:
+ *   - the ring has count free blocks from ring_head on, before its end
+ */
+static void ring_push(uint32_t count, bool released)
+{
+  ring_counts[ring_head] = count;
+  ring_released[ring_head] = released;
+  ring_head = (ring_head + count) % RING_BLOCKS;
+  ring_used += count;
+}
+
+/* Allocates size contiguous bytes from the ring buffer heap, at its head.
+ * When they do not fit before the end of the ring anymore, the rest of the
+ * ring is skipped and they are taken from its start. Either way, this only
+ * moves the head, in constant time.
+ *
+ * Returns NULL if size is zero or the ring has no room: the allocations
+ * that were not released yet, in order, fill it.
+ */
+void *memory_ring_allocate(uint32_t size)
+{
+  uint32_t count = required_number_of_contiguous_blocks(size);
+  if ((count == 0) || (count > RING_BLOCKS))
+  {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&ring_lock);
+
+  uint8_t *address = NULL;
+
+  if (ring_used == 0)
+  {
+    ring_head = 0;
+    ring_tail = 0;
+  }
+
+  uint32_t skipped = (ring_head + count > RING_BLOCKS)
+                     ? RING_BLOCKS - ring_head
+                     : 0;
+  if (   (ring_used + skipped + count <= RING_BLOCKS)
+      && ((skipped == 0) || (count <= ring_tail)))
+  {
+    if (skipped > 0)
+    {
+      ring_push(skipped, true);
+    }
+    address = &(ring_heap[ring_head * BLOCK_SIZE]);
+    ring_push(count, false);
+  }
+
+  pthread_mutex_unlock(&ring_lock);
+
+  return address;
+}
+
+/* Releases an allocation of memory_ring_allocate. When it is the oldest one
+ * in the ring, the tail moves past it and past every allocation after it
+ * that was released already; otherwise it is only marked, and the tail
+ * skips it later. Every allocation is passed by the tail once, so this
+ * takes constant time on average.
+ *
+ * Returns false when the pointer is not the start of a live allocation of
+ * the ring buffer heap.
+ */
+bool memory_ring_release(void *ptr)
+{
+  uint8_t *address = (uint8_t *) ptr;
+  if (   (address < ring_heap)
+      || (address >= &(ring_heap[RING_BLOCKS * BLOCK_SIZE]))
+      || (((address - ring_heap) % BLOCK_SIZE) != 0))
+  {
+    return false;
+  }
+
+  uint32_t index = (uint32_t) ((address - ring_heap) / BLOCK_SIZE);
+
+  pthread_mutex_lock(&ring_lock);
+
+  bool released = (ring_counts[index] != 0) && !ring_released[index];
+  if (released)
+  {
+    ring_released[index] = true;
+
+    while ((ring_used > 0) && ring_released[ring_tail])
+    {
+      uint32_t count = ring_counts[ring_tail];
+      ring_counts[ring_tail] = 0;
+      ring_released[ring_tail] = false;
+      ring_tail = (ring_tail + count) % RING_BLOCKS;
+      ring_used -= count;
+    }
+  }
+
+  pthread_mutex_unlock(&ring_lock);
+
+  return released;
+}
+
+/* Returns the number of free bytes in the ring buffer heap. Not all of them
+ * may be contiguous, as the ring wraps around.
+ */
+uint32_t memory_ring_available(void)
+{
+  pthread_mutex_lock(&ring_lock);
+  uint32_t available = (RING_BLOCKS - ring_used) * BLOCK_SIZE;
+  pthread_mutex_unlock(&ring_lock);
+
+  return available;
+}
+
+/* Creates the key whose destructor gives up the epoch slot of a thread when
+ * the thread exits, and makes forked children forget the slots of the
+ * threads that they did not inherit.
+ */
+static void epoch_key_create(void)
+{
+  pthread_key_create(&epoch_key, epoch_thread_exit);
+  pthread_atfork(NULL, NULL, epoch_fork_child);
+}
+
+/* Only the thread that called fork lives on in the child. */
+static void epoch_fork_child(void)
+{
+  for (uint32_t i = 0; i < EPOCH_THREADS; i++)
+  {
+    if (i + 1 != epoch_slot)
+    {
+      epoch_threads[i].pin = 0;
+      epoch_threads[i].taken = false;
+    }
+  }
+  epoch_unregistered = ((epoch_slot == 0) && (epoch_depth > 0)) ? 1 : 0;
+}
+
+/* Gives up the epoch slot of an exiting thread, even when the thread is
+ * still in a critical section.
+ */
+static void epoch_thread_exit(void *thread)
+{
+  struct epoch_thread *slot = (struct epoch_thread *) thread;
+  __atomic_store_n(&(slot->pin), 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&(slot->taken), false, __ATOMIC_RELEASE);
+}
+
+/* Claims a free epoch slot for the calling thread. When all EPOCH_THREADS
+ * slots are taken, epoch_slot stays 0.
+ */
+static void epoch_register(void)
+{
+  pthread_once(&epoch_once, epoch_key_create);
+
+  for (uint32_t i = 0; i < EPOCH_THREADS; i++)
+  {
+    bool expected = false;
+    if (__atomic_compare_exchange_n(&(epoch_threads[i].taken), &expected,
+                                    true, false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED))
+    {
+      pthread_setspecific(epoch_key, &(epoch_threads[i]));
+      epoch_slot = i + 1;
+      return;
+    }
+  }
+}
+
+/* Starts a critical section of a reader. Until the matching
+ * memory_epoch_exit, no chain that memory_retire accepts from then on, or
+ * that it accepted while the reader could still reach it, goes back to the
+ * free list. This takes one store in the slot of the thread, which no other
+ * reader writes to.
+ *
+ * Critical sections may be nested. A thread that finds no free slot is
+ * counted instead, and holds back all reclamation while it is inside.
+ */
+void memory_epoch_enter(void)
+{
+  if (epoch_depth++ > 0)
+  {
+    return;
+  }
+
+  if (epoch_slot == 0)
+  {
+    epoch_register();
+  }
+
+  if (epoch_slot == 0)
+  {
+    __atomic_fetch_add(&epoch_unregistered, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+
+  /* The pin must be visible before the reader loads any pointer */
+  uint64_t epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&(epoch_threads[epoch_slot-1].pin), (epoch << 1) | 1,
+                   __ATOMIC_SEQ_CST);
+}
+
+/* Ends a critical section of memory_epoch_enter. */
+void memory_epoch_exit(void)
+{
+  assert(epoch_depth > 0);
+  if (--epoch_depth > 0)
+  {
+    return;
+  }
+
+  if (epoch_slot == 0)
+  {
+    __atomic_fetch_sub(&epoch_unregistered, 1, __ATOMIC_RELEASE);
+  }
+  else
+  {
+    __atomic_store_n(&(epoch_threads[epoch_slot-1].pin), 0, __ATOMIC_RELEASE);
+  }
+}
+
+/* Moves the epoch from e to e + 1 when every reader in a critical section
+ * started it in epoch e, and then releases the chains that were retired in
+ * epoch e - 1: every reader that could still reach them has left its
+ * critical section. released is increased by their number.
+ *
+ * Returns false when a reader still holds the epoch back.
+ *
+ * Preconditions:
+ *   - the lock of the segment is held
+ */
+static bool epoch_advance_locked(uint32_t *released)
+{
+  uint64_t epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+  uint64_t pin = (epoch << 1) | 1;
+
+  if (__atomic_load_n(&epoch_unregistered, __ATOMIC_SEQ_CST) != 0)
+  {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < EPOCH_THREADS; i++)
+  {
+    uint64_t other = __atomic_load_n(&(epoch_threads[i].pin),
+                                     __ATOMIC_SEQ_CST);
+    if ((other != 0) && (other != pin))
+    {
+      return false;
+    }
+  }
+
+  __atomic_store_n(&epoch_global, epoch + 1, __ATOMIC_SEQ_CST);
+
+  uint32_t *list = &(segment->retired[(epoch + 1) % 2]);
+  while (*list != 0)
+  {
+    uint32_t index = *list - 1;
+    *list = retired_next[index];
+    release_chain(&(pool_of_blocks[index]));
+    (*released)++;
+  }
+
+  return true;
+}
+
+/* Retires an allocation of memory_allocate: it is released like with
+ * memory_release, but only once no reader that is in a critical section of
+ * memory_epoch_enter now can still use it. The caller must first make the
+ * allocation unreachable for new readers.
+ *
+ * The chain is queued in the current epoch. Every EPOCH_BATCH chains, the
+ * epoch is moved forward when the readers allow it, and the chains of two
+ * epochs ago go back to the free list together, under a single lock. Until
+ * then, they count as used.
+ *
+ * Returns false for the same pointers as memory_release.
+ */
+bool memory_retire(void *ptr)
+{
+  uint32_t released = 0;
+
+  if (__atomic_load_n(&profile_live, __ATOMIC_RELAXED) != 0)
+  {
+    profile_release(ptr);
+  }
+
+  segment_lock();
+
+  struct block *block = block_of_allocation(ptr);
+  if (   (block != NULL)
+      && (   (block_flags_load(block_index(block->address)) & BLOCK_MOVABLE)
+          != 0))
+  {
+    block = NULL;
+  }
+
+  if (block != NULL)
+  {
+    /* A concurrent memory_release of the same pointer may have cached it */
+    uint32_t index = block_index(block->address);
+    uint8_t flags = __atomic_fetch_or(&(block_flags[index]), BLOCK_RETIRED,
+                                      __ATOMIC_RELAXED);
+    if ((flags & BLOCK_CACHED) != 0)
+    {
+      __atomic_fetch_and(&(block_flags[index]), (uint8_t) ~BLOCK_RETIRED,
+                         __ATOMIC_RELAXED);
+      block = NULL;
+    }
+  }
+
+  if (block != NULL)
+  {
+    uint32_t index = block_index(block->address);
+    uint32_t *list = &(segment->retired[epoch_global % 2]);
+    retired_next[index] = *list;
+    *list = index + 1;
+
+    if (++segment->retired_count >= EPOCH_BATCH)
+    {
+      segment->retired_count = 0;
+      epoch_advance_locked(&released);
+    }
+  }
+
+  segment_unlock();
+
+  return (block != NULL);
+}
+
+/* Moves the epoch forward twice, as far as the readers allow, and so
+ * releases every retired chain once no reader is in a critical section.
+ * Useful when no more chains are retired for a while.
+ *
+ * Returns the number of chains released.
+ */
+uint32_t memory_epoch_reclaim(void)
+{
+  uint32_t released = 0;
+
+  segment_lock();
+
+  segment->retired_count = 0;
+  if (epoch_advance_locked(&released))
+  {
+    epoch_advance_locked(&released);
+  }
+
+  segment_unlock();
+
+  return released;
 }
+#endif
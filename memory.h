@@ -3,6 +3,68 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint32_t memory_handle_t;
+
+/* A compressed reference to an address in the heap, see memory_ref. */
+typedef uint32_t memory_ref_t;
+
+#define MEMORY_REF_NULL  0
+
+/* Every allocation starts at an address that is a multiple of this. */
+#define MEMORY_ALIGNMENT  16
+
+/* A heap snapshot, as written by memory_snapshot_write, is this header,
+ * followed by one state byte and one uint32_t alloc_count for every block,
+ * and then by the start and the length, both uint32_t, of every free run.
+ * All numbers are in the byte order of the machine that wrote it.
+ *
+ * wilderness is the index of the first block of the wilderness, the blocks
+ * that have the state MEMORY_SNAPSHOT_WILDERNESS. They are contiguous, but
+ * free runs of long-lived allocations can follow them.
+ */
+#define MEMORY_SNAPSHOT_MAGIC    0x50414d48
+#define MEMORY_SNAPSHOT_VERSION  1
+
+struct memory_snapshot_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t heap_size;
+  uint32_t block_size;
+  uint32_t blocks;
+  uint32_t wilderness;
+  uint32_t runs;
+};
+
+/* The state byte of a block: one of the states, possibly with flags. */
+#define MEMORY_SNAPSHOT_FREE        0
+#define MEMORY_SNAPSHOT_WILDERNESS  1
+#define MEMORY_SNAPSHOT_HEAD        2
+#define MEMORY_SNAPSHOT_BODY        3
+#define MEMORY_SNAPSHOT_CACHED      4
+#define MEMORY_SNAPSHOT_STATE       0x0f
+#define MEMORY_SNAPSHOT_MOVABLE     0x40
+#define MEMORY_SNAPSHOT_DIRTY       0x80
+
+/* The operations and the number of size classes of the latency recorder. */
+#define MEMORY_LATENCY_ALLOCATE      0
+#define MEMORY_LATENCY_RELEASE       1
+#define MEMORY_LATENCY_OPERATIONS    2
+#define MEMORY_LATENCY_SIZE_CLASSES  8
+
+/* The largest fixed buffer of memory_io_register, 1 GiB. */
+#define MEMORY_IO_SLICE  (UINT32_C(1) << 30)
+
+/* The lifetimes of memory_allocate_hint. */
+#define MEMORY_LIFETIME_SHORT  0
+#define MEMORY_LIFETIME_LONG   1
 
 void memory_test(void);
 
@@ -12,8 +74,124 @@ uint32_t memory_available(void);
 
 uint32_t memory_used(void);
 
+bool memory_contains(const void *ptr);
+
+memory_ref_t memory_ref(const void *ptr);
+
+void *memory_deref(memory_ref_t ref);
+
 void *memory_allocate(uint32_t size);
 
+void *memory_allocate_zeroed(uint32_t size);
+
+void *memory_allocate_hint(uint32_t size, int lifetime);
+
+void *memory_allocate_near(const void *hint_ptr, uint32_t size);
+
+void *memory_allocate_wait(uint32_t size, int timeout);
+
 bool memory_release(void *ptr);
 
+uint32_t memory_usable_size(const void *ptr);
+
+void memory_flush_thread_cache(void);
+
+memory_handle_t memory_allocate_handle(uint32_t size);
+
+void *memory_pin(memory_handle_t handle);
+
+void memory_unpin(memory_handle_t handle);
+
+bool memory_release_handle(memory_handle_t handle);
+
+void memory_compact(void);
+
+int memory_allocate_iov(uint32_t size, struct iovec *out, int max);
+
+bool memory_release_iov(const struct iovec *iov, int count);
+
+bool memory_initialize_shared(const char *name);
+
+/* Maps the segment at the address it has in the process that created it.
+ * Fails with errno EADDRINUSE when that range is in use in this process.
+ */
+bool memory_attach_shared(const char *name);
+
+void memory_detach_shared(void);
+
+bool memory_open_persistent(const char *path, bool *restored);
+
+void memory_close_persistent(void);
+
+void memory_set_root(void *ptr);
+
+void *memory_get_root(void);
+
+bool memory_snapshot_write(FILE *out);
+
+void memory_profile_set_interval(uint32_t interval);
+
+void memory_profile_write_pprof(FILE *out);
+
+void memory_profile_write_collapsed(FILE *out, bool live);
+
+void memory_latency_enable(bool enabled);
+
+void memory_latency_reset(void);
+
+uint64_t memory_latency_count(int operation, uint32_t size_class);
+
+uint64_t memory_latency_percentile(int      operation,
+                                   uint32_t size_class,
+                                   double   percentile);
+
+void memory_latency_write(FILE *out);
+
+void memory_tiers_initialize(void);
+
+void *memory_tiers_allocate(uint32_t size);
+
+bool memory_tiers_release(void *ptr);
+
+uint32_t memory_tiers_usable_size(const void *ptr);
+
+uint32_t memory_tiers_available(void);
+
+/* Registers the whole heap with the ring, including blocks the caller does
+ * not own: any fixed-buffer operation on the ring can read or write them.
+ */
+bool memory_io_register(int ring_fd);
+
+bool memory_io_unregister(int ring_fd);
+
+int memory_io_buffer(const void *ptr, uint32_t size, uint64_t *offset);
+
+void memory_bitmap_initialize(void);
+
+void *memory_bitmap_allocate(uint32_t size);
+
+bool memory_bitmap_release(void *ptr);
+
+uint32_t memory_bitmap_available(void);
+
+void memory_ring_initialize(void);
+
+void *memory_ring_allocate(uint32_t size);
+
+bool memory_ring_release(void *ptr);
+
+uint32_t memory_ring_available(void);
+
+void memory_epoch_enter(void);
+
+void memory_epoch_exit(void);
+
+bool memory_retire(void *ptr);
+
+uint32_t memory_epoch_reclaim(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
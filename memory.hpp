@@ -0,0 +1,163 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+#include "memory.h"
+
+/* A std::pmr::memory_resource on top of memory_allocate and memory_release,
+ * so that pmr containers keep their elements in the block heap.
+ *
+ * Every allocation of the heap is aligned to MEMORY_ALIGNMENT. Requests for
+ * a larger alignment go to the upstream resource instead, which is known
+ * again from the alignment when they are deallocated. Throws std::bad_alloc
+ * when the heap has no room, as any memory_resource does.
+ *
+ * The heap must have been initialized with memory_initialize, or a shared
+ * or persistent heap attached, before the first allocation.
+ */
+class memory_block_resource : public std::pmr::memory_resource
+{
+public:
+  explicit memory_block_resource(
+    std::pmr::memory_resource *upstream = std::pmr::new_delete_resource())
+    : upstream_(upstream)
+  {
+  }
+
+  std::pmr::memory_resource *upstream_resource() const
+  {
+    return upstream_;
+  }
+
+private:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    if (alignment > MEMORY_ALIGNMENT)
+    {
+      return upstream_->allocate(bytes, alignment);
+    }
+
+    if (bytes > std::numeric_limits<uint32_t>::max())
+    {
+      throw std::bad_alloc();
+    }
+
+    /* memory_allocate refuses zero bytes, a memory_resource may not */
+    void *ptr = memory_allocate((bytes == 0) ? 1 : (uint32_t) bytes);
+    if (ptr == nullptr)
+    {
+      throw std::bad_alloc();
+    }
+
+    return ptr;
+  }
+
+  void do_deallocate(void *ptr, std::size_t bytes,
+                     std::size_t alignment) override
+  {
+    if (alignment > MEMORY_ALIGNMENT)
+    {
+      upstream_->deallocate(ptr, bytes, alignment);
+      return;
+    }
+
+    memory_release(ptr);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other)
+    const noexcept override
+  {
+    /* All resources share the one heap, but not their upstream */
+    const memory_block_resource *resource =
+      dynamic_cast<const memory_block_resource *>(&other);
+    return (resource != nullptr) && (resource->upstream_ == upstream_);
+  }
+
+  std::pmr::memory_resource *upstream_;
+};
+
+/* Returns a memory_block_resource with the default upstream, for the
+ * allocators that are not given one.
+ */
+inline memory_block_resource *memory_default_block_resource()
+{
+  static memory_block_resource resource;
+  return &resource;
+}
+
+/* An allocator for the standard containers that takes its memory from a
+ * memory_block_resource, so it honours alignment in the same way.
+ *
+ * It is stateful: two allocators are equal, and can free each other's
+ * memory, when their resources are equal. The resource follows a container
+ * when it is copied, moved or swapped.
+ */
+template <typename T>
+class memory_block_allocator
+{
+public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  memory_block_allocator() noexcept
+    : resource_(memory_default_block_resource())
+  {
+  }
+
+  explicit memory_block_allocator(memory_block_resource *resource) noexcept
+    : resource_(resource)
+  {
+  }
+
+  template <typename U>
+  memory_block_allocator(const memory_block_allocator<U> &other) noexcept
+    : resource_(other.resource())
+  {
+  }
+
+  T *allocate(std::size_t n)
+  {
+    if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+    {
+      throw std::bad_array_new_length();
+    }
+
+    return static_cast<T *>(resource_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *ptr, std::size_t n) noexcept
+  {
+    resource_->deallocate(ptr, n * sizeof(T), alignof(T));
+  }
+
+  memory_block_resource *resource() const noexcept
+  {
+    return resource_;
+  }
+
+private:
+  memory_block_resource *resource_;
+};
+
+template <typename T, typename U>
+bool operator==(const memory_block_allocator<T> &a,
+                const memory_block_allocator<U> &b) noexcept
+{
+  return a.resource()->is_equal(*b.resource());
+}
+
+template <typename T, typename U>
+bool operator!=(const memory_block_allocator<T> &a,
+                const memory_block_allocator<U> &b) noexcept
+{
+  return !(a == b);
+}
+
+#endif
@@ -1,18 +1,154 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
+#ifdef MEMORY_TIER
+#include "memory_tier.h"
+#endif
 #include "memory.h"
 
 /****************************************************************************
  * De configuratie van de heap
  ****************************************************************************/
 
+/* Beide kunnen bij het compileren overschreven worden, zoals voor de
+ * benchmarks, bv. met -DHEAP_SIZE=524288.
+ */
+#ifndef HEAP_SIZE
 #define HEAP_SIZE   1024
+#endif
+#ifndef BLOCK_SIZE
 #define BLOCK_SIZE  64
+#endif
 
 #define NUMBER_OF_BLOCKS  ((HEAP_SIZE) / (BLOCK_SIZE))
 
+/* De opcodes van io_uring_register die memory_io_register gebruikt.
+ * <linux/io_uring.h> wordt niet ingelezen, omdat het via <linux/fs.h> een
+ * eigen BLOCK_SIZE definieert.
+ */
+#define IORING_REGISTER_BUFFERS    0
+#define IORING_UNREGISTER_BUFFERS  1
+
+/* Het aantal fixed buffers waarin memory_io_register de heap opdeelt, elk
+ * hoogstens MEMORY_IO_SLICE bytes. Als constante kan de iovec-array op de
+ * stack een vaste grootte hebben.
+ */
+#define IO_SLICES                                                          \
+  ((uint32_t) (((uint64_t) (HEAP_SIZE) + MEMORY_IO_SLICE - 1)             \
+               / MEMORY_IO_SLICE))
+
+/* Elk blok begint op een veelvoud van MEMORY_ALIGNMENT, zoals memory.h
+ * belooft, omdat ook de heap zelf daarop begint. Een macht van twee laat de
+ * compiler delen door BLOCK_SIZE als een shift doen.
+ */
+_Static_assert(((BLOCK_SIZE) & ((BLOCK_SIZE) - 1)) == 0,
+               "BLOCK_SIZE must be a power of two");
+_Static_assert((BLOCK_SIZE) % MEMORY_ALIGNMENT == 0,
+               "BLOCK_SIZE must be a multiple of MEMORY_ALIGNMENT");
+
+/* Vlaggen die per blok van de heap bijgehouden worden in block_flags.
+ *
+ * BLOCK_DIRTY: het blok werd sinds de start van het programma minstens een
+ *              keer toegekend en bevat dus mogelijk andere bytes dan nul.
+ * BLOCK_HEAD:  het blok is het eerste blok van een toegekend geheugendeel.
+ * BLOCK_BODY:  het blok hoort bij een toegekend geheugendeel, maar is niet
+ *              het eerste blok ervan.
+ * BLOCK_MOVABLE: het blok is het eerste blok van een geheugendeel dat via
+ *              een handle toegekend werd en door memory_compact verplaatst
+ *              mag worden.
+ * BLOCK_CACHED: het blok is het eerste blok van een geheugendeel dat
+ *              vrijgegeven werd, maar nog in de thread cache of de remote
+ *              free queue van een thread, of in een CPU cache zit. Het
+ *              geheugendeel zit nog in de used list.
+ * BLOCK_LONG_LIVED: het blok is het eerste blok van een geheugendeel dat
+ *              memory_allocate_hint aan het einde van de heap plaatste. Het
+ *              gaat bij het vrijgeven meteen naar de free list, zodat een
+ *              kortlevend geheugendeel het niet via een cache overneemt.
+ * BLOCK_RETIRED: het blok is het eerste blok van een geheugendeel dat aan
+ *              memory_retire gegeven werd. Het zit nog in de used list tot
+ *              geen enkele lezer het meer kan zien.
+ *
+ * Een blok zonder BLOCK_HEAD en zonder BLOCK_BODY is vrij.
+ */
+#define BLOCK_DIRTY    0x01
+#define BLOCK_HEAD     0x02
+#define BLOCK_BODY     0x04
+#define BLOCK_MOVABLE  0x08
+#define BLOCK_CACHED   0x10
+#define BLOCK_LONG_LIVED  0x20
+#define BLOCK_RETIRED  0x40
+
+/* Elke thread houdt de laatst vrijgegeven geheugendelen van 1 tot
+ * THREAD_CACHE_BINS blokken bij in zijn thread cache, tot
+ * THREAD_CACHE_DEPTH geheugendelen per aantal blokken.
+ */
+#define THREAD_CACHE_BINS   4
+#define THREAD_CACHE_DEPTH  8
+
+/* Het aantal blokken van de lock-free bitmap heap, en het aantal woorden van
+ * 64 bits van zijn bitmap.
+ */
+#ifndef BITMAP_BLOCKS
+#define BITMAP_BLOCKS  256
+#endif
+#define BITMAP_WORDS   (((BITMAP_BLOCKS) + 63) / 64)
+
+/* Het aantal blokken van de ring buffer heap. */
+#ifndef RING_BLOCKS
+#define RING_BLOCKS  256
+#endif
+
+/* Het aantal threads dat tegelijk een epoch slot kan hebben, en het aantal
+ * geheugendelen dat memory_retire aanneemt voor het de epoch probeert te
+ * verhogen.
+ */
+#ifndef EPOCH_THREADS
+#define EPOCH_THREADS  64
+#endif
+#ifndef EPOCH_BATCH
+#define EPOCH_BATCH  8
+#endif
+
+/* Het aantal threads dat tegelijk een remote free queue kan hebben. */
+#define REMOTE_QUEUES  16
+
+/* De sampling heap profiler onderscheidt tot PROFILE_SITES call sites en
+ * houdt per call site tot PROFILE_DEPTH frames van de stack trace bij.
+ */
+#define PROFILE_SITES  64
+#define PROFILE_DEPTH  16
+
+/* De histogrammen van de latency recorder verdelen elke macht van twee in
+ * LATENCY_SUB_BUCKETS = 2^LATENCY_SUB_BITS buckets, zodat elke 64 bit waarde
+ * in een van de LATENCY_BUCKETS buckets valt.
+ */
+#define LATENCY_SUB_BITS     3
+#define LATENCY_SUB_BUCKETS  (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS      \
+  (2 * LATENCY_SUB_BUCKETS + (63 - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS)
+
+/* Het aantal CPU caches. Een CPU gebruikt de CPU cache met als index zijn
+ * nummer modulo CPU_CACHES; de CPU caches samen vormen een kleine gedeelde
+ * cache achter de thread caches.
+ */
+#define CPU_CACHES  8
+
 /****************************************************************************
  * Interne gegevensstructuren die gebruikt worden om de boekhouding van het
  * dynamisch geheugengebruik bij te houden.
@@ -32,18 +168,311 @@ struct list
   struct block *last;
 };
 
+/* Een handle verwijst naar een verplaatsbaar geheugendeel via de index van
+ * zijn eerste blok. Zolang pin_count niet nul is, wordt het niet verplaatst.
+ */
+struct handle
+{
+  uint32_t block;
+  uint32_t pin_count;
+  bool used;
+};
+
+/* De thread cache van een thread. blocks[b] is een stapel met de indices van
+ * de eerste blokken van geheugendelen van b+1 blokken; count[b] is de hoogte
+ * van die stapel. De inhoud geldt enkel voor het segment segment, zolang de
+ * generation van dat segment niet veranderd is. queue is het nummer van de
+ * remote free queue van de thread in dat segment, of 0 als hij er geen heeft.
+ * busy is true zolang de thread zijn cache zonder de lock aanpast; next en
+ * prev verbinden de thread caches van alle threads in thread_caches.
+ */
+struct thread_cache
+{
+  struct segment *segment;
+  uint32_t generation;
+  uint32_t queue;
+  bool registered;
+  bool busy;
+  struct thread_cache *next;
+  struct thread_cache *prev;
+  uint32_t count[THREAD_CACHE_BINS];
+  uint32_t blocks[THREAD_CACHE_BINS][THREAD_CACHE_DEPTH];
+};
+
+/* Een remote free queue. Andere threads plaatsen de geheugendelen die ze
+ * vrijgeven, maar die door de eigenaar van de queue toegekend werden, met
+ * een atomaire operatie op de stapel die bij head begint: head is de index
+ * van het eerste blok plus 1, of 0 voor een lege stapel, en remote_next
+ * verbindt de volgende. owned is true zolang een thread de queue gebruikt.
+ */
+struct remote_queue
+{
+  uint32_t head;
+  bool owned;
+};
+
+/* Een CPU cache houdt, net als een thread cache, geheugendelen van ten
+ * hoogste THREAD_CACHE_BINS blokken bij die uit volle thread caches en
+ * remote free queues komen, maar wordt gedeeld door alle threads die op
+ * dezelfde CPU lopen. Een geheugendeel gaat niet terug naar de thread die
+ * het toekende. busy is true zolang een thread de CPU cache gebruikt.
+ */
+struct cpu_cache
+{
+  bool busy;
+  uint32_t count[THREAD_CACHE_BINS];
+  uint32_t blocks[THREAD_CACHE_BINS][THREAD_CACHE_DEPTH];
+};
+
+/* Het epoch slot van een thread. pin is 0 buiten een kritieke sectie, en
+ * anders de epoch bij het begin ervan maal twee plus een. Elk slot heeft
+ * zijn eigen cache lijn, zodat lezers elkaar niet storen.
+ */
+struct epoch_thread
+{
+  uint64_t pin;
+  bool taken;
+} __attribute__((aligned(64)));
+
+/* Een call site van de sampling heap profiler: de stack trace van een
+ * gesamplede toekenning, met het aantal gesamplede toekenningen en hun
+ * gevraagde grootte, zowel van de toekenningen die nog niet vrijgegeven
+ * zijn als van alle toekenningen samen.
+ */
+struct profile_site
+{
+  uint32_t depth;
+  void *frames[PROFILE_DEPTH];
+  uint64_t live_count;
+  uint64_t live_bytes;
+  uint64_t total_count;
+  uint64_t total_bytes;
+};
+
+/* Een segment bevat de heap en zijn volledige boekhouding, zodat ze samen in
+ * gedeeld geheugen of in een bestand geplaatst kunnen worden.
+ *
+ * De boekhouding bestaat uit gewone pointers. Die zijn enkel geldig wanneer
+ * het segment op het adres base gemapt is; elk proces dat een gedeeld
+ * segment gebruikt, mapt het daarom op dat adres. Een bestand dat niet meer
+ * op zijn oude adres gemapt kan worden, wordt verplaatst met
+ * segment_relocate. De lock beschermt alle andere velden, ook tussen
+ * processen.
+ *
+ * clean is enkel true in een bestand dat correct afgesloten werd, root is
+ * een pointer die de gebruiker bij een herstart terugkrijgt.
+ *
+ * Threads in memory_allocate_wait wachten op released. waiting is hun
+ * aantal, waiters[n] het aantal dat op n blokken wacht.
+ *
+ * De blokken vanaf index wilderness tot index wilderness_end zitten nog in
+ * geen enkele lijst: ze zijn vrij en worden pas in de free list opgenomen
+ * wanneer ze nodig zijn, van onder af voor gewone geheugendelen en van boven
+ * af voor langlevende.
+ * free_blocks en used_blocks zijn het aantal blokken in de free list en in
+ * de used list.
+ *
+ * Handle h komt overeen met handles[h - 1]; block_handle geeft voor het
+ * eerste blok van een verplaatsbaar geheugendeel de index van zijn handle.
+ *
+ * generation verandert bij elke memory_initialize, cached_blocks is het
+ * aantal blokken dat in de thread caches, de remote free queues en de CPU
+ * caches zit.
+ * block_owner geeft voor het eerste blok van een geheugendeel het nummer van
+ * de remote free queue van de thread die het toekende, of 0.
+ *
+ * retired[e % 2] is de lijst van de geheugendelen die memory_retire in
+ * epoch e aannam: de index van het eerste blok van het eerste geheugendeel
+ * plus 1, en zo verder via retired_next, of 0 als de lijst leeg is.
+ * retired_count is het aantal sinds de laatste poging om de epoch te
+ * verhogen.
+ */
+#define SEGMENT_MAGIC  0x48454150
+
+struct segment
+{
+  uint8_t heap[HEAP_SIZE] __attribute__((aligned(MEMORY_ALIGNMENT)));
+  struct block pool_of_blocks[NUMBER_OF_BLOCKS];
+  struct list free_list;
+  struct list used_list;
+  uint8_t block_flags[NUMBER_OF_BLOCKS];
+  uint32_t wilderness;
+  uint32_t wilderness_end;
+  uint32_t free_blocks;
+  uint32_t used_blocks;
+  struct handle handles[NUMBER_OF_BLOCKS];
+  uint32_t block_handle[NUMBER_OF_BLOCKS];
+  uint32_t generation;
+  uint32_t cached_blocks;
+  struct remote_queue remote_queues[REMOTE_QUEUES];
+  uint8_t block_owner[NUMBER_OF_BLOCKS];
+  uint32_t remote_next[NUMBER_OF_BLOCKS];
+  struct cpu_cache cpu_caches[CPU_CACHES];
+  uint32_t retired[2];
+  uint32_t retired_count;
+  uint32_t retired_next[NUMBER_OF_BLOCKS];
+
+  uint32_t magic;
+  uint32_t heap_size;
+  uint32_t block_size;
+  bool clean;
+  struct segment *base;
+  void *root;
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+  uint32_t waiting;
+  uint32_t waiters[NUMBER_OF_BLOCKS + 1];
+};
+
 /****************************************************************************
  * Interne variabelen om de heap voor te stellen en om de interne boekhouding
  * van het geheugengebruik te doen.
+ *
+ * Ze zijn velden van het segment waar segment naar wijst. Zolang er geen
+ * gedeeld segment gebruikt wordt, is dat private_segment. Tot
+ * memory_initialize opgeroepen wordt, heeft dat nog geen wilderness.
  ****************************************************************************/
 
-static uint8_t heap[HEAP_SIZE];
+static struct segment private_segment =
+{
+  .heap_size = HEAP_SIZE,
+  .block_size = BLOCK_SIZE,
+  .wilderness = NUMBER_OF_BLOCKS,
+  .wilderness_end = NUMBER_OF_BLOCKS,
+  .base = &private_segment,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .released = PTHREAD_COND_INITIALIZER
+};
+
+static struct segment *segment = &private_segment;
+
+static int persistent_fd = -1;
+
+static __thread struct thread_cache thread_cache;
 
-static struct block pool_of_blocks[NUMBER_OF_BLOCKS];
+static pthread_key_t thread_cache_key;
 
-static struct list free_list;
+static pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
 
-static struct list used_list;
+static struct thread_cache *thread_caches;
+
+static pthread_mutex_t thread_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t private_released_once = PTHREAD_ONCE_INIT;
+
+/* De sampling heap profiler hoort bij het proces, niet bij het segment: de
+ * stack traces zijn enkel in dit proces geldig. profile_interval is het
+ * gemiddeld aantal bytes tussen twee samples, of 0 als hij uit staat.
+ * block_site geeft voor het eerste blok van een gesamplede toekenning het
+ * nummer van zijn call site plus 1, profile_size haar gevraagde grootte.
+ *
+ * Een tier (zie memory_tier.h) heeft geen profiler, latency recorder,
+ * bitmap heap, ring buffer heap of epochs, want memory_tiers.c gebruikt ze
+ * niet. Hun toestand bestaat er dus niet, op profile_interval, profile_live
+ * en latency_enabled na, die er altijd 0 blijven.
+ */
+static uint32_t profile_interval;
+
+static uint32_t profile_live;
+
+#ifndef MEMORY_TIER
+static struct profile_site profile_sites[PROFILE_SITES];
+
+static uint32_t profile_site_count;
+
+static uint8_t block_site[NUMBER_OF_BLOCKS];
+
+static uint32_t profile_size[NUMBER_OF_BLOCKS];
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread int64_t profile_countdown;
+
+static __thread uint64_t profile_random;
+#endif
+
+/* De latency recorder: latency_histograms[o][c][b] telt de oproepen van
+ * operatie o op een geheugendeel van grootteklasse c waarvan de duur in
+ * bucket b viel.
+ */
+static bool latency_enabled;
+
+#ifndef MEMORY_TIER
+static uint64_t latency_histograms[MEMORY_LATENCY_OPERATIONS]
+                                  [MEMORY_LATENCY_SIZE_CLASSES]
+                                  [LATENCY_BUCKETS];
+
+/* De lock-free bitmap heap, los van de heap van het segment: bit i van
+ * bitmap_words staat op 1 als blok i van bitmap_heap toegekend is, of als
+ * het na BITMAP_BLOCKS komt. bitmap_counts geeft voor het eerste blok van
+ * een geheugendeel zijn aantal blokken, anders 0. bitmap_hint is het woord
+ * waar de thread zijn volgende zoektocht begint, plus 1.
+ */
+static uint8_t bitmap_heap[BITMAP_BLOCKS * BLOCK_SIZE]
+  __attribute__((aligned(MEMORY_ALIGNMENT)));
+
+static uint64_t bitmap_words[BITMAP_WORDS];
+
+static uint32_t bitmap_counts[BITMAP_BLOCKS];
+
+static __thread uint32_t bitmap_hint;
+
+/* De ring buffer heap, ook los van de heap van het segment. Geheugendelen
+ * worden toegekend aan ring_head en vrijgegeven vanaf ring_tail; ring_used
+ * is het aantal blokken daartussen. ring_counts geeft voor het eerste blok
+ * van een geheugendeel zijn aantal blokken, anders 0, en ring_released zegt
+ * of het al vrijgegeven werd, maar nog niet aan de beurt was. Het stuk
+ * dat overgeslagen wordt als een geheugendeel niet meer voor het einde
+ * past, is een vrijgegeven geheugendeel.
+ */
+static uint8_t ring_heap[RING_BLOCKS * BLOCK_SIZE]
+  __attribute__((aligned(MEMORY_ALIGNMENT)));
+
+static uint32_t ring_counts[RING_BLOCKS];
+
+static bool ring_released[RING_BLOCKS];
+
+static uint32_t ring_head;
+
+static uint32_t ring_tail;
+
+static uint32_t ring_used;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Epoch-based reclamation hoort bij het proces: enkel zijn eigen lezers
+ * worden gevolgd. epoch_global is de huidige epoch, epoch_unregistered het
+ * aantal lezers in een kritieke sectie zonder epoch slot, die elke
+ * verhoging tegenhouden. epoch_slot is het slot van de thread plus 1, of 0,
+ * en epoch_depth het aantal geneste kritieke secties.
+ */
+static uint64_t epoch_global;
+
+static uint32_t epoch_unregistered;
+
+static struct epoch_thread epoch_threads[EPOCH_THREADS];
+
+static __thread uint32_t epoch_slot;
+
+static __thread uint32_t epoch_depth;
+
+static pthread_key_t epoch_key;
+
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+#endif
+
+#define heap            (segment->heap)
+#define pool_of_blocks  (segment->pool_of_blocks)
+#define free_list       (segment->free_list)
+#define used_list       (segment->used_list)
+#define block_flags     (segment->block_flags)
+#define handles         (segment->handles)
+#define block_handle    (segment->block_handle)
+#define remote_queues   (segment->remote_queues)
+#define block_owner     (segment->block_owner)
+#define remote_next     (segment->remote_next)
+#define cpu_caches      (segment->cpu_caches)
+#define retired_next    (segment->retired_next)
 
 /****************************************************************************
  * Declaraties van de interne functies.
@@ -82,4 +511,183 @@ static uint32_t list_remove_chain(struct list  *list,
                                   struct block *block,
                                   uint32_t      block_count);
 
+static uint32_t block_index(const uint8_t *address);
+
+static bool block_is_carved(uint32_t index);
+
+static struct block *wilderness_link(uint32_t start, uint32_t count);
+
+static struct block *wilderness_carve(uint32_t count);
+
+static struct block *wilderness_carve_top(uint32_t count);
+
+static struct block *free_list_find_run(uint32_t count);
+
+static struct block *free_list_find_last_run(uint32_t count);
+
+static struct block *allocate_chain(uint32_t count);
+
+static struct block *allocate_chain_by(uint32_t count,
+                                       struct block *(*find_run)(uint32_t));
+
+static void caches_flush_locked(void);
+
+static bool block_is_free(uint32_t index);
+
+static uint32_t free_run_end(uint32_t start, struct block **next);
+
+static uint32_t free_run_start(uint32_t end, struct block **prev);
+
+static uint32_t free_run_next(uint32_t from, const struct block *next);
+
+static uint32_t free_run_prev(uint32_t to, const struct block *prev);
+
+static struct block *free_list_find_run_near(uint32_t hint, uint32_t count);
+
+static void allocation_claim(struct block *block, uint32_t count);
+
+static int iov_runs_insert(struct iovec *runs, int count, int max,
+                           uint32_t first, uint32_t run_length);
+
+static void release_chain(struct block *block);
+
+static uint8_t block_flags_load(uint32_t index);
+
+static void blocks_set_flags(uint32_t first, uint32_t count, uint8_t flags);
+
+static void blocks_clear_flags(uint32_t first, uint32_t count, uint8_t flags);
+
+static void blocks_zero_dirty(uint32_t first, uint32_t count);
+
+static struct block *block_of_allocation(const void *ptr);
+
+static void thread_cache_key_create(void);
+
+static void thread_cache_exit(void *cache);
+
+static void thread_cache_fork_child(void);
+
+static void thread_cache_make_current(void);
+
+static struct block *thread_cache_pop(uint32_t count);
+
+static bool thread_cache_push(void *ptr);
+
+static void thread_cache_evict(uint32_t bin, uint32_t count);
+
+static void thread_cache_flush_locked(void);
+
+static void thread_cache_begin(void);
+
+static void thread_cache_end(void);
+
+static void thread_caches_flush_others_locked(void);
+
+static void segment_release_cached(void);
+
+static void remote_queue_claim(void);
+
+static bool remote_queue_push(void *ptr);
+
+static void remote_queue_drain(uint32_t queue, bool locked);
+
+static void thread_cache_leave(void);
+
+static void thread_cache_spill(uint32_t bin, uint32_t count);
+
+static uint32_t cpu_cache_current(void);
+
+static struct block *cpu_cache_pop(uint32_t count);
+
+static bool cpu_cache_push(uint32_t index, uint32_t count);
+
+static void cpu_caches_flush_locked(void);
+
+static uint32_t waiting_largest(void);
+
+static struct handle *handle_lookup(memory_handle_t handle);
+
+static void list_append_block(struct list *list, struct block *block);
+
+static void lists_rebuild(void);
+
+static void allocation_move(uint32_t from, uint32_t to);
+
+static void segment_lock(void);
+
+static void segment_unlock(void);
+
+static struct segment *segment_map(int fd, struct segment *address);
+
+static void released_init(pthread_cond_t *released, int pshared);
+
+static void private_released_init(void);
+
+static void segment_lock_init(struct segment *shared);
+
+static void segment_format(struct segment *shared);
+
+static void *pointer_rebase(void *pointer, uintptr_t delta);
+
+static void segment_relocate(struct segment *old_base);
+
+static bool list_is_consistent(const struct list *list,
+                               bool               used,
+                               uint32_t          *count);
+
+static bool segment_is_consistent(void);
+
+static uint8_t snapshot_state(uint32_t index);
+
+static void *allocation_create(uint32_t size);
+
+static bool allocation_release(void *ptr);
+
+static void profile_allocation(uint8_t *address, uint32_t size);
+
+static void profile_release(const void *ptr);
+
+static void profile_forget_live(void);
+
+static uint64_t latency_now(void);
+
+static void latency_record(int operation, uint32_t count, uint64_t ticks);
+
+static uint32_t io_slices(void);
+
+#ifndef MEMORY_TIER
+static double profile_log2(double x);
+
+static int64_t profile_next_interval(void);
+
+static void profile_write_frame(FILE *out, void *frame, char *symbol);
+
+static uint32_t latency_size_class(uint32_t count);
+
+static uint32_t latency_bucket(uint64_t ticks);
+
+static uint64_t latency_bucket_limit(uint32_t bucket);
+
+static uint32_t bitmap_find(uint32_t count, uint32_t first);
+
+static bool bitmap_claim(uint32_t start, uint32_t count);
+
+static void bitmap_clear(uint32_t start, uint32_t count);
+
+static void ring_push(uint32_t count, bool released);
+
+static void epoch_key_create(void);
+
+static void epoch_fork_child(void);
+
+static void epoch_thread_exit(void *thread);
+
+static void epoch_register(void);
+
+static bool epoch_advance_locked(uint32_t *released);
+#endif
+
+/* Een tier (zie memory_tier.h) heeft geen eigen tests */
+#ifndef MEMORY_TIER
 #include "test.c"
+#endif
@@ -0,0 +1,76 @@
+#ifndef MEMORY_TIER_H
+#define MEMORY_TIER_H
+
+/* A tier is a heap of its own, with its own BLOCK_SIZE, that is made by
+ * compiling memory.c once more with -DMEMORY_TIER=n -DBLOCK_SIZE=n, where n
+ * is a power of two. All divisions by BLOCK_SIZE are then divisions by a
+ * constant power of two, which the compiler turns into shifts.
+ *
+ * The public functions of a tier get the prefix memory_tiern_ instead of
+ * memory_, e.g. memory_tier64_allocate, so that several tiers and the heap
+ * of memory.o can be linked into one program. memory_tiers.c routes each
+ * request to the right tier.
+ *
+ * A tier has only the heap itself: the profiler, the latency recorder, the
+ * bitmap and ring buffer heaps and epochs are left out, as memory_tiers.c
+ * does not use them.
+ */
+#define MEMORY_TIER_CONCAT(prefix, tier, name)  prefix ## tier ## name
+#define MEMORY_TIER_NAME(tier, name)  \
+  MEMORY_TIER_CONCAT(memory_tier, tier, name)
+
+#ifdef MEMORY_TIER
+#define memory_test                    MEMORY_TIER_NAME(MEMORY_TIER, _test)
+#define memory_initialize              MEMORY_TIER_NAME(MEMORY_TIER, _initialize)
+#define memory_available               MEMORY_TIER_NAME(MEMORY_TIER, _available)
+#define memory_used                    MEMORY_TIER_NAME(MEMORY_TIER, _used)
+#define memory_contains                MEMORY_TIER_NAME(MEMORY_TIER, _contains)
+#define memory_ref                     MEMORY_TIER_NAME(MEMORY_TIER, _ref)
+#define memory_deref                   MEMORY_TIER_NAME(MEMORY_TIER, _deref)
+#define memory_allocate                MEMORY_TIER_NAME(MEMORY_TIER, _allocate)
+#define memory_allocate_zeroed         \
+  MEMORY_TIER_NAME(MEMORY_TIER, _allocate_zeroed)
+#define memory_allocate_hint           \
+  MEMORY_TIER_NAME(MEMORY_TIER, _allocate_hint)
+#define memory_allocate_near           \
+  MEMORY_TIER_NAME(MEMORY_TIER, _allocate_near)
+#define memory_allocate_wait           \
+  MEMORY_TIER_NAME(MEMORY_TIER, _allocate_wait)
+#define memory_release                 MEMORY_TIER_NAME(MEMORY_TIER, _release)
+#define memory_usable_size             \
+  MEMORY_TIER_NAME(MEMORY_TIER, _usable_size)
+#define memory_flush_thread_cache      \
+  MEMORY_TIER_NAME(MEMORY_TIER, _flush_thread_cache)
+#define memory_allocate_handle         \
+  MEMORY_TIER_NAME(MEMORY_TIER, _allocate_handle)
+#define memory_pin                     MEMORY_TIER_NAME(MEMORY_TIER, _pin)
+#define memory_unpin                   MEMORY_TIER_NAME(MEMORY_TIER, _unpin)
+#define memory_release_handle          \
+  MEMORY_TIER_NAME(MEMORY_TIER, _release_handle)
+#define memory_compact                 MEMORY_TIER_NAME(MEMORY_TIER, _compact)
+#define memory_allocate_iov            \
+  MEMORY_TIER_NAME(MEMORY_TIER, _allocate_iov)
+#define memory_release_iov             \
+  MEMORY_TIER_NAME(MEMORY_TIER, _release_iov)
+#define memory_initialize_shared       \
+  MEMORY_TIER_NAME(MEMORY_TIER, _initialize_shared)
+#define memory_attach_shared           \
+  MEMORY_TIER_NAME(MEMORY_TIER, _attach_shared)
+#define memory_detach_shared           \
+  MEMORY_TIER_NAME(MEMORY_TIER, _detach_shared)
+#define memory_open_persistent         \
+  MEMORY_TIER_NAME(MEMORY_TIER, _open_persistent)
+#define memory_close_persistent        \
+  MEMORY_TIER_NAME(MEMORY_TIER, _close_persistent)
+#define memory_set_root                MEMORY_TIER_NAME(MEMORY_TIER, _set_root)
+#define memory_get_root                MEMORY_TIER_NAME(MEMORY_TIER, _get_root)
+#define memory_snapshot_write          \
+  MEMORY_TIER_NAME(MEMORY_TIER, _snapshot_write)
+#define memory_io_register             \
+  MEMORY_TIER_NAME(MEMORY_TIER, _io_register)
+#define memory_io_unregister           \
+  MEMORY_TIER_NAME(MEMORY_TIER, _io_unregister)
+#define memory_io_buffer               MEMORY_TIER_NAME(MEMORY_TIER, _io_buffer)
+#endif
+
+#endif
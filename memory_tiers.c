@@ -0,0 +1,136 @@
+#include "memory.h"
+#include "memory_tier.h"
+
+/* FOR_EACH_TIER(TIER) lists the tiers as TIER(n), from the smallest
+ * BLOCK_SIZE n to the largest. Every tier is memory.c compiled with that
+ * BLOCK_SIZE; the Makefile defines FOR_EACH_TIER from its list of TIERS.
+ */
+#ifndef FOR_EACH_TIER
+#error "FOR_EACH_TIER must list the tiers the Makefile builds"
+#endif
+
+/* A tier serves requests of at most TIER_SPAN blocks, which leaves larger
+ * requests to the next tier, unless it is the last one.
+ */
+#define TIER_SPAN  16
+
+#define TIER_DECLARE(n)                                            \
+  void MEMORY_TIER_NAME(n, _initialize)(void);                     \
+  bool MEMORY_TIER_NAME(n, _contains)(const void *ptr);            \
+  void *MEMORY_TIER_NAME(n, _allocate)(uint32_t size);             \
+  bool MEMORY_TIER_NAME(n, _release)(void *ptr);                   \
+  uint32_t MEMORY_TIER_NAME(n, _usable_size)(const void *ptr);     \
+  uint32_t MEMORY_TIER_NAME(n, _available)(void);
+
+FOR_EACH_TIER(TIER_DECLARE)
+
+/* The functions of one tier, so that the tiers can be walked in a loop. */
+struct tier
+{
+  uint32_t block_size;
+  void (*initialize)(void);
+  bool (*contains)(const void *ptr);
+  void *(*allocate)(uint32_t size);
+  bool (*release)(void *ptr);
+  uint32_t (*usable_size)(const void *ptr);
+  uint32_t (*available)(void);
+};
+
+#define TIER_ENTRY(n)                     \
+  {                                       \
+    n,                                    \
+    MEMORY_TIER_NAME(n, _initialize),     \
+    MEMORY_TIER_NAME(n, _contains),       \
+    MEMORY_TIER_NAME(n, _allocate),       \
+    MEMORY_TIER_NAME(n, _release),        \
+    MEMORY_TIER_NAME(n, _usable_size),    \
+    MEMORY_TIER_NAME(n, _available)       \
+  },
+
+static const struct tier tiers[] =
+{
+  FOR_EACH_TIER(TIER_ENTRY)
+};
+
+#define NUMBER_OF_TIERS  ((int) (sizeof(tiers) / sizeof(tiers[0])))
+
+/* Returns the tier that contains the given pointer, or NULL. */
+static const struct tier *tier_of(const void *ptr)
+{
+  for (int t = 0; t < NUMBER_OF_TIERS; t++)
+  {
+    if (tiers[t].contains(ptr))
+    {
+      return &(tiers[t]);
+    }
+  }
+
+  return NULL;
+}
+
+/* Initializes the heap of every tier. */
+void memory_tiers_initialize(void)
+{
+  for (int t = 0; t < NUMBER_OF_TIERS; t++)
+  {
+    tiers[t].initialize();
+  }
+}
+
+/* Allocates size bytes from the tier with the smallest BLOCK_SIZE in which
+ * they fit in at most TIER_SPAN blocks. When that tier has no room, the
+ * tiers with larger blocks are tried in turn.
+ *
+ * Returns NULL if size is zero or no tier has room.
+ */
+void *memory_tiers_allocate(uint32_t size)
+{
+  int t = 0;
+  while (   (t < NUMBER_OF_TIERS - 1)
+         && (size > TIER_SPAN * tiers[t].block_size))
+  {
+    t++;
+  }
+
+  void *ptr = NULL;
+  while ((ptr == NULL) && (t < NUMBER_OF_TIERS))
+  {
+    ptr = tiers[t].allocate(size);
+    t++;
+  }
+
+  return ptr;
+}
+
+/* Releases an allocation of memory_tiers_allocate to its tier.
+ *
+ * Returns false when the pointer is in none of the tiers, or when its tier
+ * refuses it, as memory_release would.
+ */
+bool memory_tiers_release(void *ptr)
+{
+  const struct tier *tier = tier_of(ptr);
+  return (tier != NULL) && tier->release(ptr);
+}
+
+/* Returns the number of bytes that can be used through the given pointer,
+ * which is a multiple of the BLOCK_SIZE of its tier, or zero when it is not
+ * the start of a live allocation of a tier.
+ */
+uint32_t memory_tiers_usable_size(const void *ptr)
+{
+  const struct tier *tier = tier_of(ptr);
+  return (tier == NULL) ? 0 : tier->usable_size(ptr);
+}
+
+/* Returns the number of free bytes in all tiers together. */
+uint32_t memory_tiers_available(void)
+{
+  uint32_t available = 0;
+  for (int t = 0; t < NUMBER_OF_TIERS; t++)
+  {
+    available += tiers[t].available();
+  }
+
+  return available;
+}
@@ -516,6 +516,18 @@ static void test_memory_initialize(void)
 
   TEST(ctxt, used_list.first == NULL);
   TEST(ctxt, used_list.last == NULL);
+  TEST(ctxt, free_list.first == NULL);
+  TEST(ctxt, free_list.last == NULL);
+  TEST(ctxt, segment->wilderness == 0);
+  TEST(ctxt, segment->wilderness_end == NUMBER_OF_BLOCKS);
+  TEST(ctxt, memory_available() == HEAP_SIZE);
+  TEST(ctxt, ((uintptr_t) heap % MEMORY_ALIGNMENT) == 0);
+
+  /* Allocating the whole heap carves every block from the wilderness */
+  uint8_t *p = (uint8_t *) memory_allocate(HEAP_SIZE);
+  TEST(ctxt, p == heap);
+  TEST(ctxt, segment->wilderness == NUMBER_OF_BLOCKS);
+  TEST(ctxt, memory_release(p));
   TEST(ctxt, free_list.first != NULL);
   TEST(ctxt, free_list.last != NULL);
 
@@ -537,6 +549,74 @@ static void test_memory_initialize(void)
   print_summary(ctxt);
 }
 
+static void test_wilderness_carve(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  /* Only what an allocation needs is carved */
+  uint8_t *p1 = (uint8_t *) memory_allocate(2*BLOCK_SIZE);
+  TEST(ctxt, p1 == heap);
+  TEST(ctxt, segment->wilderness == 2);
+  TEST(ctxt, _list_get_length(&free_list) == 0);
+  TEST(ctxt, memory_available() == HEAP_SIZE - 2*BLOCK_SIZE);
+
+  /* Freed blocks are reused before the wilderness is touched */
+  uint8_t *p2 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  TEST(ctxt, memory_release(p1));
+  memory_flush_thread_cache();
+  TEST(ctxt, memory_allocate(BLOCK_SIZE) == heap);
+  TEST(ctxt, segment->wilderness == 3);
+
+  /* A free run that borders the wilderness is extended */
+  TEST(ctxt, memory_release(p2));
+  memory_flush_thread_cache();
+  uint8_t *p3 = (uint8_t *) memory_allocate(3*BLOCK_SIZE);
+  TEST(ctxt, p3 == heap+BLOCK_SIZE);
+  TEST(ctxt, segment->wilderness == 4);
+  TEST(ctxt, segment_is_consistent());
+
+  /* A free run that does not border it is skipped */
+  TEST(ctxt, memory_release(heap));
+  memory_flush_thread_cache();
+  uint8_t *p4 = (uint8_t *) memory_allocate(2*BLOCK_SIZE);
+  TEST(ctxt, p4 == heap+4*BLOCK_SIZE);
+  TEST(ctxt, segment->wilderness == 6);
+  TEST(ctxt, free_list.first == &(pool_of_blocks[0]));
+  TEST(ctxt, segment_is_consistent());
+
+  TEST(ctxt, memory_allocate(HEAP_SIZE - 5*BLOCK_SIZE) == NULL);
+  TEST(ctxt, memory_allocate(HEAP_SIZE - 6*BLOCK_SIZE) == heap+6*BLOCK_SIZE);
+  TEST(ctxt, memory_available() == BLOCK_SIZE);
+
+  /* Blocks beyond the wilderness are never live, whatever their flags */
+  memory_initialize();
+  TEST(ctxt, !memory_release(p4));
+  TEST(ctxt, memory_usable_size(p3) == 0);
+
+  /* Long-lived allocations are carved from the end of the wilderness */
+  uint8_t *low = (uint8_t *) memory_allocate(2*BLOCK_SIZE);
+  uint8_t *high = (uint8_t *) memory_allocate_hint(2*BLOCK_SIZE,
+                                                   MEMORY_LIFETIME_LONG);
+  TEST(ctxt, high == heap + HEAP_SIZE - 2*BLOCK_SIZE);
+  TEST(ctxt, segment->wilderness == 2);
+  TEST(ctxt, segment->wilderness_end == NUMBER_OF_BLOCKS - 2);
+  TEST(ctxt, _list_get_length(&free_list) == 0);
+  TEST(ctxt, memory_usable_size(heap + 2*BLOCK_SIZE) == 0);
+  TEST(ctxt, segment_is_consistent());
+
+  /* A run can start below the wilderness and end above it */
+  TEST(ctxt, memory_release(low));
+  TEST(ctxt, memory_release(high));
+  memory_flush_thread_cache();
+  TEST(ctxt, memory_allocate(HEAP_SIZE) == heap);
+  TEST(ctxt, segment->wilderness == segment->wilderness_end);
+  TEST(ctxt, segment_is_consistent());
+
+  print_summary(ctxt);
+}
+
 static void test_memory_allocate(void)
 {
   context_t *ctxt = new_context(__func__);
@@ -659,69 +739,24 @@ static void test_memory_release(void)
 {
   context_t *ctxt = new_context(__func__);
 
-  list_init(&used_list);
-  list_init(&free_list);
-
-  struct block block0;
-  struct block block2;
-  struct block block3;
-  struct block block4;
-  struct block block6;
-  struct block block7;
-  struct block block9;
-  struct block block10;
-  struct block block11;
-  struct block block12;
-
-  list_append(&used_list, &block0);
-  list_append(&used_list, &block2);
-  list_append(&used_list, &block3);
-  list_append(&used_list, &block4);
-  list_append(&used_list, &block6);
-  list_append(&used_list, &block7);
-  list_append(&used_list, &block9);
-  list_append(&used_list, &block10);
-  list_append(&used_list, &block11);
-  list_append(&used_list, &block12);
-
-  block0.address = heap;
-  block0.alloc_count = 1;
-  uint8_t * p0 = block0.address;
+  memory_initialize();
 
-  block2.address = heap+2*BLOCK_SIZE;
-  block3.address = heap+3*BLOCK_SIZE;
-  block4.address = heap+4*BLOCK_SIZE;
-  block2.alloc_count = 3;
-  block3.alloc_count = 0;
-  block4.alloc_count = 0;
-  uint8_t * p2 = block2.address;
+  uint8_t * p0 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t * gap1 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t * p2 = (uint8_t *) memory_allocate(3*BLOCK_SIZE);
+  uint8_t * gap5 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t * p6 = (uint8_t *) memory_allocate(2*BLOCK_SIZE);
+  uint8_t * gap8 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t * p9 = (uint8_t *) memory_allocate(4*BLOCK_SIZE);
 
-  block6.address = heap+6*BLOCK_SIZE;
-  block7.address = heap+7*BLOCK_SIZE;
-  block6.alloc_count = 2;
-  block7.alloc_count = 0;
-  uint8_t * p6 = block6.address;
+  assert(p0 == heap);
+  assert(p2 == heap+2*BLOCK_SIZE);
+  assert(p6 == heap+6*BLOCK_SIZE);
+  assert(p9 == heap+9*BLOCK_SIZE);
 
-  block9.address = heap+9*BLOCK_SIZE;
-  block10.address = heap+10*BLOCK_SIZE;
-  block11.address = heap+11*BLOCK_SIZE;
-  block12.address = heap+12*BLOCK_SIZE;
-  block9.alloc_count = 4;
-  block10.alloc_count = 0;
-  block11.alloc_count = 0;
-  block12.alloc_count = 0;
-  uint8_t * p9 = block9.address;
-
-  assert(block_is_valid(&block0));
-  assert(block_is_valid(&block2));
-  assert(block_is_valid(&block3));
-  assert(block_is_valid(&block4));
-  assert(block_is_valid(&block6));
-  assert(block_is_valid(&block7));
-  assert(block_is_valid(&block9));
-  assert(block_is_valid(&block10));
-  assert(block_is_valid(&block11));
-  assert(block_is_valid(&block12));
+  TEST(ctxt, memory_release(gap1));
+  TEST(ctxt, memory_release(gap5));
+  TEST(ctxt, memory_release(gap8));
 
   TEST(ctxt, memory_release(p0));
   TEST(ctxt, memory_release(p2));
@@ -731,9 +766,518 @@ static void test_memory_release(void)
   TEST(ctxt, !memory_release(heap-1));
   TEST(ctxt, !memory_release(heap+1));
 
+  TEST(ctxt, !memory_release(p0));
+  TEST(ctxt, !memory_release(p9));
+  TEST(ctxt, !memory_release(&(heap[HEAP_SIZE])));
+  memory_flush_thread_cache();
+  TEST(ctxt, _list_get_length(&used_list) == 0);
+  TEST(ctxt, memory_available() == HEAP_SIZE);
+
+  p2 = (uint8_t *) memory_allocate(3*BLOCK_SIZE);
+  TEST(ctxt, !memory_release(p2+BLOCK_SIZE));
+  TEST(ctxt, !memory_release(p2+2*BLOCK_SIZE));
+  TEST(ctxt, memory_release(p2));
+
+  print_summary(ctxt);
+}
+
+static void test_memory_usable_size(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  uint8_t *p1 = (uint8_t *) memory_allocate(1);
+  uint8_t *p2 = (uint8_t *) memory_allocate(2*BLOCK_SIZE+1);
+
+  TEST(ctxt, memory_usable_size(p1) == BLOCK_SIZE);
+  TEST(ctxt, memory_usable_size(p2) == 3*BLOCK_SIZE);
+  TEST(ctxt, memory_usable_size(NULL) == 0);
+  TEST(ctxt, memory_usable_size(p2+1) == 0);
+  TEST(ctxt, memory_usable_size(p2+BLOCK_SIZE) == 0);
+  TEST(ctxt, memory_usable_size(heap+5*BLOCK_SIZE) == 0);
+  TEST(ctxt, memory_usable_size(&ctxt) == 0);
+
+  memory_release(p2);
+  TEST(ctxt, memory_usable_size(p2) == 0);
+  TEST(ctxt, memory_usable_size(p1) == BLOCK_SIZE);
+
   print_summary(ctxt);
 }
 
+static void test_memory_allocate_hint(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  /* Short-lived data grows up from the start, the rest down from the end */
+  uint8_t *p1 = (uint8_t *) memory_allocate_hint(BLOCK_SIZE,
+                                                 MEMORY_LIFETIME_SHORT);
+  uint8_t *p2 = (uint8_t *) memory_allocate_hint(2*BLOCK_SIZE,
+                                                 MEMORY_LIFETIME_LONG);
+  uint8_t *p3 = (uint8_t *) memory_allocate_hint(BLOCK_SIZE,
+                                                 MEMORY_LIFETIME_LONG);
+  uint8_t *p4 = (uint8_t *) memory_allocate_hint(2*BLOCK_SIZE,
+                                                 MEMORY_LIFETIME_SHORT);
+  TEST(ctxt, p1 == heap);
+  TEST(ctxt, p2 == heap + HEAP_SIZE - 2*BLOCK_SIZE);
+  TEST(ctxt, p3 == heap + HEAP_SIZE - 3*BLOCK_SIZE);
+  TEST(ctxt, p4 == heap + BLOCK_SIZE);
+  TEST(ctxt, memory_usable_size(p2) == 2*BLOCK_SIZE);
+  TEST(ctxt, memory_available() == HEAP_SIZE - 6*BLOCK_SIZE);
+  TEST(ctxt, segment->wilderness == 3);
+  TEST(ctxt, segment->wilderness_end == NUMBER_OF_BLOCKS - 3);
+  TEST(ctxt, memory_allocate_hint(BLOCK_SIZE, 2) == NULL);
+  TEST(ctxt, memory_allocate_hint(0, MEMORY_LIFETIME_LONG) == NULL);
+
+  /* A long-lived allocation does not fill a hole in the short-lived data */
+  TEST(ctxt, memory_release(p1));
+  memory_flush_thread_cache();
+  uint8_t *p5 = (uint8_t *) memory_allocate_hint(BLOCK_SIZE,
+                                                 MEMORY_LIFETIME_LONG);
+  TEST(ctxt, p5 == heap + HEAP_SIZE - 4*BLOCK_SIZE);
+
+  /* The end of the heap is reused once it is free again */
+  TEST(ctxt, memory_release(p2));
+  memory_flush_thread_cache();
+  TEST(ctxt, memory_allocate_hint(BLOCK_SIZE, MEMORY_LIFETIME_LONG)
+             == heap + HEAP_SIZE - BLOCK_SIZE);
+  TEST(ctxt, memory_allocate_hint(HEAP_SIZE, MEMORY_LIFETIME_LONG) == NULL);
+  TEST(ctxt, segment_is_consistent());
+
+  print_summary(ctxt);
+}
+
+static void test_memory_allocate_near(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  uint8_t *p1 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t *p2 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t *p3 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t *p4 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  TEST(ctxt, memory_release(p2));
+  memory_flush_thread_cache();
+
+  /* The closest free block, not the first one */
+  TEST(ctxt, memory_allocate_near(p4, BLOCK_SIZE) == heap + 4*BLOCK_SIZE);
+  TEST(ctxt, memory_allocate_near(p1, BLOCK_SIZE) == p2);
+
+  /* Runs are carved from the wilderness, around the hint */
+  TEST(ctxt, memory_allocate_near(heap + 10*BLOCK_SIZE, 2*BLOCK_SIZE)
+             == heap + 10*BLOCK_SIZE);
+  TEST(ctxt, memory_allocate_near(heap + 15*BLOCK_SIZE, 3*BLOCK_SIZE)
+             == heap + 13*BLOCK_SIZE);
+  TEST(ctxt, memory_allocate_near(p3, 5*BLOCK_SIZE) == heap + 5*BLOCK_SIZE);
+  TEST(ctxt, memory_allocate_near(p3, 2*BLOCK_SIZE) == NULL);
+  TEST(ctxt, memory_allocate_near(p3, 0) == NULL);
+  TEST(ctxt, memory_allocate_near(p3, BLOCK_SIZE) == heap + 12*BLOCK_SIZE);
+  TEST(ctxt, memory_available() == 0);
+  TEST(ctxt, segment_is_consistent());
+
+  /* Once the wilderness is gone, a run may span where it was */
+  TEST(ctxt, memory_release(heap + 10*BLOCK_SIZE));
+  TEST(ctxt, memory_release(heap + 12*BLOCK_SIZE));
+  memory_flush_thread_cache();
+  TEST(ctxt, memory_allocate_near(p3, 3*BLOCK_SIZE) == heap + 10*BLOCK_SIZE);
+  TEST(ctxt, segment_is_consistent());
+
+  /* Without a hint in the heap, it is memory_allocate */
+  memory_initialize();
+  TEST(ctxt, memory_allocate_near(NULL, BLOCK_SIZE) == heap);
+  TEST(ctxt, memory_allocate_near(&ctxt, BLOCK_SIZE) == heap + BLOCK_SIZE);
+
+  print_summary(ctxt);
+}
+
+static void test_memory_io(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  uint64_t offset = 1;
+  TEST(ctxt, memory_io_buffer(heap, HEAP_SIZE, &offset) == 0);
+  TEST(ctxt, offset == 0);
+  TEST(ctxt, memory_io_buffer(heap + 3*BLOCK_SIZE, 1, &offset) == 0);
+  TEST(ctxt, offset == 3*BLOCK_SIZE);
+  TEST(ctxt, memory_io_buffer(heap + BLOCK_SIZE, HEAP_SIZE, &offset) == -1);
+  TEST(ctxt, memory_io_buffer(heap, 0, &offset) == -1);
+  TEST(ctxt, memory_io_buffer(&ctxt, 1, &offset) == -1);
+  TEST(ctxt, io_slices() == 1);
+
+  TEST(ctxt, !memory_io_register(-1));
+
+  /* io_uring_setup takes a struct io_uring_params of 120 bytes, all zero;
+   * <linux/io_uring.h> can not be included next to BLOCK_SIZE */
+  uint32_t params[30] = { 0 };
+  int ring = (int) syscall(SYS_io_uring_setup, 4, params);
+  if (ring >= 0)
+  {
+    TEST(ctxt, memory_io_register(ring));
+    bool registered = memory_io_register(ring);
+    int error = errno;
+    TEST(ctxt, !registered);
+    TEST(ctxt, error == EBUSY);
+    TEST(ctxt, memory_io_unregister(ring));
+    TEST(ctxt, !memory_io_unregister(ring));
+    close(ring);
+  }
+
+  print_summary(ctxt);
+}
+
+/* Allocates and releases runs of 1 to 80 blocks of the bitmap heap, which
+ * span words, and checks that no other thread wrote into them meanwhile.
+ * Returns the number of allocations that were overwritten or could not be
+ * released.
+ */
+static void *bitmap_stress_in_thread(void *arg)
+{
+  uint8_t tag = (uint8_t) (uintptr_t) arg;
+  uint32_t random = tag * 2654435761u + 1;
+  uintptr_t errors = 0;
+
+  for (int i = 0; i < 20000; i++)
+  {
+    random = random * 1103515245 + 12345;
+    uint32_t size = (1 + (random >> 16) % 80) * BLOCK_SIZE;
+
+    uint8_t *p = (uint8_t *) memory_bitmap_allocate(size);
+    if (p == NULL)
+    {
+      sched_yield();
+      continue;
+    }
+
+    memset(p, tag, size);
+    if ((i % 64) == 0)
+    {
+      sched_yield();
+    }
+    for (uint32_t j = 0; j < size; j++)
+    {
+      errors += (p[j] != tag);
+    }
+    errors += !memory_bitmap_release(p);
+  }
+
+  return (void *) errors;
+}
+
+static void test_memory_bitmap(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_bitmap_initialize();
+  TEST(ctxt, memory_bitmap_available() == BITMAP_BLOCKS * BLOCK_SIZE);
+
+  /* Runs can span words of the bitmap */
+  bitmap_hint = 1;
+  uint8_t *p1 = (uint8_t *) memory_bitmap_allocate(BLOCK_SIZE);
+  uint8_t *p2 = (uint8_t *) memory_bitmap_allocate(70*BLOCK_SIZE);
+  uint8_t *p3 = (uint8_t *) memory_bitmap_allocate(60*BLOCK_SIZE);
+  TEST(ctxt, p1 == bitmap_heap);
+  TEST(ctxt, p2 == bitmap_heap + BLOCK_SIZE);
+  TEST(ctxt, p3 == bitmap_heap + 71*BLOCK_SIZE);
+  TEST(ctxt, bitmap_words[0] == UINT64_MAX);
+  TEST(ctxt, bitmap_words[2] == (UINT64_C(1) << (131 - 128)) - 1);
+  TEST(ctxt, memory_bitmap_available() == (BITMAP_BLOCKS - 131) * BLOCK_SIZE);
+  TEST(ctxt, memory_bitmap_allocate(0) == NULL);
+  TEST(ctxt, memory_bitmap_allocate(BITMAP_BLOCKS * BLOCK_SIZE) == NULL);
+
+  TEST(ctxt, memory_bitmap_release(p2));
+  TEST(ctxt, !memory_bitmap_release(p2));
+  TEST(ctxt, !memory_bitmap_release(p3 + 1));
+  TEST(ctxt, !memory_bitmap_release(p3 + BLOCK_SIZE));
+  TEST(ctxt, !memory_bitmap_release(&ctxt));
+  TEST(ctxt, bitmap_words[0] == 1);
+
+  /* The search wraps around to the start of the bitmap */
+  bitmap_hint = BITMAP_WORDS;
+  TEST(ctxt, memory_bitmap_allocate(70*BLOCK_SIZE) == p2);
+
+  /* A claim that loses a word gives back the words it already had */
+  memory_bitmap_initialize();
+  TEST(ctxt, bitmap_claim(130, 1));
+  TEST(ctxt, !bitmap_claim(120, 20));
+  TEST(ctxt, bitmap_words[1] == 0);
+  TEST(ctxt, bitmap_words[2] == 4);
+
+  /* Many threads at once never get the same blocks */
+  memory_bitmap_initialize();
+  pthread_t threads[4];
+  for (uintptr_t t = 0; t < 4; t++)
+  {
+    pthread_create(&(threads[t]), NULL, bitmap_stress_in_thread,
+                   (void *) (t + 1));
+  }
+  uintptr_t errors = 0;
+  for (int t = 0; t < 4; t++)
+  {
+    void *result;
+    pthread_join(threads[t], &result);
+    errors += (uintptr_t) result;
+  }
+  TEST(ctxt, errors == 0);
+  TEST(ctxt, memory_bitmap_available() == BITMAP_BLOCKS * BLOCK_SIZE);
+
+  print_summary(ctxt);
+}
+
+static void test_memory_ring(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_ring_initialize();
+  TEST(ctxt, memory_ring_available() == RING_BLOCKS * BLOCK_SIZE);
+
+  uint8_t *p1 = (uint8_t *) memory_ring_allocate(100*BLOCK_SIZE);
+  uint8_t *p2 = (uint8_t *) memory_ring_allocate(100*BLOCK_SIZE - 1);
+  TEST(ctxt, p1 == ring_heap);
+  TEST(ctxt, p2 == ring_heap + 100*BLOCK_SIZE);
+  TEST(ctxt, memory_ring_allocate(100*BLOCK_SIZE) == NULL);
+  TEST(ctxt, memory_ring_allocate(0) == NULL);
+  TEST(ctxt, memory_ring_allocate((RING_BLOCKS + 1)*BLOCK_SIZE) == NULL);
+
+  /* Released out of order, p2 waits for p1 */
+  TEST(ctxt, memory_ring_release(p2));
+  TEST(ctxt, !memory_ring_release(p2));
+  TEST(ctxt, memory_ring_available() == (RING_BLOCKS - 200) * BLOCK_SIZE);
+  TEST(ctxt, memory_ring_release(p1));
+  TEST(ctxt, memory_ring_available() == RING_BLOCKS * BLOCK_SIZE);
+  TEST(ctxt, memory_ring_allocate(BLOCK_SIZE) == ring_heap);
+
+  /* What does not fit before the end, wraps to the start */
+  memory_ring_initialize();
+  p1 = (uint8_t *) memory_ring_allocate(100*BLOCK_SIZE);
+  p2 = (uint8_t *) memory_ring_allocate(100*BLOCK_SIZE);
+  TEST(ctxt, memory_ring_release(p1));
+  uint8_t *p3 = (uint8_t *) memory_ring_allocate(80*BLOCK_SIZE);
+  TEST(ctxt, p3 == ring_heap);
+  TEST(ctxt, memory_ring_available() == (RING_BLOCKS - 236) * BLOCK_SIZE);
+  TEST(ctxt, memory_ring_allocate(21*BLOCK_SIZE) == NULL);
+  TEST(ctxt, !memory_ring_release(ring_heap + 200*BLOCK_SIZE));
+  TEST(ctxt, !memory_ring_release(p3 + 1));
+  TEST(ctxt, !memory_ring_release(&ctxt));
+
+  /* The tail passes the skipped end of the ring too */
+  TEST(ctxt, memory_ring_release(p2));
+  TEST(ctxt, memory_ring_available() == (RING_BLOCKS - 80) * BLOCK_SIZE);
+  TEST(ctxt, ring_tail == 0);
+  TEST(ctxt, memory_ring_release(p3));
+  TEST(ctxt, memory_ring_available() == RING_BLOCKS * BLOCK_SIZE);
+
+  print_summary(ctxt);
+}
+
+static void test_memory_ref(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+  TEST(ctxt, memory_ref(NULL) == MEMORY_REF_NULL);
+  TEST(ctxt, memory_deref(MEMORY_REF_NULL) == NULL);
+
+  /* A list of nodes linked through references */
+  struct node
+  {
+    memory_ref_t next;
+    uint32_t value;
+  };
+  memory_ref_t first = MEMORY_REF_NULL;
+  for (uint32_t i = 0; i < 4; i++)
+  {
+    struct node *node = (struct node *) memory_allocate(sizeof(struct node));
+    node->next = first;
+    node->value = i;
+    first = memory_ref(node);
+    TEST(ctxt, first == (memory_ref_t) ((uint8_t *) node - heap) + 1);
+  }
+
+  uint32_t expected = 4;
+  for (struct node *node = memory_deref(first); node != NULL;
+       node = memory_deref(node->next))
+  {
+    TEST(ctxt, node->value == --expected);
+  }
+  TEST(ctxt, expected == 0);
+
+  /* Addresses inside an allocation */
+  uint8_t *p = (uint8_t *) memory_allocate(2*BLOCK_SIZE);
+  uint8_t *inside = p + BLOCK_SIZE + 3;
+  TEST(ctxt, memory_deref(memory_ref(inside)) == inside);
+
+  print_summary(ctxt);
+}
+
+static uint32_t epoch_reader_state;
+
+/* Stays in a critical section until the state becomes 2. */
+static void *epoch_reader_in_thread(void *arg)
+{
+  (void) arg;
+
+  memory_epoch_enter();
+  __atomic_store_n(&epoch_reader_state, 1, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&epoch_reader_state, __ATOMIC_ACQUIRE) != 2)
+  {
+    sched_yield();
+  }
+  memory_epoch_exit();
+
+  return NULL;
+}
+
+/* Releases the chain at ptr while the main thread tries to retire it. */
+static void *release_against_retire_in_thread(void *ptr)
+{
+  return (void *) (intptr_t) memory_release(ptr);
+}
+
+static void test_memory_retire(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+  uint32_t available = memory_available();
+
+  /* The own critical section holds a retired chain back */
+  void *p = memory_allocate(BLOCK_SIZE);
+  memory_epoch_enter();
+  memory_epoch_enter();
+  TEST(ctxt, memory_retire(p));
+  TEST(ctxt, !memory_retire(p));
+  TEST(ctxt, !memory_release(p));
+  memory_epoch_exit();
+  TEST(ctxt, memory_epoch_reclaim() == 0);
+  TEST(ctxt, memory_available() == available - BLOCK_SIZE);
+  memory_epoch_exit();
+  TEST(ctxt, memory_epoch_reclaim() == 1);
+  TEST(ctxt, memory_available() == available);
+  TEST(ctxt, !memory_retire(NULL));
+  TEST(ctxt, !memory_retire(p));
+
+  /* So does the critical section of another thread */
+  pthread_t thread;
+  p = memory_allocate(2*BLOCK_SIZE);
+  pthread_create(&thread, NULL, epoch_reader_in_thread, NULL);
+  while (__atomic_load_n(&epoch_reader_state, __ATOMIC_ACQUIRE) != 1)
+  {
+    sched_yield();
+  }
+  TEST(ctxt, memory_retire(p));
+  TEST(ctxt, memory_epoch_reclaim() == 0);
+  __atomic_store_n(&epoch_reader_state, 2, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+  TEST(ctxt, memory_epoch_reclaim() == 1);
+  TEST(ctxt, memory_available() == available);
+
+  /* Without readers, a batch is released when the next one is complete */
+  void *chains[2*EPOCH_BATCH];
+  for (int i = 0; i < 2*EPOCH_BATCH; i++)
+  {
+    chains[i] = memory_allocate(BLOCK_SIZE);
+  }
+  for (int i = 0; i < EPOCH_BATCH; i++)
+  {
+    TEST(ctxt, memory_retire(chains[i]));
+  }
+  TEST(ctxt, memory_available() == available - 2*EPOCH_BATCH*BLOCK_SIZE);
+  for (int i = EPOCH_BATCH; i < 2*EPOCH_BATCH; i++)
+  {
+    TEST(ctxt, memory_retire(chains[i]));
+  }
+  TEST(ctxt, memory_available() == available - EPOCH_BATCH*BLOCK_SIZE);
+  TEST(ctxt, memory_epoch_reclaim() == EPOCH_BATCH);
+  TEST(ctxt, memory_available() == available);
+
+  /* Of a release and a retirement of the same chain, only one succeeds */
+  bool exactly_one = true;
+  for (int i = 0; i < 1000; i++)
+  {
+    void *released = NULL;
+    p = memory_allocate(BLOCK_SIZE);
+    pthread_create(&thread, NULL, release_against_retire_in_thread, p);
+    bool retired = memory_retire(p);
+    pthread_join(thread, &released);
+    exactly_one = exactly_one && (retired != (released != NULL));
+    memory_epoch_reclaim();
+    memory_flush_thread_cache();
+  }
+  TEST(ctxt, exactly_one);
+  TEST(ctxt, memory_used() == 0);
+  TEST(ctxt, segment_is_consistent());
+
+  /* A retired chain is no longer a live sample of the profiler */
+  memory_profile_set_interval(1);
+  void *unsampled = memory_allocate(BLOCK_SIZE);
+  p = memory_allocate(BLOCK_SIZE);
+  TEST(ctxt, profile_live == 1);
+  TEST(ctxt, memory_retire(p));
+  TEST(ctxt, profile_live == 0);
+  TEST(ctxt, block_site[block_index(p)] == 0);
+  TEST(ctxt, memory_epoch_reclaim() == 1);
+  TEST(ctxt, memory_release(unsampled));
+  memory_profile_set_interval(0);
+
+  print_summary(ctxt);
+}
+
+#ifndef MEMORY_NO_TIERS
+static void test_memory_tiers(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+  memory_tiers_initialize();
+  uint32_t available = memory_tiers_available();
+  TEST(ctxt, available == 65536 + 262144 + 1048576);
+
+  /* Each request goes to the smallest tier where it takes at most 16 blocks */
+  uint8_t *p1 = (uint8_t *) memory_tiers_allocate(100);
+  uint8_t *p2 = (uint8_t *) memory_tiers_allocate(16*64);
+  uint8_t *p3 = (uint8_t *) memory_tiers_allocate(16*64 + 1);
+  uint8_t *p4 = (uint8_t *) memory_tiers_allocate(16*1024 + 1);
+  uint8_t *p5 = (uint8_t *) memory_tiers_allocate(20*16384);
+  TEST(ctxt, memory_tiers_usable_size(p1) == 128);
+  TEST(ctxt, memory_tiers_usable_size(p2) == 1024);
+  TEST(ctxt, memory_tiers_usable_size(p3) == 2048);
+  TEST(ctxt, memory_tiers_usable_size(p4) == 32768);
+  TEST(ctxt, memory_tiers_usable_size(p5) == 20*16384);
+  TEST(ctxt, memory_tiers_allocate(0) == NULL);
+  TEST(ctxt, memory_tiers_allocate(2*1048576) == NULL);
+
+  /* The tiers are apart from the heap of memory_allocate */
+  TEST(ctxt, !memory_contains(p1));
+  TEST(ctxt, memory_tiers_usable_size(heap) == 0);
+  TEST(ctxt, !memory_tiers_release(heap));
+  TEST(ctxt, memory_available() == HEAP_SIZE);
+
+  TEST(ctxt, memory_tiers_release(p1));
+  TEST(ctxt, memory_tiers_release(p2));
+  TEST(ctxt, memory_tiers_release(p3));
+  TEST(ctxt, memory_tiers_release(p4));
+  TEST(ctxt, memory_tiers_release(p5));
+  TEST(ctxt, memory_tiers_usable_size(p3) == 0);
+  TEST(ctxt, !memory_tiers_release(NULL));
+
+  /* A full tier hands its requests to the next one */
+  memory_tiers_initialize();
+  for (int i = 0; i < 64; i++)
+  {
+    TEST(ctxt, memory_tiers_usable_size(memory_tiers_allocate(16*64))
+               == 1024);
+  }
+  TEST(ctxt, memory_tiers_usable_size(memory_tiers_allocate(100)) == 1024);
+
+  print_summary(ctxt);
+}
+#endif
+
 static void test_memory_available(void)
 {
   uint32_t available = HEAP_SIZE;
@@ -765,6 +1309,10 @@ static void test_memory_available(void)
   p1 = memory_allocate(1); available -= BLOCK_SIZE;
   TEST(ctxt, memory_available() == available);
 
+  /* Both are counted as blocks move, not by walking the lists */
+  TEST(ctxt, segment->free_blocks == _list_get_length(&free_list));
+  TEST(ctxt, segment->used_blocks == _list_get_length(&used_list));
+
   print_summary(ctxt);
 }
 
@@ -802,6 +1350,987 @@ static void test_memory_used(void)
   print_summary(ctxt);
 }
 
+static void test_memory_allocate_zeroed(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  TEST(ctxt, memory_allocate_zeroed(0) == NULL);
+  TEST(ctxt, memory_allocate_zeroed(HEAP_SIZE+1) == NULL);
+
+  uint8_t *p1 = (uint8_t *) memory_allocate(2*BLOCK_SIZE);
+  TEST(ctxt, p1 == heap);
+  TEST(ctxt, (block_flags[0] & BLOCK_DIRTY) != 0);
+  TEST(ctxt, (block_flags[1] & BLOCK_DIRTY) != 0);
+  TEST(ctxt, (block_flags[2] & BLOCK_DIRTY) == 0);
+  memset(p1, 0xFF, 2*BLOCK_SIZE);
+  TEST(ctxt, memory_release(p1));
+  memory_flush_thread_cache();
+
+  /* A block that was never handed out is known to be zero and is not
+   * cleared again: a byte planted behind the back of the allocator shows
+   * whether memset touched it. */
+  heap[3*BLOCK_SIZE] = 0xAA;
+
+  uint8_t *p2 = (uint8_t *) memory_allocate_zeroed(4*BLOCK_SIZE);
+  TEST(ctxt, p2 == heap);
+  bool dirty_blocks_zeroed = true;
+  for (int i = 0; i < 3*BLOCK_SIZE; i++)
+  {
+    dirty_blocks_zeroed = dirty_blocks_zeroed && (p2[i] == 0);
+  }
+  TEST(ctxt, dirty_blocks_zeroed);
+  TEST(ctxt, p2[3*BLOCK_SIZE] == 0xAA);
+  TEST(ctxt, (block_flags[2] & BLOCK_DIRTY) != 0);
+  TEST(ctxt, (block_flags[3] & BLOCK_DIRTY) != 0);
+  TEST(ctxt, (block_flags[4] & BLOCK_DIRTY) == 0);
+
+  memset(p2, 0xFF, 4*BLOCK_SIZE);
+  TEST(ctxt, memory_release(p2));
+  memory_flush_thread_cache();
+  p2 = (uint8_t *) memory_allocate_zeroed(4*BLOCK_SIZE);
+  TEST(ctxt, p2 == heap);
+  bool all_zeroed = true;
+  for (int i = 0; i < 4*BLOCK_SIZE; i++)
+  {
+    all_zeroed = all_zeroed && (p2[i] == 0);
+  }
+  TEST(ctxt, all_zeroed);
+
+  print_summary(ctxt);
+}
+
+static void *release_in_thread(void *ptr)
+{
+  return (void *) (intptr_t) memory_release(ptr);
+}
+
+static void *allocate_in_thread(void *unused)
+{
+  (void) unused;
+  return memory_allocate(BLOCK_SIZE);
+}
+
+static void *allocate_release_in_thread(void *unused)
+{
+  (void) unused;
+  void *ptr = memory_allocate(BLOCK_SIZE);
+  return memory_release(ptr) ? ptr : NULL;
+}
+
+static uint32_t idle_cache_state;
+
+/* Caches THREAD_CACHE_DEPTH chains and keeps them until the state is 2. */
+static void *cache_and_idle_in_thread(void *unused)
+{
+  (void) unused;
+  void *chains[THREAD_CACHE_DEPTH];
+  for (int i = 0; i < THREAD_CACHE_DEPTH; i++)
+  {
+    chains[i] = memory_allocate(BLOCK_SIZE);
+  }
+  for (int i = 0; i < THREAD_CACHE_DEPTH; i++)
+  {
+    memory_release(chains[i]);
+  }
+
+  __atomic_store_n(&idle_cache_state, 1, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&idle_cache_state, __ATOMIC_ACQUIRE) != 2)
+  {
+    sched_yield();
+  }
+
+  return NULL;
+}
+
+static void test_thread_cache(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  /* The chain released last is handed out first */
+  uint8_t *x = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t *y = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t *z = (uint8_t *) memory_allocate(2*BLOCK_SIZE);
+  TEST(ctxt, memory_release(x));
+  TEST(ctxt, memory_release(y));
+  TEST(ctxt, (block_flags[block_index(y)] & BLOCK_CACHED) != 0);
+  TEST(ctxt, _list_get_length(&free_list) == 0);
+  TEST(ctxt, memory_available() == HEAP_SIZE - 2*BLOCK_SIZE);
+  TEST(ctxt, memory_used() == 2*BLOCK_SIZE);
+  TEST(ctxt, !memory_release(y));
+  TEST(ctxt, memory_usable_size(y) == 0);
+  TEST(ctxt, memory_allocate(BLOCK_SIZE) == y);
+  TEST(ctxt, (block_flags[block_index(y)] & BLOCK_CACHED) == 0);
+  TEST(ctxt, memory_allocate(BLOCK_SIZE) == x);
+
+  /* Chains are only reused for the same number of blocks */
+  memset(z, 0xFF, 2*BLOCK_SIZE);
+  TEST(ctxt, memory_release(z));
+  TEST(ctxt, memory_allocate(BLOCK_SIZE) == heap+4*BLOCK_SIZE);
+  uint8_t *p = (uint8_t *) memory_allocate_zeroed(2*BLOCK_SIZE);
+  TEST(ctxt, p == z);
+  TEST(ctxt, (p[0] == 0) && (p[2*BLOCK_SIZE-1] == 0));
+  TEST(ctxt, segment_is_consistent());
+
+  /* A full bin spills its oldest half to the CPU caches */
+  memory_initialize();
+  uint8_t *blocks[THREAD_CACHE_DEPTH+1];
+  for (int i = 0; i < THREAD_CACHE_DEPTH+1; i++)
+  {
+    blocks[i] = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  }
+  for (int i = 0; i < THREAD_CACHE_DEPTH+1; i++)
+  {
+    TEST(ctxt, memory_release(blocks[i]));
+  }
+  TEST(ctxt, _list_get_length(&free_list) == 0);
+  TEST(ctxt, thread_cache.count[0] == THREAD_CACHE_DEPTH/2 + 1);
+  TEST(ctxt, memory_available() == HEAP_SIZE);
+  TEST(ctxt, segment_is_consistent());
+
+  /* A request the free list cannot satisfy flushes the cache first */
+  TEST(ctxt, memory_allocate(HEAP_SIZE) == heap);
+  TEST(ctxt, segment->cached_blocks == 0);
+  TEST(ctxt, memory_release(heap));
+
+  /* Entries from before memory_initialize are forgotten */
+  x = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  TEST(ctxt, memory_release(x));
+  memory_initialize();
+  y = (uint8_t *) memory_allocate(3*BLOCK_SIZE);
+  TEST(ctxt, y == heap);
+  TEST(ctxt, memory_allocate(BLOCK_SIZE) == heap+3*BLOCK_SIZE);
+
+  /* A thread flushes its cache when it exits */
+  memory_initialize();
+  pthread_t thread;
+  void *released = NULL;
+  pthread_create(&thread, NULL, allocate_release_in_thread, NULL);
+  pthread_join(thread, &released);
+  TEST(ctxt, released == heap);
+  TEST(ctxt, (block_flags[0] & BLOCK_CACHED) == 0);
+  TEST(ctxt, free_list.first->address == heap);
+  TEST(ctxt, memory_used() == 0);
+  TEST(ctxt, segment_is_consistent());
+
+  /* A failing request also flushes the cache of an idle thread */
+  memory_initialize();
+  pthread_create(&thread, NULL, cache_and_idle_in_thread, NULL);
+  while (__atomic_load_n(&idle_cache_state, __ATOMIC_ACQUIRE) != 1)
+  {
+    sched_yield();
+  }
+  TEST(ctxt, segment->cached_blocks == THREAD_CACHE_DEPTH);
+  TEST(ctxt, memory_allocate(HEAP_SIZE) == heap);
+  TEST(ctxt, segment->cached_blocks == 0);
+  TEST(ctxt, memory_release(heap));
+  __atomic_store_n(&idle_cache_state, 2, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+  TEST(ctxt, memory_used() == 0);
+  TEST(ctxt, segment_is_consistent());
+
+  print_summary(ctxt);
+}
+
+static void test_remote_free_queue(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  /* A chain released by another thread goes to the queue of its owner */
+  uint8_t *x = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t *y = (uint8_t *) memory_allocate(2*BLOCK_SIZE);
+  uint8_t *z = (uint8_t *) memory_allocate(8*BLOCK_SIZE);
+  uint32_t queue = block_owner[block_index(x)];
+  TEST(ctxt, queue != 0);
+  TEST(ctxt, remote_queues[queue-1].owned);
+
+  pthread_t thread;
+  void *released = NULL;
+  uint8_t *chains[] = { x, y, z };
+  for (int i = 0; i < 3; i++)
+  {
+    pthread_create(&thread, NULL, release_in_thread, chains[i]);
+    pthread_join(thread, &released);
+    TEST(ctxt, released != NULL);
+  }
+  TEST(ctxt, remote_queues[queue-1].head == block_index(z) + 1);
+  TEST(ctxt, remote_next[block_index(z)] == block_index(y) + 1);
+  TEST(ctxt, !memory_release(x));
+  TEST(ctxt, memory_used() == 0);
+  TEST(ctxt, _list_get_length(&free_list) == 0);
+  TEST(ctxt, segment_is_consistent());
+
+  /* The owner drains it on its next allocation: small chains into its
+   * thread cache, large ones into the free list */
+  TEST(ctxt, memory_allocate(2*BLOCK_SIZE) == y);
+  TEST(ctxt, remote_queues[queue-1].head == 0);
+  TEST(ctxt, _list_get_length(&free_list) == 8);
+  TEST(ctxt, memory_allocate(BLOCK_SIZE) == x);
+  TEST(ctxt, segment_is_consistent());
+
+  /* Exiting threads give up their queue */
+  for (int i = 0; i < REMOTE_QUEUES; i++)
+  {
+    pthread_create(&thread, NULL, allocate_release_in_thread, NULL);
+    pthread_join(thread, &released);
+  }
+  int owned = 0;
+  for (int i = 0; i < REMOTE_QUEUES; i++)
+  {
+    owned += remote_queues[i].owned;
+  }
+  TEST(ctxt, owned == 1);
+
+  print_summary(ctxt);
+}
+
+static void test_cpu_caches(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  /* Stay on one CPU, so every call uses the same CPU cache */
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(sched_getcpu(), &cpus);
+  sched_setaffinity(0, sizeof(cpus), &cpus);
+
+  memory_initialize();
+
+  TEST(ctxt, cpu_cache_current() < CPU_CACHES);
+  TEST(ctxt, cpu_cache_pop(0) == NULL);
+  TEST(ctxt, cpu_cache_pop(THREAD_CACHE_BINS+1) == NULL);
+
+  /* Chains spilled by a thread are handed out again once its thread cache
+   * is empty, also to other threads on the same CPU */
+  uint8_t *blocks[THREAD_CACHE_DEPTH+1];
+  for (int i = 0; i < THREAD_CACHE_DEPTH+1; i++)
+  {
+    blocks[i] = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  }
+  for (int i = 0; i < THREAD_CACHE_DEPTH+1; i++)
+  {
+    TEST(ctxt, memory_release(blocks[i]));
+  }
+  for (int i = THREAD_CACHE_DEPTH; i >= THREAD_CACHE_DEPTH/2; i--)
+  {
+    TEST(ctxt, memory_allocate(BLOCK_SIZE) == blocks[i]);
+  }
+  TEST(ctxt, memory_allocate(BLOCK_SIZE) == blocks[THREAD_CACHE_DEPTH/2 - 1]);
+  TEST(ctxt, (block_flags[THREAD_CACHE_DEPTH/2 - 1] & BLOCK_CACHED) == 0);
+
+  pthread_t thread;
+  void *allocated = NULL;
+  pthread_create(&thread, NULL, allocate_in_thread, NULL);
+  pthread_join(thread, &allocated);
+  TEST(ctxt, (allocated == blocks[THREAD_CACHE_DEPTH/2 - 2]));
+  TEST(ctxt, memory_used() == (THREAD_CACHE_DEPTH/2 + 3) * BLOCK_SIZE);
+  TEST(ctxt, segment_is_consistent());
+
+  /* A CPU cache that is in use is passed over for its neighbours */
+  uint32_t current = cpu_cache_current();
+  cpu_caches[current].busy = true;
+  TEST(ctxt, cpu_cache_pop(1) == NULL);
+  cpu_caches[current].busy = false;
+  struct block *block = cpu_cache_pop(1);
+  TEST(ctxt, block->address == blocks[1]);
+
+  block_flags[block_index(blocks[1])] |= BLOCK_CACHED;
+  segment->cached_blocks++;
+  cpu_caches[current].busy = true;
+  TEST(ctxt, cpu_cache_push(block_index(blocks[1]), 1));
+  TEST(ctxt, cpu_caches[(current+1) % CPU_CACHES].count[0] == 1);
+  TEST(ctxt, cpu_cache_pop(1) == block);
+  cpu_caches[current].busy = false;
+
+  /* A request the free list cannot satisfy flushes the CPU caches */
+  memory_initialize();
+  for (int i = 0; i < THREAD_CACHE_DEPTH+1; i++)
+  {
+    blocks[i] = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  }
+  for (int i = 0; i < THREAD_CACHE_DEPTH+1; i++)
+  {
+    memory_release(blocks[i]);
+  }
+  memory_flush_thread_cache();
+  TEST(ctxt, segment->cached_blocks == THREAD_CACHE_DEPTH/2);
+  TEST(ctxt, memory_allocate(HEAP_SIZE) == heap);
+  TEST(ctxt, segment->cached_blocks == 0);
+  TEST(ctxt, segment_is_consistent());
+
+  print_summary(ctxt);
+}
+
+static void *allocate_wait_in_thread(void *size)
+{
+  return memory_allocate_wait((uint32_t) (intptr_t) size, -1);
+}
+
+static void wait_for_waiters(uint32_t waiting)
+{
+  while (__atomic_load_n(&(segment->waiting), __ATOMIC_RELAXED) != waiting)
+  {
+    usleep(1000);
+  }
+}
+
+static void test_memory_allocate_wait(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  TEST(ctxt, memory_allocate_wait(0, -1) == NULL);
+  TEST(ctxt, memory_allocate_wait(HEAP_SIZE+1, -1) == NULL);
+  uint8_t *all = (uint8_t *) memory_allocate_wait(HEAP_SIZE, 0);
+  TEST(ctxt, all == heap);
+
+  /* Without a release the timeout expires */
+  TEST(ctxt, memory_allocate_wait(BLOCK_SIZE, 0) == NULL);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  TEST(ctxt, memory_allocate_wait(BLOCK_SIZE, 20) == NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long elapsed = (end.tv_sec - start.tv_sec) * 1000
+               + (end.tv_nsec - start.tv_nsec) / 1000000;
+  TEST(ctxt, elapsed >= 19);
+  TEST(ctxt, segment->waiting == 0);
+  TEST(ctxt, memory_release(all));
+
+  /* A release wakes the waiter, the largest request first */
+  uint8_t *blocks[NUMBER_OF_BLOCKS];
+  for (int i = 0; i < NUMBER_OF_BLOCKS; i++)
+  {
+    blocks[i] = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  }
+
+  pthread_t small, large;
+  void *small_address = NULL;
+  void *large_address = NULL;
+  pthread_create(&small, NULL, allocate_wait_in_thread,
+                 (void *) (intptr_t) BLOCK_SIZE);
+  wait_for_waiters(1);
+  pthread_create(&large, NULL, allocate_wait_in_thread,
+                 (void *) (intptr_t) (2*BLOCK_SIZE));
+  wait_for_waiters(2);
+  segment_lock();
+  TEST(ctxt, waiting_largest() == 2);
+  segment_unlock();
+
+  /* While anyone waits, a release goes straight to the free list */
+  TEST(ctxt, memory_release(blocks[4]));
+  TEST(ctxt, _list_get_length(&free_list) == 1);
+  usleep(10000);
+  TEST(ctxt, segment->waiting == 2);
+
+  /* A new small request does not pass the large one that waits */
+  TEST(ctxt, memory_allocate_wait(BLOCK_SIZE, 0) == NULL);
+  TEST(ctxt, memory_allocate_wait(BLOCK_SIZE, 5) == NULL);
+  TEST(ctxt, _list_get_length(&free_list) == 1);
+
+  TEST(ctxt, memory_release(blocks[5]));
+  pthread_join(large, &large_address);
+  TEST(ctxt, large_address == blocks[4]);
+  TEST(ctxt, segment->waiting == 1);
+
+  TEST(ctxt, memory_release(blocks[9]));
+  pthread_join(small, &small_address);
+  TEST(ctxt, small_address == blocks[9]);
+  TEST(ctxt, segment->waiting == 0);
+  TEST(ctxt, segment_is_consistent());
+
+  print_summary(ctxt);
+}
+
+static void test_memory_snapshot_write(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  uint8_t *p1 = (uint8_t *) memory_allocate(2*BLOCK_SIZE);
+  uint8_t *p2 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t *p3 = (uint8_t *) memory_allocate(THREAD_CACHE_BINS*BLOCK_SIZE + 1);
+  uint8_t *p4 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  TEST(ctxt, memory_release(p2));
+  TEST(ctxt, memory_release(p3));
+
+  FILE *out = tmpfile();
+  TEST(ctxt, memory_snapshot_write(out));
+  rewind(out);
+
+  struct memory_snapshot_header header;
+  uint8_t states[NUMBER_OF_BLOCKS];
+  uint32_t alloc_counts[NUMBER_OF_BLOCKS];
+  uint32_t runs[2];
+  TEST(ctxt, fread(&header, sizeof(header), 1, out) == 1);
+  TEST(ctxt, fread(states, sizeof(states), 1, out) == 1);
+  TEST(ctxt, fread(alloc_counts, sizeof(alloc_counts), 1, out) == 1);
+  TEST(ctxt, fread(runs, sizeof(runs), 1, out) == 1);
+  TEST(ctxt, fgetc(out) == EOF);
+  fclose(out);
+
+  TEST(ctxt, header.magic == MEMORY_SNAPSHOT_MAGIC);
+  TEST(ctxt, header.version == MEMORY_SNAPSHOT_VERSION);
+  TEST(ctxt, header.heap_size == HEAP_SIZE);
+  TEST(ctxt, header.block_size == BLOCK_SIZE);
+  TEST(ctxt, header.blocks == NUMBER_OF_BLOCKS);
+  TEST(ctxt, header.wilderness == THREAD_CACHE_BINS + 5);
+  TEST(ctxt, header.runs == 1);
+
+  TEST(ctxt, p1 == heap);
+  TEST(ctxt, states[0] == (MEMORY_SNAPSHOT_HEAD | MEMORY_SNAPSHOT_DIRTY));
+  TEST(ctxt, alloc_counts[0] == 2);
+  TEST(ctxt, states[1] == (MEMORY_SNAPSHOT_BODY | MEMORY_SNAPSHOT_DIRTY));
+  TEST(ctxt, states[2] == (MEMORY_SNAPSHOT_CACHED | MEMORY_SNAPSHOT_DIRTY));
+  TEST(ctxt, alloc_counts[2] == 1);
+  TEST(ctxt, states[3] == (MEMORY_SNAPSHOT_FREE | MEMORY_SNAPSHOT_DIRTY));
+  TEST(ctxt, alloc_counts[3] == 0);
+  TEST(ctxt, runs[0] == 3);
+  TEST(ctxt, runs[1] == THREAD_CACHE_BINS + 1);
+  TEST(ctxt, p4 == heap + (THREAD_CACHE_BINS + 4)*BLOCK_SIZE);
+  TEST(ctxt, states[THREAD_CACHE_BINS + 4] & MEMORY_SNAPSHOT_HEAD);
+  TEST(ctxt, states[NUMBER_OF_BLOCKS-1] == MEMORY_SNAPSHOT_WILDERNESS);
+
+  print_summary(ctxt);
+}
+
+static void test_memory_latency(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  /* Exact buckets below 16 ticks, eight per power of two above */
+  TEST(ctxt, latency_bucket(0) == 0);
+  TEST(ctxt, latency_bucket(15) == 15);
+  TEST(ctxt, latency_bucket(16) == 16);
+  TEST(ctxt, latency_bucket(17) == 16);
+  TEST(ctxt, latency_bucket(18) == 17);
+  TEST(ctxt, latency_bucket(32) == 24);
+  TEST(ctxt, latency_bucket(UINT64_MAX) == LATENCY_BUCKETS - 1);
+  TEST(ctxt, latency_bucket_limit(15) == 15);
+  TEST(ctxt, latency_bucket_limit(16) == 17);
+  TEST(ctxt, latency_bucket_limit(24) == 35);
+  TEST(ctxt, latency_bucket_limit(LATENCY_BUCKETS - 1) == UINT64_MAX);
+  TEST(ctxt, latency_bucket(latency_bucket_limit(100)) == 100);
+  TEST(ctxt, latency_bucket(latency_bucket_limit(100) + 1) == 101);
+
+  TEST(ctxt, latency_size_class(1) == 0);
+  TEST(ctxt, latency_size_class(2) == 1);
+  TEST(ctxt, latency_size_class(3) == 2);
+  TEST(ctxt, latency_size_class(4) == 2);
+  TEST(ctxt, latency_size_class(UINT32_MAX)
+             == MEMORY_LATENCY_SIZE_CLASSES - 1);
+
+  memory_initialize();
+
+  /* Nothing is recorded while the recorder is off */
+  TEST(ctxt, memory_release(memory_allocate(BLOCK_SIZE)));
+  TEST(ctxt, memory_latency_count(MEMORY_LATENCY_ALLOCATE, 0) == 0);
+
+  memory_latency_enable(true);
+  for (int i = 0; i < 10; i++)
+  {
+    uint8_t *p = (uint8_t *) memory_allocate(BLOCK_SIZE);
+    uint8_t *q = (uint8_t *) memory_allocate(3*BLOCK_SIZE);
+    TEST(ctxt, memory_release(q));
+    TEST(ctxt, memory_release(p));
+  }
+  TEST(ctxt, memory_allocate(0) == NULL);
+  memory_latency_enable(false);
+
+  TEST(ctxt, memory_latency_count(MEMORY_LATENCY_ALLOCATE, 0) == 11);
+  TEST(ctxt, memory_latency_count(MEMORY_LATENCY_ALLOCATE, 2) == 10);
+  TEST(ctxt, memory_latency_count(MEMORY_LATENCY_RELEASE, 0) == 10);
+  TEST(ctxt, memory_latency_count(MEMORY_LATENCY_RELEASE, 2) == 10);
+  TEST(ctxt, memory_latency_count(MEMORY_LATENCY_RELEASE, 1) == 0);
+  TEST(ctxt, memory_latency_count(2, 0) == 0);
+  TEST(ctxt, memory_latency_count(MEMORY_LATENCY_ALLOCATE,
+                                  MEMORY_LATENCY_SIZE_CLASSES) == 0);
+
+  uint64_t p50 = memory_latency_percentile(MEMORY_LATENCY_ALLOCATE, 0, 50.0);
+  uint64_t max = memory_latency_percentile(MEMORY_LATENCY_ALLOCATE, 0, 100.0);
+  TEST(ctxt, p50 > 0);
+  TEST(ctxt, p50 <= max);
+  TEST(ctxt, memory_latency_percentile(MEMORY_LATENCY_RELEASE, 1, 50.0) == 0);
+
+  char buffer[4096];
+  FILE *out = tmpfile();
+  memory_latency_write(out);
+  rewind(out);
+  buffer[fread(buffer, 1, sizeof(buffer) - 1, out)] = '\0';
+  TEST(ctxt, strncmp(buffer, "operation,max_blocks,count,", 27) == 0);
+  TEST(ctxt, strstr(buffer, "\nallocate,1,11,") != NULL);
+  TEST(ctxt, strstr(buffer, "\nrelease,4,10,") != NULL);
+  TEST(ctxt, strstr(buffer, "\nrelease,2,") == NULL);
+  fclose(out);
+
+  memory_latency_reset();
+  TEST(ctxt, memory_latency_count(MEMORY_LATENCY_ALLOCATE, 0) == 0);
+  TEST(ctxt, memory_latency_count(MEMORY_LATENCY_RELEASE, 2) == 0);
+
+  print_summary(ctxt);
+}
+
+static void test_memory_profile(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+  memory_profile_set_interval(1);
+
+  /* The first allocation of a thread only starts its interval */
+  uint8_t *x = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  TEST(ctxt, block_site[block_index(x)] == 0);
+
+  uint8_t *y = (uint8_t *) memory_allocate(2*BLOCK_SIZE - 1);
+  TEST(ctxt, block_site[block_index(y)] != 0);
+  TEST(ctxt, profile_size[block_index(y)] == 2*BLOCK_SIZE - 1);
+  TEST(ctxt, profile_live == 1);
+
+  char buffer[4096];
+  FILE *out = tmpfile();
+  memory_profile_write_collapsed(out, true);
+  rewind(out);
+  buffer[fread(buffer, 1, sizeof(buffer) - 1, out)] = '\0';
+  TEST(ctxt, strstr(buffer, ";memory_allocate 127\n") != NULL);
+  fclose(out);
+
+  /* Releasing drops the live sample, not the cumulative one */
+  TEST(ctxt, memory_release(y));
+  TEST(ctxt, block_site[block_index(y)] == 0);
+  TEST(ctxt, profile_live == 0);
+
+  out = tmpfile();
+  memory_profile_write_collapsed(out, true);
+  TEST(ctxt, ftell(out) == 0);
+  memory_profile_write_collapsed(out, false);
+  memory_profile_write_pprof(out);
+  rewind(out);
+  buffer[fread(buffer, 1, sizeof(buffer) - 1, out)] = '\0';
+  TEST(ctxt, strstr(buffer, ";memory_allocate 127\n") != NULL);
+  TEST(ctxt, strstr(buffer, "heap profile: 0: 0 [1: 127] @ heap_v2/1\n")
+             != NULL);
+  TEST(ctxt, strstr(buffer, "0: 0 [1: 127] @ 0x") != NULL);
+  TEST(ctxt, strstr(buffer, "MAPPED_LIBRARIES:") != NULL);
+  fclose(out);
+
+  /* Nothing is sampled while sampling is off */
+  memory_profile_set_interval(0);
+  uint8_t *z = (uint8_t *) memory_allocate_zeroed(BLOCK_SIZE);
+  TEST(ctxt, block_site[block_index(z)] == 0);
+  TEST(ctxt, profile_live == 0);
+
+  print_summary(ctxt);
+}
+
+static void test_memory_handles(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  TEST(ctxt, memory_allocate_handle(0) == 0);
+  TEST(ctxt, memory_allocate_handle(HEAP_SIZE+1) == 0);
+  TEST(ctxt, memory_pin(0) == NULL);
+  TEST(ctxt, memory_pin(NUMBER_OF_BLOCKS+1) == NULL);
+
+  memory_handle_t h1 = memory_allocate_handle(2*BLOCK_SIZE);
+  memory_handle_t h2 = memory_allocate_handle(BLOCK_SIZE);
+  TEST(ctxt, h1 != 0);
+  TEST(ctxt, h2 != 0);
+  TEST(ctxt, h1 != h2);
+  TEST(ctxt, memory_used() == 3*BLOCK_SIZE);
+
+  uint8_t *p1 = (uint8_t *) memory_pin(h1);
+  TEST(ctxt, p1 == heap);
+  TEST(ctxt, memory_usable_size(p1) == 2*BLOCK_SIZE);
+  TEST(ctxt, !memory_release(p1));
+  TEST(ctxt, !memory_release_handle(h1));
+  memory_unpin(h1);
+  TEST(ctxt, memory_release_handle(h1));
+  TEST(ctxt, !memory_release_handle(h1));
+  TEST(ctxt, memory_pin(h1) == NULL);
+  TEST(ctxt, memory_used() == BLOCK_SIZE);
+  TEST(ctxt, segment_is_consistent());
+
+  /* Unpinning too often does not underflow */
+  memory_unpin(h2);
+  TEST(ctxt, memory_pin(h2) == heap+2*BLOCK_SIZE);
+  memory_unpin(h2);
+  TEST(ctxt, memory_release_handle(h2));
+  TEST(ctxt, memory_used() == 0);
+
+  /* A handle does not survive memory_initialize */
+  h1 = memory_allocate_handle(BLOCK_SIZE);
+  memory_initialize();
+  p1 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  TEST(ctxt, memory_pin(h1) == NULL);
+  TEST(ctxt, !memory_release_handle(h1));
+  TEST(ctxt, memory_usable_size(p1) == BLOCK_SIZE);
+  TEST(ctxt, memory_used() == BLOCK_SIZE);
+
+  print_summary(ctxt);
+}
+
+static void test_memory_compact(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+
+  memory_handle_t a = memory_allocate_handle(2*BLOCK_SIZE);
+  memory_handle_t b = memory_allocate_handle(BLOCK_SIZE);
+  uint8_t *c = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  memory_handle_t d = memory_allocate_handle(2*BLOCK_SIZE);
+  memory_handle_t e = memory_allocate_handle(BLOCK_SIZE);
+
+  strcpy((char *) memory_pin(b), "b");
+  memory_unpin(b);
+  strcpy((char *) c, "c");
+  uint8_t *pinned = (uint8_t *) memory_pin(e);
+  strcpy((char *) pinned, "e");
+
+  memory_release_handle(a);
+  memory_release_handle(d);
+  TEST(ctxt, memory_allocate(3*BLOCK_SIZE) == heap+7*BLOCK_SIZE);
+  memory_release(heap+7*BLOCK_SIZE);
+
+  /* b slides down, c is a raw pointer and e is pinned */
+  memory_compact();
+  TEST(ctxt, segment_is_consistent());
+  TEST(ctxt, memory_pin(b) == heap);
+  TEST(ctxt, strcmp((char *) heap, "b") == 0);
+  memory_unpin(b);
+  TEST(ctxt, strcmp((char *) c, "c") == 0);
+  TEST(ctxt, memory_pin(e) == pinned);
+  memory_unpin(e);
+  TEST(ctxt, segment->wilderness == 7);
+  TEST(ctxt, memory_available() == HEAP_SIZE - 3*BLOCK_SIZE);
+
+  /* Once e is unpinned it closes the gap behind c */
+  memory_unpin(e);
+  memory_compact();
+  TEST(ctxt, segment_is_consistent());
+  TEST(ctxt, memory_pin(e) == heap+4*BLOCK_SIZE);
+  TEST(ctxt, strcmp((char *) heap+4*BLOCK_SIZE, "e") == 0);
+  memory_unpin(e);
+  TEST(ctxt, segment->wilderness == 5);
+  TEST(ctxt, memory_allocate(11*BLOCK_SIZE) == heap+5*BLOCK_SIZE);
+  TEST(ctxt, memory_release_handle(b));
+  TEST(ctxt, memory_release_handle(e));
+  TEST(ctxt, memory_release(c));
+
+  print_summary(ctxt);
+}
+
+static void test_memory_allocate_iov(void)
+{
+  context_t *ctxt = new_context(__func__);
+  struct iovec iov[4];
+
+  memory_initialize();
+
+  TEST(ctxt, memory_allocate_iov(0, iov, 4) == 0);
+  TEST(ctxt, memory_allocate_iov(BLOCK_SIZE, iov, 0) == 0);
+
+  /* Contiguous memory is handed out as a single piece */
+  TEST(ctxt, memory_allocate_iov(BLOCK_SIZE+1, iov, 4) == 1);
+  TEST(ctxt, iov[0].iov_base == heap);
+  TEST(ctxt, iov[0].iov_len == BLOCK_SIZE+1);
+  TEST(ctxt, memory_release_iov(iov, 1));
+
+  /* Fragment the heap into free runs of 2, 3, 1 and 1 blocks */
+  uint8_t *p[NUMBER_OF_BLOCKS];
+  for (int i = 0; i < NUMBER_OF_BLOCKS; i++)
+  {
+    p[i] = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  }
+  memory_release(p[0]);
+  memory_release(p[1]);
+  memory_release(p[4]);
+  memory_release(p[5]);
+  memory_release(p[6]);
+  memory_release(p[9]);
+  memory_release(p[12]);
+  TEST(ctxt, memory_allocate(4*BLOCK_SIZE) == NULL);
+
+  TEST(ctxt, memory_allocate_iov(4*BLOCK_SIZE+10, iov, 1) == 0);
+  TEST(ctxt, memory_allocate_iov(7*BLOCK_SIZE+1, iov, 4) == 0);
+  TEST(ctxt, memory_available() == 7*BLOCK_SIZE);
+
+  TEST(ctxt, memory_allocate_iov(4*BLOCK_SIZE+10, iov, 4) == 2);
+  TEST(ctxt, iov[0].iov_base == heap+4*BLOCK_SIZE);
+  TEST(ctxt, iov[0].iov_len == 3*BLOCK_SIZE);
+  TEST(ctxt, iov[1].iov_base == heap);
+  TEST(ctxt, iov[1].iov_len == BLOCK_SIZE+10);
+  TEST(ctxt, memory_available() == 2*BLOCK_SIZE);
+  TEST(ctxt, memory_usable_size(iov[1].iov_base) == 2*BLOCK_SIZE);
+  TEST(ctxt, segment_is_consistent());
+
+  TEST(ctxt, memory_release_iov(iov, 2));
+  TEST(ctxt, !memory_release_iov(iov, 2));
+  TEST(ctxt, memory_available() == 7*BLOCK_SIZE);
+
+  /* The wilderness counts as a run, joined with a free run next to it */
+  memory_initialize();
+  uint8_t *a = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t *b = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t *c = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  memory_release(a);
+  memory_release(c);
+  TEST(ctxt, memory_allocate_iov(HEAP_SIZE, iov, 4) == 0);
+  TEST(ctxt, memory_allocate_iov(HEAP_SIZE-BLOCK_SIZE, iov, 4) == 2);
+  TEST(ctxt, iov[0].iov_base == heap+2*BLOCK_SIZE);
+  TEST(ctxt, iov[0].iov_len == HEAP_SIZE-2*BLOCK_SIZE);
+  TEST(ctxt, iov[1].iov_base == heap);
+  TEST(ctxt, iov[1].iov_len == BLOCK_SIZE);
+  TEST(ctxt, memory_available() == 0);
+  TEST(ctxt, segment_is_consistent());
+  TEST(ctxt, memory_release_iov(iov, 2));
+  TEST(ctxt, memory_release(b));
+
+  print_summary(ctxt);
+}
+
+static void test_memory_shared(void)
+{
+  context_t *ctxt = new_context(__func__);
+  int status;
+
+  TEST(ctxt, memory_initialize_shared(NULL));
+  TEST(ctxt, segment != &private_segment);
+  TEST(ctxt, memory_available() == HEAP_SIZE);
+
+  char *p1 = (char *) memory_allocate(BLOCK_SIZE);
+  if (fork() == 0)
+  {
+    char *p2 = (char *) memory_allocate(2*BLOCK_SIZE);
+    strcpy(p1, "written by child");
+    strcpy(p2, "allocated by child");
+    _exit((p2 == (char *) heap+BLOCK_SIZE) ? 0 : 1);
+  }
+  wait(&status);
+  TEST(ctxt, WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+  TEST(ctxt, strcmp(p1, "written by child") == 0);
+  TEST(ctxt, memory_used() == 3*BLOCK_SIZE);
+  TEST(ctxt, strcmp((char *) heap+BLOCK_SIZE, "allocated by child") == 0);
+  TEST(ctxt, memory_release(heap+BLOCK_SIZE));
+  TEST(ctxt, memory_used() == BLOCK_SIZE);
+
+  /* exit does not flush the thread cache, so a child must not cache */
+  fflush(stdout);
+  if (fork() == 0)
+  {
+    memory_release(memory_allocate(BLOCK_SIZE));
+    exit(0);
+  }
+  wait(&status);
+  TEST(ctxt, memory_release(p1));
+  void *all = memory_allocate(HEAP_SIZE);
+  TEST(ctxt, all == heap);
+  TEST(ctxt, memory_release(all));
+
+  /* Nor may it claim a remote free queue that would outlive it */
+  for (int i = 0; i <= REMOTE_QUEUES; i++)
+  {
+    if (fork() == 0)
+    {
+      memory_allocate(BLOCK_SIZE);
+      _exit(0);
+    }
+    wait(&status);
+  }
+  bool owned = false;
+  for (int i = 0; i < REMOTE_QUEUES; i++)
+  {
+    owned = owned || remote_queues[i].owned;
+  }
+  TEST(ctxt, !owned);
+  memory_initialize();
+
+  memory_detach_shared();
+  TEST(ctxt, segment == &private_segment);
+
+  char name[64];
+  snprintf(name, sizeof(name), "/memory_test_%d", (int) getpid());
+
+  TEST(ctxt, memory_initialize_shared(name));
+  uint8_t *shared_heap = heap;
+  TEST(ctxt, !memory_initialize_shared(name));
+  TEST(ctxt, heap == shared_heap);
+
+  p1 = (char *) memory_allocate(BLOCK_SIZE);
+  strcpy(p1, "named segment");
+  if (fork() == 0)
+  {
+    memory_detach_shared();
+    bool attached = memory_attach_shared(name);
+    _exit((   attached
+           && (heap == shared_heap)
+           && (strcmp(p1, "named segment") == 0)
+           && memory_release(p1)) ? 0 : 1);
+  }
+  wait(&status);
+  TEST(ctxt, WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+  TEST(ctxt, memory_used() == 0);
+
+  /* The segment cannot move, so a taken range makes attaching fail */
+  struct segment *shared_base = segment;
+  if (fork() == 0)
+  {
+    memory_detach_shared();
+    void *taken = mmap(shared_base, sizeof(struct segment),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    bool attached = memory_attach_shared(name);
+    _exit((   (taken == shared_base)
+           && !attached
+           && (errno == EADDRINUSE)
+           && (segment == &private_segment)) ? 0 : 1);
+  }
+  wait(&status);
+  TEST(ctxt, WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+  TEST(ctxt, memory_attach_shared(name));
+  TEST(ctxt, heap == shared_heap);
+
+  shm_unlink(name);
+  memory_detach_shared();
+  TEST(ctxt, !memory_attach_shared(name) && (errno == ENOENT));
+  TEST(ctxt, segment == &private_segment);
+
+  print_summary(ctxt);
+}
+
+static void test_segment_is_consistent(void)
+{
+  context_t *ctxt = new_context(__func__);
+
+  memory_initialize();
+  TEST(ctxt, segment_is_consistent());
+
+  uint8_t *p1 = (uint8_t *) memory_allocate(BLOCK_SIZE);
+  uint8_t *p2 = (uint8_t *) memory_allocate(3*BLOCK_SIZE);
+  memory_allocate(2*BLOCK_SIZE);
+  memory_release(p1);
+  memory_flush_thread_cache();
+  TEST(ctxt, segment_is_consistent());
+
+  pool_of_blocks[block_index(p2)].alloc_count = 2;
+  TEST(ctxt, !segment_is_consistent());
+  pool_of_blocks[block_index(p2)].alloc_count = 3;
+  TEST(ctxt, segment_is_consistent());
+
+  block_flags[block_index(p2)+1] = BLOCK_HEAD;
+  TEST(ctxt, !segment_is_consistent());
+  block_flags[block_index(p2)+1] = BLOCK_BODY;
+
+  segment->free_blocks++;
+  TEST(ctxt, !segment_is_consistent());
+  segment->free_blocks--;
+
+  segment->wilderness_end--;
+  TEST(ctxt, !segment_is_consistent());
+  segment->wilderness_end++;
+
+  used_list.last->next = used_list.first;
+  TEST(ctxt, !segment_is_consistent());
+  used_list.last->next = NULL;
+
+  free_list.first = &orphin_block;
+  TEST(ctxt, !segment_is_consistent());
+  free_list.first = &(pool_of_blocks[0]);
+  TEST(ctxt, segment_is_consistent());
+
+  print_summary(ctxt);
+}
+
+static void test_memory_persistent(void)
+{
+  context_t *ctxt = new_context(__func__);
+  bool restored = true;
+  int status;
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/memory_test_%d.heap", (int) getpid());
+  unlink(path);
+
+  TEST(ctxt, memory_open_persistent(path, &restored));
+  TEST(ctxt, !restored);
+  TEST(ctxt, memory_available() == HEAP_SIZE);
+  TEST(ctxt, memory_get_root() == NULL);
+  uint8_t *first_heap = heap;
+  char *p1 = (char *) memory_allocate(2*BLOCK_SIZE);
+  strcpy(p1, "cache");
+  memory_set_root(p1);
+  memory_close_persistent();
+  TEST(ctxt, segment == &private_segment);
+
+  /* Clean restart: mapped at the same address, nothing rebuilt */
+  TEST(ctxt, memory_open_persistent(path, &restored));
+  TEST(ctxt, restored);
+  TEST(ctxt, heap == first_heap);
+  TEST(ctxt, memory_get_root() == p1);
+  TEST(ctxt, strcmp(p1, "cache") == 0);
+  TEST(ctxt, memory_used() == 2*BLOCK_SIZE);
+  TEST(ctxt, memory_usable_size(p1) == 2*BLOCK_SIZE);
+  memory_close_persistent();
+
+  /* Crash: the heap is not closed, so it is validated on the next start */
+  if (fork() == 0)
+  {
+    bool ok = memory_open_persistent(path, NULL);
+    ok = ok && (memory_allocate(BLOCK_SIZE) != NULL);
+    _exit(ok ? 0 : 1);
+  }
+  wait(&status);
+  TEST(ctxt, WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+  TEST(ctxt, memory_open_persistent(path, &restored));
+  TEST(ctxt, restored);
+  TEST(ctxt, memory_used() == 3*BLOCK_SIZE);
+  memory_close_persistent();
+
+  /* The old address is taken: the bookkeeping is relocated */
+  void *blocker = mmap(first_heap, sizeof(struct segment),
+                       PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  TEST(ctxt, blocker == (void *) first_heap);
+  TEST(ctxt, memory_open_persistent(path, &restored));
+  TEST(ctxt, restored);
+  TEST(ctxt, heap != first_heap);
+  TEST(ctxt, segment_is_consistent());
+  p1 = (char *) memory_get_root();
+  TEST(ctxt, p1 == (char *) heap);
+  TEST(ctxt, strcmp(p1, "cache") == 0);
+  TEST(ctxt, memory_release(p1));
+  TEST(ctxt, memory_used() == BLOCK_SIZE);
+  memory_close_persistent();
+  munmap(blocker, sizeof(struct segment));
+
+  /* Corrupted bookkeeping after a crash: the heap starts over */
+  TEST(ctxt, memory_open_persistent(path, &restored));
+  TEST(ctxt, restored);
+  used_list.first = NULL;
+  segment->clean = false;
+  msync(segment, sizeof(struct segment), MS_SYNC);
+  munmap(segment, sizeof(struct segment));
+  segment = &private_segment;
+  close(persistent_fd);
+  persistent_fd = -1;
+  TEST(ctxt, memory_open_persistent(path, &restored));
+  TEST(ctxt, !restored);
+  TEST(ctxt, memory_used() == 0);
+  TEST(ctxt, (block_flags[NUMBER_OF_BLOCKS-1] & BLOCK_DIRTY) != 0);
+  memory_close_persistent();
+
+  unlink(path);
+
+  print_summary(ctxt);
+}
+
 /****************************************************************************/
 static void run(void (*test)(void))
 {
@@ -845,10 +2374,36 @@ void memory_test(void)
   run(test_list_insert_chain);
   run(test_list_remove_chain);
   run(test_memory_initialize);
+  run(test_wilderness_carve);
   run(test_memory_allocate);
   run(test_memory_release);
   run(test_memory_available);
   run(test_memory_used);
+  run(test_memory_allocate_zeroed);
+  run(test_memory_allocate_wait);
+  run(test_memory_profile);
+  run(test_memory_snapshot_write);
+  run(test_memory_latency);
+  run(test_memory_usable_size);
+#ifndef MEMORY_NO_TIERS
+  run(test_memory_tiers);
+#endif
+  run(test_memory_allocate_hint);
+  run(test_memory_allocate_near);
+  run(test_memory_io);
+  run(test_memory_bitmap);
+  run(test_memory_ring);
+  run(test_memory_ref);
+  run(test_memory_retire);
+  run(test_thread_cache);
+  run(test_remote_free_queue);
+  run(test_cpu_caches);
+  run(test_memory_handles);
+  run(test_memory_compact);
+  run(test_memory_allocate_iov);
+  run(test_memory_shared);
+  run(test_segment_is_consistent);
+  run(test_memory_persistent);
   run(test_list_print);
   run(test_list_print_reverse);
 }
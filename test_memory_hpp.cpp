@@ -0,0 +1,274 @@
+/* Tests of memory.hpp, the C++ interface of the block heap.
+ *
+ * The tests of memory.c live in test.c, which main runs; this program does
+ * the same for memory_block_resource and memory_block_allocator. It prints
+ * its results in the format of test.c and fails when a test fails.
+ *
+ * The Makefile links this with memory.c compiled as for main, so the heap is
+ * HEAP_SIZE bytes of BLOCK_SIZE blocks.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <list>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "memory.hpp"
+
+#define TEST(ctxt, expr)                                              \
+  if ( (expr) ) ctxt.success_count++, fprintf(stdout, ".");           \
+  else          ctxt.fail_count++,                                    \
+                fprintf(stderr, "%s:%d: Test '%s' failed\n",          \
+                        __FILE__, __LINE__, #expr);
+
+typedef struct context_s
+{
+  const char *name;
+  int success_count;
+  int fail_count;
+} context_t;
+
+/* Number of failed tests of all contexts */
+static int failures = 0;
+
+static context_t new_context(const char *name)
+{
+  fprintf(stdout,
+  "  ------------------------------------------------------------------\n");
+  fprintf(stdout, "  %s\n  ", name);
+
+  memory_initialize();
+
+  return context_t { name, 0, 0 };
+}
+
+static void print_summary(const context_t &ctxt)
+{
+  float ratio = 1;
+
+  if ((ctxt.success_count + ctxt.fail_count) > 0)
+  {
+    ratio = (float)
+      ctxt.success_count / (ctxt.success_count + ctxt.fail_count);
+  }
+
+  fprintf(stdout, "\n");
+  fprintf(stdout,
+      "  ratio=%.2f (pass=%02d fail=%02d)\n",
+      ratio,
+      ctxt.success_count,
+      ctxt.fail_count);
+
+  failures += ctxt.fail_count;
+}
+
+/* An upstream resource that counts its calls and forwards them to operator
+ * new, so a test can tell which requests left the block heap.
+ */
+class counting_resource : public std::pmr::memory_resource
+{
+public:
+  size_t allocations = 0;
+  size_t deallocations = 0;
+
+private:
+  void *do_allocate(size_t bytes, size_t alignment) override
+  {
+    allocations++;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void *ptr, size_t bytes, size_t alignment) override
+  {
+    deallocations++;
+    std::pmr::new_delete_resource()->deallocate(ptr, bytes, alignment);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+    noexcept override
+  {
+    return this == &other;
+  }
+};
+
+/****************************************************************************/
+static void test_upstream_alignment()
+{
+  context_t ctxt = new_context("upstream_alignment");
+
+  counting_resource upstream;
+  memory_block_resource resource(&upstream);
+  TEST(ctxt, resource.upstream_resource() == &upstream);
+
+  /* Blocks are only aligned on MEMORY_ALIGNMENT */
+  void *ptr = resource.allocate(16, MEMORY_ALIGNMENT);
+  TEST(ctxt, memory_contains(ptr));
+  TEST(ctxt, upstream.allocations == 0);
+  resource.deallocate(ptr, 16, MEMORY_ALIGNMENT);
+  TEST(ctxt, upstream.deallocations == 0);
+
+  /* A stricter alignment goes to upstream, and so does its release */
+  size_t alignment = 2 * MEMORY_ALIGNMENT;
+  ptr = resource.allocate(16, alignment);
+  TEST(ctxt, !memory_contains(ptr));
+  TEST(ctxt, ((uintptr_t) ptr % alignment) == 0);
+  TEST(ctxt, upstream.allocations == 1);
+  resource.deallocate(ptr, 16, alignment);
+  TEST(ctxt, upstream.deallocations == 1);
+
+  memory_flush_thread_cache();
+  TEST(ctxt, memory_used() == 0);
+
+  print_summary(ctxt);
+}
+
+/****************************************************************************/
+static void test_zero_bytes()
+{
+  context_t ctxt = new_context("zero_bytes");
+
+  memory_block_resource resource;
+
+  /* A request of zero bytes still gets a unique block of the heap */
+  void *first = resource.allocate(0);
+  void *second = resource.allocate(0);
+  TEST(ctxt, memory_contains(first));
+  TEST(ctxt, memory_contains(second));
+  TEST(ctxt, first != second);
+  TEST(ctxt, memory_used() > 0);
+
+  resource.deallocate(first, 0);
+  resource.deallocate(second, 0);
+  memory_flush_thread_cache();
+  TEST(ctxt, memory_used() == 0);
+
+  print_summary(ctxt);
+}
+
+/* Returns whether resource throws std::bad_alloc for a request of bytes. */
+static bool throws_bad_alloc(std::pmr::memory_resource &resource,
+                             size_t bytes)
+{
+  try
+  {
+    void *ptr = resource.allocate(bytes);
+    resource.deallocate(ptr, bytes);
+  }
+  catch (const std::bad_alloc &)
+  {
+    return true;
+  }
+
+  return false;
+}
+
+/****************************************************************************/
+static void test_bad_alloc()
+{
+  context_t ctxt = new_context("bad_alloc");
+
+  memory_block_resource resource;
+
+  /* Larger than the heap */
+  TEST(ctxt, throws_bad_alloc(resource, memory_available() + 1));
+
+  /* Larger than memory_allocate can ask for */
+  TEST(ctxt, throws_bad_alloc(resource, (size_t) UINT32_MAX + 1));
+
+  /* An exhausted heap */
+  uint32_t available = memory_available();
+  void *all = resource.allocate(available);
+  TEST(ctxt, memory_available() == 0);
+
+  TEST(ctxt, throws_bad_alloc(resource, 1));
+
+  resource.deallocate(all, available);
+  memory_flush_thread_cache();
+  TEST(ctxt, memory_used() == 0);
+
+  print_summary(ctxt);
+}
+
+/****************************************************************************/
+static void test_is_equal()
+{
+  context_t ctxt = new_context("is_equal");
+
+  counting_resource upstream1;
+  counting_resource upstream2;
+  memory_block_resource resource1a(&upstream1);
+  memory_block_resource resource1b(&upstream1);
+  memory_block_resource resource2(&upstream2);
+
+  /* Resources with the same upstream can release each other's memory */
+  TEST(ctxt, resource1a.is_equal(resource1b));
+  TEST(ctxt, resource1a == resource1b);
+  TEST(ctxt, !resource1a.is_equal(resource2));
+  TEST(ctxt, resource1a != resource2);
+  TEST(ctxt, !resource1a.is_equal(upstream1));
+  TEST(ctxt, !resource1a.is_equal(*std::pmr::new_delete_resource()));
+
+  memory_block_allocator<int> allocator1a(&resource1a);
+  memory_block_allocator<long> allocator1b(&resource1b);
+  memory_block_allocator<int> allocator2(&resource2);
+  TEST(ctxt, allocator1a.resource() == &resource1a);
+  TEST(ctxt, allocator1a == allocator1b);
+  TEST(ctxt, allocator1a != allocator2);
+  TEST(ctxt, memory_block_allocator<long>(allocator1a) == allocator1b);
+
+  print_summary(ctxt);
+}
+
+/****************************************************************************/
+static void test_containers()
+{
+  context_t ctxt = new_context("containers");
+
+  /* Every node and string takes a block; the heap has few of them */
+  memory_block_resource resource;
+  {
+    std::pmr::vector<uint32_t> vector(&resource);
+    std::pmr::list<std::pmr::string> list(&resource);
+
+    for (uint32_t i = 0; i < 4; i++)
+    {
+      vector.push_back(i);
+      std::string text = std::to_string(i) + " does not fit in place";
+      list.emplace_back(text.c_str());
+    }
+
+    TEST(ctxt, memory_contains(vector.data()));
+    TEST(ctxt, memory_contains(list.front().data()));
+    TEST(ctxt, vector.back() == 3);
+    TEST(ctxt, list.back().compare(0, 1, "3") == 0);
+    TEST(ctxt, memory_used() > 0);
+
+    memory_block_allocator<uint32_t> allocator(&resource);
+    std::vector<uint32_t, memory_block_allocator<uint32_t>> copy(
+        vector.begin(), vector.end(), allocator);
+    TEST(ctxt, memory_contains(copy.data()));
+    TEST(ctxt, std::equal(copy.begin(), copy.end(), vector.begin(),
+                          vector.end()));
+  }
+
+  memory_flush_thread_cache();
+  TEST(ctxt, memory_used() == 0);
+
+  print_summary(ctxt);
+}
+
+/****************************************************************************/
+int main()
+{
+  printf("Test results:\n");
+
+  test_upstream_alignment();
+  test_zero_bytes();
+  test_bad_alloc();
+  test_is_equal();
+  test_containers();
+
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}